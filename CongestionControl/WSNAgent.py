@@ -27,6 +27,20 @@ model.compile(optimizer=tf.compat.v1.train.AdamOptimizer(0.001),    # 'adam'?
               metrics=['accuracy'])
 model.summary()
 
+def export_policy(model, path):
+    # Dense weights for the in-process evaluator (WSNPolicy in wsn-policy.cc)
+    dense = [l for l in model.layers if isinstance(l, keras.layers.Dense)]
+    with open(path, 'w') as f:
+        f.write("# WSNAgent dense policy\n")
+        f.write("layers {}\n".format(len(dense)))
+        for layer in dense:
+            kernel, bias = layer.get_weights()
+            f.write("dense {} {} {}\n".format(kernel.shape[0], kernel.shape[1],
+                                              layer.get_config()['activation']))
+            for row in kernel:
+                f.write(" ".join(repr(float(w)) for w in row) + "\n")
+            f.write(" ".join(repr(float(b)) for b in bias) + "\n")
+
 total_episodes = 100    # env resets after episode
 max_env_steps = 100     # max steps inside an episode
 env._max_episode_steps = max_env_steps
@@ -86,6 +100,9 @@ for e in range(total_episodes):
     time_history.append(time)
     rew_history.append(rewardsum)
     
+export_policy(model, 'wsn-policy.txt')
+print("Policy exported to wsn-policy.txt")
+
 print("Plot Learning Performance")
 mpl.rcdefaults()
 mpl.rcParams.update({'font.size': 16})
@@ -16,9 +16,17 @@
 #include "ns3/node-list.h"
 #include <math.h>
 #include "l2r-application.h"
+#include "l2r-aggregation-application.h"
 #include <iomanip>
 #include "ns3/opengym-module.h"
 #include "wsngym.h"
+#include "wsn-policy.h"
+#include "wsn-qlearning.h"
+#include <fstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <map>
+#include <algorithm>
 using namespace ns3;
 
 #define PI 3.14159265
@@ -28,6 +36,52 @@ NetDeviceContainer devContainer;
 LrWpanHelper lrWpanHelper;
 //Ptr<LrWpanCsmaCa> csmaCa = CreateObject<LrWpanCsmaCa> ();
 std::string CSVfileName = "CongestionControl.csv";
+std::string policyFile = "";
+std::string qAgent = "";
+std::string qTable = "wsn-qlearning.txt";
+std::string congestionFileName = "congestionVsTime_total.csv";
+double warmupTime = 0;
+uint32_t episodes = 1;
+uint32_t maxParallel = 1;
+std::string saveCheckpoint = "";
+double checkpointTime = 0;
+std::string loadCheckpoint = "";
+bool bootstrap = false;
+bool verifyBootstrap = false;
+bool profileEvents = false;
+bool directDispatch = false;
+bool dropNoRoute = false;
+bool pathRecord = false;
+std::string forwardingMode = "SinglePath";
+bool nlm = false;
+bool piggybackLoad = false;
+bool overhear = false;
+bool aggregation = false;
+bool dataAggregation = false;
+double aggPeriod = 1;
+bool adaptiveTcie = false;
+uint32_t tcieMin = 5;
+uint32_t tcieMax = 120;
+bool linkEstimation = false;
+uint32_t parentMargin = 0;
+double parentDwell = 0;
+uint32_t diagRate = 10;
+std::string runProfile = "default";
+bool lean = false;
+uint32_t diagSample = 1000;
+double animInterval = 0;
+/// Animation state of one node, found by its MAC address
+struct AnimNode
+{
+  uint32_t id;      ///< node id in the animation
+  Time last;        ///< time of the last update written
+  bool updated;     ///< an update was written
+  bool pending;     ///< a throttled update waits for FlushAnimNode
+  uint16_t depth;   ///< latest depth
+  uint16_t pqm;     ///< latest PQM
+};
+std::map<Mac16Address, AnimNode> animNodes;
+void BuildAnimIndex ();
 void modify (const Mac16Address &sender,const uint16_t &depth, const uint16_t &pqm,const Mac16Address &receiver);
 /// RGB structure
 struct rgb {
@@ -67,7 +121,7 @@ static void congestionVsTime ()
     
   }
   //avgDroppedPacket /= (50-1);
-  std::ofstream out2 ("congestionVsTime_total.csv", std::ios::app);
+  std::ofstream out2 (congestionFileName.c_str (), std::ios::app);
   out2 << timeNow << "," << avgDroppedPacket
       << std::endl; 
   out2.close ();
@@ -86,6 +140,26 @@ static void ReceivePacket (MeshRootData para,Mac16Address srcAddress)
       << "," << para.m_arrivalRate << "," << para.m_avgDelay << std::endl;
   out.close ();
 }
+static Ptr<OpenGymInterface> CreateGymInterface (uint32_t port, Ptr<WSNGym> gym)
+{
+  Ptr<OpenGymInterface> openGymInterface = CreateObject<OpenGymInterface> (port);
+  gym->SetOpenGymInterface (openGymInterface);
+
+  openGymInterface->SetGetActionSpaceCb( MakeCallback (&WSNGym::GetActionSpace, gym));
+  openGymInterface->SetGetObservationSpaceCb( MakeCallback (&WSNGym::GetObservationSpace, gym));
+  openGymInterface->SetGetGameOverCb( MakeCallback (&WSNGym::GetGameOver, gym));
+  openGymInterface->SetGetObservationCb( MakeCallback (&WSNGym::GetObservation, gym));
+  openGymInterface->SetGetRewardCb( MakeCallback (&WSNGym::GetReward, gym));
+  openGymInterface->SetGetExtraInfoCb( MakeCallback (&WSNGym::GetExtraInfo, gym));
+  openGymInterface->SetExecuteActionsCb( MakeCallback (&WSNGym::ExecuteActions, gym));
+  return openGymInterface;
+}
+static void VerifyBootstrap (uint32_t rootIndex, double range)
+{
+  uint32_t mismatches = LrWpanHelper::VerifyL2rBootstrap (devContainer, rootIndex, range, std::cout);
+  std::cout << Simulator::Now ().GetSeconds () << "s: discovered tree has " << mismatches
+            << " mismatches with the bootstrap tree" << std::endl;
+}
 void ScheduleNextStateRead(double envStepTime, Ptr<OpenGymInterface> openGymInterface)
 {
   Simulator::Schedule (Seconds(envStepTime), &ScheduleNextStateRead, envStepTime, openGymInterface);
@@ -134,6 +208,8 @@ private:
   bool m_enableTracing;
   bool m_enablePcap;
   uint32_t m_meshNodeId;
+  std::vector<uint32_t> m_sinkIds; ///< all mesh roots, m_meshNodeId first
+  double m_txRange; ///< range of the propagation loss model (m)
   Ptr<SingleModelSpectrumChannel> channel;
   NodeContainer ch;
   uint32_t m_distanceBtwNodes;
@@ -141,7 +217,11 @@ private:
   uint64_t m_maxTxBytePerNode;
   uint16_t m_maxQueueSize;
   double m_sensingPeriod;
-  static uint64_t m_totalPhyDrop;
+  Ptr<OutputStreamWrapper> m_traceStream;
+  Ptr<OutputStreamWrapper> m_routingStream;
+  Ptr<OutputStreamWrapper> m_routeTree;
+  std::string m_traceName; ///< file name prefix of the trace streams
+  Ptr<L2rAggregationApplication> m_aggregationSink;
   //l2rapplication m_applicationContainer;
 
 private:
@@ -167,7 +247,24 @@ private:
    */
   ///check Throughput
   void CheckThroughput ();
-  static void PhyRxDrop (CongestionControl *cc,Ptr<LrWpanNetDevice> device, Ptr<const Packet> packet);
+  /// Print the per node and network wide counters at the end of a run
+  void PrintResults (Ptr<WSNGym> gym, Ptr<WSNPolicy> policy, Ptr<WSNQLearning> agent);
+  /**
+   * Run to the warm-up time, then fork one child per episode that
+   * continues from the converged network with its own RNG run and gym port.
+   * With a Q-learning agent the episodes run one after the other, each
+   * starting from the table the previous one saved.
+   */
+  void RunEpisodes (Ptr<WSNGym> gym, Ptr<WSNPolicy> policy, Ptr<WSNQLearning> agent, uint32_t openGymPort);
+  /// Flush buffered output so a fork does not write it twice
+  void FlushStreams ();
+  /**
+   * Move the trace and route streams of a forked episode to their own files
+   * \param suffix appended to the file names
+   */
+  void ReopenStreams (std::string suffix);
+  /// \returns true if the node is one of the mesh roots
+  bool IsSinkNode (uint32_t nodeId) const;
 
 };
 int main (int argc, char *argv[])
@@ -194,11 +291,71 @@ int main (int argc, char *argv[])
   cmd.AddValue ("printRoutingTable", "print routing table for nodes[Default:1]", printRoutingTable);
   cmd.AddValue ("CSVfileName", "The name of the CSV output file name[Default:CongestionControl.csv]", CSVfileName);
   cmd.AddValue ("meshNodeId", "The node which will be the mesh root[Default:0]", meshNodeId);
+  cmd.AddValue ("nSinks", "Number of mesh roots, spread over the node ids from meshNodeId[Default:1]", nSinks);
   cmd.AddValue ("verbose", "turn on all log components", verbose);
   cmd.AddValue ("enableTracing", "Output Tracing file[Default:0]", enableTracing);
   cmd.AddValue ("Enable Pcap", "Output Pcap packet tracing file[Default:0]", enablePcap);
   cmd.AddValue ("distanceBtwNodes", "Distance Between Nodes[Default:80]", distanceBtwNodes);
+  cmd.AddValue ("policyFile", "Weights exported by WSNAgent.py; run the trained agent in-process instead of over the gym[Default:none]", policyFile);
+  cmd.AddValue ("qAgent", "Train the native Q-learning agent: tabular or linear[Default:none]", qAgent);
+  cmd.AddValue ("qTable", "Table the native agent loads and saves[Default:wsn-qlearning.txt]", qTable);
+  cmd.AddValue ("warmupTime", "Fork episodes from the network state at this time, 0 disables[Default:0]", warmupTime);
+  cmd.AddValue ("episodes", "Number of episodes forked after warmupTime[Default:1]", episodes);
+  cmd.AddValue ("maxParallel", "Maximum number of episodes running at once, 1 with qAgent[Default:1]", maxParallel);
+  cmd.AddValue ("saveCheckpoint", "Save the converged L2R state to this file at checkpointTime[Default:none]", saveCheckpoint);
+  cmd.AddValue ("checkpointTime", "Time at which saveCheckpoint is written[Default:dataStart]", checkpointTime);
+  cmd.AddValue ("loadCheckpoint", "Start from a saved L2R state instead of topology discovery[Default:none]", loadCheckpoint);
+  cmd.AddValue ("bootstrap", "Install the L2R tree computed from node positions instead of topology discovery[Default:0]", bootstrap);
+  cmd.AddValue ("verifyBootstrap", "Compare the discovered tree with the computed one at checkpointTime[Default:0]", verifyBootstrap);
+  cmd.AddValue ("profileEvents", "Report scheduled events and handler wall time per call site[Default:0]", profileEvents);
+  cmd.AddValue ("directDispatch", "Run zero-delay L2R continuations without scheduling an event[Default:0]", directDispatch);
+  cmd.AddValue ("dropNoRoute", "Drop data frames with no next hop instead of sending them to 00:00[Default:0]", dropNoRoute);
+  cmd.AddValue ("pathRecord", "Record the queue, CSMA/CA and retries of every hop of data packets[Default:0]", pathRecord);
+  cmd.AddValue ("forwardingMode", "Next hop of data frames: SinglePath, Multipath (weighted round-robin over the ancestors within the LQT) or Backpressure (largest queue differential)[Default:SinglePath]", forwardingMode);
+  cmd.AddValue ("nlm", "Broadcast an NLM-IE when the queue crosses its high or low watermark[Default:0]", nlm);
+  cmd.AddValue ("piggybackLoad", "Carry the PQM and queue of every hop in data frames[Default:0]", piggybackLoad);
+  cmd.AddValue ("overhear", "Refresh neighbor metrics from data frames addressed to other nodes[Default:0]", overhear);
+  cmd.AddValue ("aggregation", "Pack data frames for the same next hop into one frame at forwarders[Default:0]", aggregation);
+  cmd.AddValue ("dataAggregation", "Send one min/max/mean/count record per subtree and period instead of raw packets[Default:0]", dataAggregation);
+  cmd.AddValue ("aggPeriod", "Seconds between two readings with dataAggregation[Default:1]", aggPeriod);
+  cmd.AddValue ("adaptiveTcie", "Let the mesh root shrink the TC-IE interval on topology churn and grow it when stable[Default:0]", adaptiveTcie);
+  cmd.AddValue ("tcieMin", "Shortest TC-IE interval in seconds with adaptiveTcie[Default:5]", tcieMin);
+  cmd.AddValue ("tcieMax", "Longest TC-IE interval in seconds with adaptiveTcie[Default:120]", tcieMax);
+  cmd.AddValue ("linkEstimation", "Add the measured ETX and LQI of every link to its LQM[Default:0]", linkEstimation);
+  cmd.AddValue ("parentMargin", "PQM by which a neighbor must beat the current parent to replace it[Default:0]", parentMargin);
+  cmd.AddValue ("parentDwell", "Seconds a parent is kept before a better neighbor can replace it[Default:0]", parentDwell);
+  cmd.AddValue ("diagRate", "MAC diagnostics of each kind printed per simulated second[Default:10]", diagRate);
+  cmd.AddValue ("diagSample", "Over diagRate print one MAC diagnostic in this many, 0 for none[Default:1000]", diagSample);
+  cmd.AddValue ("animInterval", "Minimum simulated seconds between two animation updates of a node, 0 for none[Default:0]", animInterval);
+  cmd.AddValue ("runProfile", "default, or lean: no packet metadata, animation, routing table dumps or text traces[Default:default]", runProfile);
   cmd.Parse (argc, argv);
+  if (runProfile != "default" && runProfile != "lean")
+  {
+    NS_FATAL_ERROR ("Unknown runProfile " << runProfile);
+  }
+  lean = runProfile == "lean";
+  if (lean)
+  {
+    printRoutingTable = false;
+    enableTracing = false;
+  }
+  LrWpanEventProfiler::Enable (profileEvents);
+  LrWpanDiagChannel::Configure (diagRate, diagSample);
+  Config::SetDefault ("ns3::LrWpanMac::PathRecord", BooleanValue (pathRecord));
+  Config::SetDefault ("ns3::LrWpanMac::ForwardingMode", StringValue (forwardingMode));
+  Config::SetDefault ("ns3::LrWpanMac::NlmEnabled", BooleanValue (nlm));
+  Config::SetDefault ("ns3::LrWpanMac::PiggybackLoad", BooleanValue (piggybackLoad));
+  Config::SetDefault ("ns3::LrWpanMac::Overhear", BooleanValue (overhear));
+  Config::SetDefault ("ns3::LrWpanMac::Aggregation", BooleanValue (aggregation));
+  Config::SetDefault ("ns3::L2rAggregationApplication::Period", TimeValue (Seconds (aggPeriod)));
+  Config::SetDefault ("ns3::LrWpanMac::DirectDispatch", BooleanValue (directDispatch));
+  Config::SetDefault ("ns3::LrWpanMac::DropNoRoute", BooleanValue (dropNoRoute));
+  Config::SetDefault ("ns3::LrWpanMac::AdaptiveTcie", BooleanValue (adaptiveTcie));
+  Config::SetDefault ("ns3::LrWpanMac::TcieMinInterval", UintegerValue (tcieMin));
+  Config::SetDefault ("ns3::LrWpanMac::TcieMaxInterval", UintegerValue (tcieMax));
+  Config::SetDefault ("ns3::LrWpanMac::LinkEstimation", BooleanValue (linkEstimation));
+  Config::SetDefault ("ns3::LrWpanMac::ParentSwitchMargin", UintegerValue (parentMargin));
+  Config::SetDefault ("ns3::LrWpanMac::ParentMinDwell", TimeValue (Seconds (parentDwell)));
   //LogComponentEnable ("LrWpanMac", LOG_LEVEL_ALL);
   //LogComponentEnable ("LrWpanPhy", LOG_LEVEL_ALL);
   std::ofstream out (CSVfileName.c_str ());
@@ -245,14 +402,26 @@ CongestionControl::CaseRun(uint32_t nNodes, uint32_t nSinks,
   m_enableTracing = enableTracing;
   m_enablePcap = enablePcap;
   m_meshNodeId = meshNodeId;
+  if (m_nSinks == 0 || m_nSinks > m_nNodes)
+  {
+    NS_FATAL_ERROR ("nSinks must be within 1.." << m_nNodes);
+  }
+  if (dataAggregation && m_nSinks > 1)
+  {
+    NS_FATAL_ERROR ("dataAggregation supports a single mesh root");
+  }
+  m_sinkIds.clear ();
+  for (uint32_t k = 0; k < m_nSinks; k++)
+  {
+    m_sinkIds.push_back ((m_meshNodeId + k * m_nNodes / m_nSinks) % m_nNodes);
+  }
   m_distanceBtwNodes = distanceBtwNodes;
   m_packetSize = 20;
   m_maxTxBytePerNode = 0;
   m_maxQueueSize = 15;
   m_sensingPeriod = 2;
-  m_totalPhyDrop = 0;
   uint32_t openGymPort = 5555;
-  //double envStepTime = 0.5;
+  double envStepTime = 0.5;
 
   std::stringstream ss;
   ss << m_nNodes;
@@ -262,18 +431,10 @@ CongestionControl::CaseRun(uint32_t nNodes, uint32_t nSinks,
   std::string m_TotalTime = ss3.str ();
   std::string tr_name = "L2R_" + t_nodes + "Nodes_" + m_TotalTime + "SimTime";
   std::cout << "Trace file generated is " << tr_name << ".tr\n";
+  m_traceName = tr_name;
 
-  Ptr<OpenGymInterface> openGymInterface = CreateObject<OpenGymInterface>(openGymPort);
   Ptr<WSNGym> myWSNGym = CreateObject<WSNGym>();
-  myWSNGym->SetOpenGymInterface(openGymInterface);
-
-  openGymInterface->SetGetActionSpaceCb( MakeCallback (&WSNGym::GetActionSpace, myWSNGym));
-  openGymInterface->SetGetObservationSpaceCb( MakeCallback (&WSNGym::GetObservationSpace, myWSNGym));
-  openGymInterface->SetGetGameOverCb( MakeCallback (&WSNGym::GetGameOver, myWSNGym));
-  openGymInterface->SetGetObservationCb( MakeCallback (&WSNGym::GetObservation, myWSNGym));
-  openGymInterface->SetGetRewardCb( MakeCallback (&WSNGym::GetReward, myWSNGym));
-  openGymInterface->SetGetExtraInfoCb( MakeCallback (&WSNGym::GetExtraInfo, myWSNGym));
-  openGymInterface->SetExecuteActionsCb( MakeCallback (&WSNGym::ExecuteActions, myWSNGym));
+  Ptr<OpenGymInterface> openGymInterface = CreateGymInterface (openGymPort, myWSNGym);
 
   CreateNodes ();
   SetupMobility ();
@@ -311,29 +472,85 @@ CongestionControl::CaseRun(uint32_t nNodes, uint32_t nSinks,
     }
     std::cout << "Data Rate: " << d->GetObject<LrWpanNetDevice> ()->GetPhy ()->GetDataOrSymbolRate(true) <<std::endl;*/
   InstallApplications ();
-  Ptr<OutputStreamWrapper> routeTree = Create<OutputStreamWrapper> ((tr_name + "_routeTree" + ".routes"), std::ios::out);
+  if (!lean)
+  {
+    m_routeTree = Create<OutputStreamWrapper> ((tr_name + "_routeTree" + ".routes"), std::ios::out);
+  }
   for (NetDeviceContainer::Iterator i= devContainer.Begin(); i != devContainer.End (); i++)
   {
     Ptr<NetDevice> d = *i;
     Ptr<LrWpanNetDevice> device = d->GetObject<LrWpanNetDevice> ();
-    device->GetMac ()->outputRoutesTree(routeTree);
+    if (m_routeTree)
+    {
+      device->GetMac ()->outputRoutesTree(m_routeTree);
+    }
     uint32_t nodeID = d->GetNode ()->GetId ();
     if(nodeID == meshNodeId)
     {
       myWSNGym->GetCongestionParams(device->GetMac()->m_meshRootData);
     }
   }
+  Ptr<WSNPolicy> policy;
+  if (!policyFile.empty ())
+  {
+    policy = CreateObject<WSNPolicy> ();
+    if (!policy->Load (policyFile))
+    {
+      NS_FATAL_ERROR ("Can not load policy from " << policyFile);
+    }
+    policy->Start (myWSNGym, Seconds (5.0), Seconds (envStepTime));
+  }
+  Ptr<WSNQLearning> agent;
+  if (policy == 0 && !qAgent.empty ())
+  {
+    if (qAgent != "tabular" && qAgent != "linear")
+    {
+      NS_FATAL_ERROR ("Unknown qAgent mode " << qAgent);
+    }
+    agent = CreateObject<WSNQLearning> ();
+    agent->SetAttribute ("Mode", EnumValue (qAgent == "tabular" ? WSNQLearning::TABULAR : WSNQLearning::LINEAR));
+    agent->SetAttribute ("TableFile", StringValue (qTable));
+    agent->Start (myWSNGym, Seconds (5.0), Seconds (envStepTime));
+  }
+  bool forkEpisodes = warmupTime > 0 && warmupTime < m_totalTime;
   std::string animFile = tr_name + ".xml";
-  pAnim = new AnimationInterface (animFile); //Mandatory
+  if (!forkEpisodes && !lean)
+  {
+    // A single animation trace can not follow several forked episodes
+    pAnim = new AnimationInterface (animFile); //Mandatory
+    BuildAnimIndex ();
+  }
   //pAnim->EnablePacketMetadata (); //Optional
   //Simulator::Schedule(Seconds(5.0), &ScheduleNextStateRead, envStepTime, openGymInterface);
-  Simulator::Stop (Seconds (m_totalTime));
-  Simulator::Schedule(Seconds(m_dataStart + 1),congestionVsTime);
-  Simulator::Run ();
+  if (!lean)
+  {
+    Simulator::Schedule(Seconds(m_dataStart + 1),congestionVsTime);
+  }
+  if (forkEpisodes)
+  {
+    RunEpisodes (myWSNGym, policy, agent, openGymPort);
+  }
+  else
+  {
+    Simulator::Stop (Seconds (m_totalTime));
+    Simulator::Run ();
+    if (pAnim)
+    {
+      std::cout << "Animation Trace file created:" << animFile.c_str ()<< std::endl;
+    }
+    PrintResults (myWSNGym, policy, agent);
+  }
+  Simulator::Destroy ();
+  //m_applicationContainer->TotalPacketPrint();
+  delete pAnim;
+  pAnim = 0;
+}
+void
+CongestionControl::PrintResults (Ptr<WSNGym> gym, Ptr<WSNPolicy> policy, Ptr<WSNQLearning> agent)
+{
   uint32_t totalPacketSent = 0;
   uint32_t totalPacketDroped = 0;
   uint32_t internalLoad = 0;
-  std::cout << "Animation Trace file created:" << animFile.c_str ()<< std::endl;
   for(uint32_t i = 1; i < m_nNodes; i++)
   {
     //Ptr<l2rapplication> app = ch.Get (i)->GetApplication(0)->GetObject<l2rapplication> ();
@@ -350,12 +567,184 @@ CongestionControl::CaseRun(uint32_t nNodes, uint32_t nSinks,
   std::cout << "Total Packet Sent By All Nodes = " << totalPacketSent  <<std::endl
             << "Total Packet Dropped By All Nodes (Congestion) = " << totalPacketDroped <<std::endl
             << "Total Internal Load: " << internalLoad << std::endl;
-  std::cout << "Total Packet Received by Sink = " 
-            << ch.Get(m_meshNodeId)->GetDevice (0)->GetObject<LrWpanNetDevice> ()->GetMac ()->GetTotalPacketRxByMeshRoot() << std::endl;
-  myWSNGym->NotifySimulationEnd();
-  Simulator::Destroy ();
-  //m_applicationContainer->TotalPacketPrint();
-  delete pAnim;
+  uint32_t totalPacketReceived = 0;
+  for (std::vector<uint32_t>::const_iterator s = m_sinkIds.begin (); s != m_sinkIds.end (); ++s)
+  {
+    totalPacketReceived += ch.Get(*s)->GetDevice (0)->GetObject<LrWpanNetDevice> ()->GetMac ()->GetTotalPacketRxByMeshRoot();
+  }
+  std::cout << "Total Packet Received by Sink = " << totalPacketReceived << std::endl;
+  if (adaptiveTcie)
+  {
+    for (std::vector<uint32_t>::const_iterator s = m_sinkIds.begin (); s != m_sinkIds.end (); ++s)
+    {
+      Ptr<LrWpanMac> mac = ch.Get(*s)->GetDevice (0)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      std::cout << "TC-IE interval of sink " << *s << " = " << static_cast<uint32_t> (mac->GetTcieInterval ())
+                << "s after " << mac->GetTcieAdaptations () << " changes" << std::endl;
+    }
+  }
+  if (m_sinkIds.size () > 1)
+  {
+    LrWpanHelper::PrintL2rRoots (devContainer, std::cout);
+  }
+  LrWpanHelper::PrintL2rCounters (devContainer, std::cout);
+  LrWpanHelper::PrintL2rParentShare (devContainer, std::cout);
+  LrWpanHelper::PrintL2rParentChanges (devContainer, std::cout);
+  if (linkEstimation)
+  {
+    LrWpanHelper::PrintL2rLinks (devContainer, std::cout);
+  }
+  LrWpanHelper::PrintL2rDrops (devContainer, std::cout);
+  if (m_aggregationSink)
+  {
+    m_aggregationSink->PrintReport (std::cout);
+  }
+  LrWpanDiagChannel::Report (std::cout);
+  if (pathRecord)
+  {
+    ch.Get(m_meshNodeId)->GetDevice (0)->GetObject<LrWpanNetDevice> ()->GetMac ()->PrintPathBreakdown (std::cout);
+  }
+  if (LrWpanEventProfiler::IsEnabled ())
+  {
+    LrWpanEventProfiler::Report (std::cout);
+  }
+  if (policy)
+  {
+    std::cout << "Policy Steps = " << policy->GetNSteps ()
+              << "\tTotal Reward = " << policy->GetTotalReward () << std::endl;
+  }
+  else if (agent)
+  {
+    agent->Save ();
+    std::cout << "Agent Steps = " << agent->GetNSteps ()
+              << "\tTotal Reward = " << agent->GetTotalReward ()
+              << "\tEpsilon = " << agent->GetEpsilon () << std::endl;
+  }
+  else
+  {
+    gym->NotifySimulationEnd();
+  }
+}
+void
+CongestionControl::FlushStreams ()
+{
+  std::cout.flush ();
+  std::cerr.flush ();
+  if (m_traceStream)
+    m_traceStream->GetStream ()->flush ();
+  if (m_routingStream)
+    m_routingStream->GetStream ()->flush ();
+  if (m_routeTree)
+    m_routeTree->GetStream ()->flush ();
+}
+void
+CongestionControl::ReopenStreams (std::string suffix)
+{
+  // The devices hold on to the stream objects, so swap the file underneath
+  Ptr<OutputStreamWrapper> streams[] = {m_traceStream, m_routingStream, m_routeTree};
+  std::string names[] = {".tr", ".routes", "_routeTree.routes"};
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    if (!streams[i])
+      continue;
+    std::ofstream *file = dynamic_cast<std::ofstream *> (streams[i]->GetStream ());
+    if (file)
+    {
+      file->close ();
+      file->open ((m_traceName + names[i] + suffix).c_str (), std::ios::out);
+    }
+  }
+}
+void
+CongestionControl::RunEpisodes (Ptr<WSNGym> gym, Ptr<WSNPolicy> policy, Ptr<WSNQLearning> agent, uint32_t openGymPort)
+{
+  Simulator::Stop (Seconds (warmupTime));
+  Simulator::Run ();
+  std::cout << "Warm-up finished at " << Simulator::Now ().GetSeconds ()
+            << "s, forking " << episodes << " episodes" << std::endl;
+
+  uint32_t baseRun = RngSeedManager::GetRun ();
+  // Each episode of an agent trains on from the table of the previous one
+  uint32_t parallel = agent ? 1 : std::max<uint32_t> (maxParallel, 1);
+  uint32_t running = 0;
+  uint32_t failed = 0;
+  for (uint32_t episode = 0; episode < episodes; episode++)
+  {
+    if (running >= parallel)
+    {
+      int status;
+      if (wait (&status) > 0)
+      {
+        --running;
+        failed += !(WIFEXITED (status) && WEXITSTATUS (status) == 0);
+      }
+    }
+    FlushStreams ();
+    pid_t pid = fork ();
+    if (pid < 0)
+    {
+      NS_FATAL_ERROR ("fork failed for episode " << episode);
+    }
+    if (pid > 0)
+    {
+      ++running;
+      continue;
+    }
+
+    // Child: everything below runs on a copy-on-write image of the warmed-up network
+    std::ostringstream suffix;
+    suffix << ".ep" << episode;
+    CSVfileName += suffix.str ();
+    congestionFileName += suffix.str ();
+    ReopenStreams (suffix.str ());
+    // Streams created from now on draw from the new run; re-seed the existing ones too
+    RngSeedManager::SetRun (baseRun + 1 + episode);
+    int64_t stream = 0;
+    stream += lrWpanHelper.AssignStreams (devContainer, stream);
+    for (uint32_t i = 0; i < ch.GetN (); i++)
+    {
+      if (i == m_meshNodeId || ch.Get (i)->GetNApplications () == 0)
+        continue;
+      Ptr<Application> app = ch.Get (i)->GetApplication (0);
+      if (DynamicCast<l2rapplication> (app))
+        stream += DynamicCast<l2rapplication> (app)->AssignStreams (stream);
+      else
+        stream += DynamicCast<L2rAggregationApplication> (app)->AssignStreams (stream);
+    }
+    if (agent)
+    {
+      if (episode > 0)
+      {
+        std::ostringstream previous;
+        previous << qTable << ".ep" << episode - 1;
+        agent->SetAttribute ("TableFile", StringValue (previous.str ()));
+        if (!agent->Load ())
+        {
+          std::cout << "Episode " << episode << " can not load " << previous.str ()
+                    << ", starting from the warm-up table" << std::endl;
+        }
+      }
+      agent->SetAttribute ("TableFile", StringValue (qTable + suffix.str ()));
+      stream += agent->AssignStreams (stream);
+    }
+    CreateGymInterface (openGymPort + 1 + episode, gym);
+
+    Simulator::Stop (Seconds (m_totalTime) - Simulator::Now ());
+    Simulator::Run ();
+    std::cout << "Episode " << episode << " (run " << RngSeedManager::GetRun () << ")" << std::endl;
+    PrintResults (gym, policy, agent);
+    Simulator::Destroy ();
+    FlushStreams ();
+    _exit (0);
+  }
+  while (running > 0)
+  {
+    int status;
+    if (wait (&status) <= 0)
+      break;
+    --running;
+    failed += !(WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  }
+  std::cout << "Episodes finished = " << episodes << "\tFailed = " << failed << std::endl;
 }
 void 
 CongestionControl::CreateNodes()
@@ -408,6 +797,9 @@ CongestionControl::CreateDevices (std::string tr_name)
   channel = CreateObject<SingleModelSpectrumChannel> ();
   //Ptr<LogDistancePropagationLossModel> propModel = CreateObject<LogDistancePropagationLossModel> ();
   Ptr<RangePropagationLossModel> propModel = CreateObject<RangePropagationLossModel> ();
+  DoubleValue maxRange;
+  propModel->GetAttribute ("MaxRange", maxRange);
+  m_txRange = maxRange.Get ();
 
   //Ptr<ConstantSpeedPropagationDelayModel> delayModel = CreateObject<ConstantSpeedPropagationDelayModel> ();
   channel->AddPropagationLossModel (propModel);
@@ -427,7 +819,6 @@ CongestionControl::CreateDevices (std::string tr_name)
     Ptr<NetDevice> d = *i;
     Ptr<LrWpanNetDevice> device = d->GetObject<LrWpanNetDevice> ();
     uint32_t nodeID = d->GetNode ()->GetId ();
-    device->GetPhy ()->TraceConnectWithoutContext ("PhyRxDrop", MakeBoundCallback (&CongestionControl::PhyRxDrop, this, device));
     temp++; 
     //uint32_t nodeID = d->GetNode ()->GetId ();
     device->GetMac ()->SetMaxQueueSize(m_maxQueueSize);
@@ -444,7 +835,7 @@ CongestionControl::CreateDevices (std::string tr_name)
     device->GetMac ()->SetMcpsDataIndicationCallback (cb1);
     cb3 = MakeCallback (&L2rUpdateTcie);
     device->GetMac ()->SetL2rReceiveUpdateCallback(cb3);
-    if(nodeID == m_meshNodeId)
+    if(IsSinkNode (nodeID))
       {
         meshRootRxMsgCallback cb2;
         cb2 = MakeCallback (&ReceivePacket);
@@ -456,23 +847,57 @@ CongestionControl::CreateDevices (std::string tr_name)
   {
     // Tracing
     AsciiTraceHelper ascii;
-    Ptr<OutputStreamWrapper> stream = ascii.CreateFileStream (tr_name + ".tr");
-    lrWpanHelper.EnableAsciiAll (stream);
+    m_traceStream = ascii.CreateFileStream (tr_name + ".tr");
+    lrWpanHelper.EnableAsciiAll (m_traceStream);
   }
   if(m_enablePcap == true)
     lrWpanHelper.EnablePcapAll (std::string (tr_name), true);
-  Packet::EnablePrinting ();
-  devContainer.Get(m_meshNodeId)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_AssignL2RProtocolForSink(true, 0xffff, m_periodicUpdateInterval);
-  devContainer.Get(m_meshNodeId)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_SendTopologyDiscovery();
+  if (!lean)
+  {
+    Packet::EnablePrinting ();
+  }
+  if (!loadCheckpoint.empty ())
+  {
+    // The checkpoint already holds the sink role and the converged tree
+    lrWpanHelper.LoadL2rCheckpoint (devContainer, loadCheckpoint);
+  }
+  else if (bootstrap)
+  {
+    lrWpanHelper.BootstrapL2r (devContainer, m_sinkIds, m_txRange, 0xffff, m_periodicUpdateInterval);
+  }
+  else
+  {
+    // Every root floods its own discovery; nodes join the first one heard
+    for (std::vector<uint32_t>::const_iterator s = m_sinkIds.begin (); s != m_sinkIds.end (); ++s)
+    {
+      devContainer.Get(*s)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_AssignL2RProtocolForSink(true, 0xffff, m_periodicUpdateInterval);
+      devContainer.Get(*s)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_SendTopologyDiscovery();
+    }
+  }
+  if (verifyBootstrap && m_sinkIds.size () > 1)
+  {
+    NS_FATAL_ERROR ("verifyBootstrap supports a single mesh root");
+  }
+  if (verifyBootstrap)
+  {
+    Simulator::Schedule (Seconds (checkpointTime > 0 ? checkpointTime : m_dataStart),
+                         &VerifyBootstrap, m_meshNodeId, m_txRange);
+  }
+  if (!saveCheckpoint.empty ())
+  {
+    double saveAt = checkpointTime > 0 ? checkpointTime : m_dataStart;
+    Simulator::Schedule (Seconds (saveAt), &LrWpanHelper::SaveL2rCheckpoint, &lrWpanHelper,
+                         devContainer, saveCheckpoint);
+  }
   if (m_printRoutingTable)
   {
-    Ptr<OutputStreamWrapper> routingStream = Create<OutputStreamWrapper> ((tr_name + ".routes"), std::ios::out);
+    m_routingStream = Create<OutputStreamWrapper> ((tr_name + ".routes"), std::ios::out);
     for (NetDeviceContainer::Iterator i= devContainer.Begin(); i != devContainer.End (); i++)
     { 
       Ptr<NetDevice> d = *i;
       Ptr<LrWpanNetDevice> device = d->GetObject<LrWpanNetDevice> ();
       Simulator::Schedule (Seconds(1.01), &LrWpanMac::PrintRoutingTable,device->GetMac (),
-                          d->GetNode(), routingStream,Time::S);
+                          d->GetNode(), m_routingStream,Time::S);
     }  
   }
   if (verbose)
@@ -481,15 +906,38 @@ CongestionControl::CreateDevices (std::string tr_name)
   }
   //End of the CreateDevice function
 }
+bool
+CongestionControl::IsSinkNode (uint32_t nodeId) const
+{
+  return std::find (m_sinkIds.begin (), m_sinkIds.end (), nodeId) != m_sinkIds.end ();
+}
 void
 CongestionControl::InstallApplications()
 {  
 
   uint8_t temp = 0;
+  if (dataAggregation)
+  {
+    m_aggregationSink = CreateObject<L2rAggregationApplication> ();
+    ch.Get (m_meshNodeId)->AddApplication (m_aggregationSink);
+    m_aggregationSink->Setup (devContainer.Get (m_meshNodeId), 0);
+    for (NetDeviceContainer::Iterator i= devContainer.Begin(); i != devContainer.End (); i++)
+    {
+      Ptr<NetDevice> d = *i;
+      if(d->GetNode()->GetId () == m_meshNodeId)
+        continue;
+      Ptr<L2rAggregationApplication> app = CreateObject<L2rAggregationApplication> ();
+      d->GetNode ()->AddApplication (app);
+      app->Setup (d, m_aggregationSink);
+      app->SetStartTime (Seconds (m_dataStart));
+      app->SetStopTime (Seconds (m_totalTime));
+    }
+    return;
+  }
   for (NetDeviceContainer::Iterator i= devContainer.Begin(); i != devContainer.End (); i++)
   {
     Ptr<NetDevice> d = *i;
-    if(d->GetNode()->GetId () == m_meshNodeId)
+    if(IsSinkNode (d->GetNode()->GetId ()))
       continue;
     Ptr<ConstantRandomVariable> rvg = CreateObject<ConstantRandomVariable> ();
     Ptr<UniformRandomVariable> on = CreateObject<UniformRandomVariable> ();
@@ -540,50 +988,66 @@ CongestionControl::InstallApplications()
   
 }
 
-void modify (const Mac16Address &sender,const uint16_t &depth, const uint16_t &pqm,const Mac16Address &receiver)
+void BuildAnimIndex ()
 {
-  /*std::ostringstream oss;
-  oss << "Update:" << Simulator::Now ().GetSeconds ();
-  pAnim->UpdateLinkDescription (0, 1, oss.str ());
-  pAnim->UpdateLinkDescription (0, 2, oss.str ());
-  pAnim->UpdateLinkDescription (0, 3, oss.str ());
-  pAnim->UpdateLinkDescription (0, 4, oss.str ());
-  pAnim->UpdateLinkDescription (0, 5, oss.str ());
-  pAnim->UpdateLinkDescription (0, 6, oss.str ());
-  pAnim->UpdateLinkDescription (1, 7, oss.str ());
-  pAnim->UpdateLinkDescription (1, 8, oss.str ());
-  pAnim->UpdateLinkDescription (1, 9, oss.str ());
-  pAnim->UpdateLinkDescription (1, 10, oss.str ());
-  pAnim->UpdateLinkDescription (1, 11, oss.str ());
-  */
-  std::ostringstream node0Oss;
-  /*static uint32_t index = 0;
-  index = depth %3;
-  struct rgb color = colors[index];*/
-  uint32_t nodeID;
+  animNodes.clear ();
   for (NetDeviceContainer::Iterator i= devContainer.Begin(); i != devContainer.End (); i++)
-  {  
+  {
     Ptr<NetDevice> d = *i;
-    Ptr<LrWpanNetDevice> device = d->GetObject<LrWpanNetDevice> ();
-    nodeID = d->GetNode ()->GetId ();
-    pAnim->UpdateNodeSize(nodeID, 15,15);
-    if(receiver == device->GetAddress ())
-    {
-      node0Oss << nodeID <<"," << depth <<"," << pqm <<"," << receiver;
-      // Every update change the node description for nodes
-      pAnim->UpdateNodeDescription (nodeID, node0Oss.str ());
-      // Every update change the color for nodes if receive update from mesh Root
-      pAnim->UpdateNodeColor (nodeID, colors[depth].r, colors[depth].g,colors[depth].b); 
-    }
-  } 
+    AnimNode node;
+    node.id = d->GetNode ()->GetId ();
+    node.updated = false;
+    node.pending = false;
+    node.depth = 0;
+    node.pqm = 0;
+    animNodes[Mac16Address::ConvertFrom (d->GetAddress ())] = node;
+    pAnim->UpdateNodeSize (node.id, 15,15);
+  }
 }
-void CongestionControl::PhyRxDrop (CongestionControl *cc,Ptr<LrWpanNetDevice> device, Ptr<const Packet> packet)
+
+static void WriteAnimNode (const Mac16Address &address, AnimNode &node)
 {
-  /*std::ostringstream os;
-  packet->Print (os);
-  std::cout << std::setiosflags (std::ios::fixed) << std::setprecision (9) << "[" << Simulator::Now ().GetSeconds () << "] " << device->GetMac ()->GetShortAddress () << " PhyRxDrop: " << os.str () << std::endl;
-*/
-++m_totalPhyDrop;
+  std::ostringstream node0Oss;
+  node0Oss << node.id <<"," << node.depth <<"," << node.pqm <<"," << address;
+  // Every update change the node description for nodes
+  pAnim->UpdateNodeDescription (node.id, node0Oss.str ());
+  // Every update change the color for nodes if receive update from mesh Root
+  struct rgb color = colors[node.depth % (sizeof (colors) / sizeof (colors[0]))];
+  pAnim->UpdateNodeColor (node.id, color.r, color.g, color.b);
+  node.last = Simulator::Now ();
+  node.updated = true;
+  node.pending = false;
 }
 
-uint64_t CongestionControl::m_totalPhyDrop = 0;
+static void FlushAnimNode (Mac16Address address)
+{
+  if (pAnim == 0)
+    return;
+  std::map<Mac16Address, AnimNode>::iterator it = animNodes.find (address);
+  if (it != animNodes.end () && it->second.pending)
+    WriteAnimNode (it->first, it->second);
+}
+
+void modify (const Mac16Address &sender,const uint16_t &depth, const uint16_t &pqm,const Mac16Address &receiver)
+{
+  if (pAnim == 0)
+    return;
+  std::map<Mac16Address, AnimNode>::iterator it = animNodes.find (receiver);
+  if (it == animNodes.end ())
+    return;
+  AnimNode &node = it->second;
+  node.depth = depth;
+  node.pqm = pqm;
+  Time interval = Seconds (animInterval);
+  if (node.updated && Simulator::Now () - node.last < interval)
+  {
+    // Keep the latest values and write them once the interval is over
+    if (!node.pending)
+    {
+      node.pending = true;
+      Simulator::Schedule (node.last + interval - Simulator::Now (), &FlushAnimNode, receiver);
+    }
+    return;
+  }
+  WriteAnimNode (receiver, node);
+}
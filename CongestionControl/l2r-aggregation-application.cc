@@ -0,0 +1,375 @@
+#include "l2r-aggregation-application.h"
+#include "ns3/log.h"
+#include "ns3/simulator.h"
+#include "ns3/packet.h"
+#include "ns3/uinteger.h"
+#include "ns3/nstime.h"
+#include <ns3/lr-wpan-module.h>
+#include <algorithm>
+#include <limits>
+
+namespace ns3 {
+
+NS_LOG_COMPONENT_DEFINE ("L2rAggregationApplication");
+
+NS_OBJECT_ENSURE_REGISTERED (L2rAggregateRecord);
+NS_OBJECT_ENSURE_REGISTERED (L2rAggregationApplication);
+
+L2rAggregateRecord::L2rAggregateRecord ()
+  : m_period (0),
+    m_count (0),
+    m_min (std::numeric_limits<uint32_t>::max ()),
+    m_max (0),
+    m_sum (0)
+{
+}
+
+TypeId
+L2rAggregateRecord::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::L2rAggregateRecord")
+    .SetParent<Header> ()
+    .AddConstructor<L2rAggregateRecord> ()
+  ;
+  return tid;
+}
+
+TypeId
+L2rAggregateRecord::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+
+uint32_t
+L2rAggregateRecord::GetSerializedSize (void) const
+{
+  return 4 + 4 + 4 + 4 + 8;
+}
+
+void
+L2rAggregateRecord::Serialize (Buffer::Iterator start) const
+{
+  start.WriteHtonU32 (m_period);
+  start.WriteHtonU32 (m_count);
+  start.WriteHtonU32 (m_min);
+  start.WriteHtonU32 (m_max);
+  start.WriteHtonU64 (m_sum);
+}
+
+uint32_t
+L2rAggregateRecord::Deserialize (Buffer::Iterator start)
+{
+  Buffer::Iterator i = start;
+  m_period = i.ReadNtohU32 ();
+  m_count = i.ReadNtohU32 ();
+  m_min = i.ReadNtohU32 ();
+  m_max = i.ReadNtohU32 ();
+  m_sum = i.ReadNtohU64 ();
+  return i.GetDistanceFrom (start);
+}
+
+void
+L2rAggregateRecord::Print (std::ostream &os) const
+{
+  os << "period " << m_period << " count " << m_count << " min " << m_min
+     << " max " << m_max << " sum " << m_sum;
+}
+
+void
+L2rAggregateRecord::SetPeriod (uint32_t period)
+{
+  m_period = period;
+}
+
+uint32_t
+L2rAggregateRecord::GetPeriod (void) const
+{
+  return m_period;
+}
+
+void
+L2rAggregateRecord::AddReading (uint32_t reading)
+{
+  ++m_count;
+  m_min = std::min (m_min, reading);
+  m_max = std::max (m_max, reading);
+  m_sum += reading;
+}
+
+void
+L2rAggregateRecord::Merge (const L2rAggregateRecord &other)
+{
+  NS_ASSERT (other.m_period == m_period);
+  m_count += other.m_count;
+  m_min = std::min (m_min, other.m_min);
+  m_max = std::max (m_max, other.m_max);
+  m_sum += other.m_sum;
+}
+
+uint32_t
+L2rAggregateRecord::GetCount (void) const
+{
+  return m_count;
+}
+
+uint32_t
+L2rAggregateRecord::GetMin (void) const
+{
+  return m_min;
+}
+
+uint32_t
+L2rAggregateRecord::GetMax (void) const
+{
+  return m_max;
+}
+
+uint64_t
+L2rAggregateRecord::GetSum (void) const
+{
+  return m_sum;
+}
+
+double
+L2rAggregateRecord::GetMean (void) const
+{
+  return m_count ? static_cast<double> (m_sum) / m_count : 0;
+}
+
+bool
+L2rAggregateRecord::operator== (const L2rAggregateRecord &other) const
+{
+  return m_period == other.m_period && m_count == other.m_count && m_min == other.m_min
+         && m_max == other.m_max && m_sum == other.m_sum;
+}
+
+TypeId
+L2rAggregationApplication::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::L2rAggregationApplication")
+    .SetParent<Application> ()
+    .AddConstructor<L2rAggregationApplication> ()
+    .AddAttribute ("Period", "Time between two readings of a node",
+                   TimeValue (Seconds (1)),
+                   MakeTimeAccessor (&L2rAggregationApplication::m_period),
+                   MakeTimeChecker ())
+    .AddAttribute ("HopWindow", "Time a node waits per level of the tree below it",
+                   TimeValue (MilliSeconds (50)),
+                   MakeTimeAccessor (&L2rAggregationApplication::m_hopWindow),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxDepth", "Depth of the deepest node the windows leave room for",
+                   UintegerValue (8),
+                   MakeUintegerAccessor (&L2rAggregationApplication::m_maxDepth),
+                   MakeUintegerChecker<uint32_t> (1, 64))
+    .AddAttribute ("MaxReading", "Readings are drawn uniformly from 0 to this value",
+                   UintegerValue (10000),
+                   MakeUintegerAccessor (&L2rAggregationApplication::m_maxReading),
+                   MakeUintegerChecker<uint32_t> ())
+  ;
+  return tid;
+}
+
+L2rAggregationApplication::L2rAggregationApplication ()
+  : m_recordsSent (0),
+    m_lateRecords (0),
+    m_noRoute (0),
+    m_recordsReceived (0)
+{
+  NS_LOG_FUNCTION (this);
+  m_reading = CreateObject<UniformRandomVariable> ();
+}
+
+L2rAggregationApplication::~L2rAggregationApplication ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+void
+L2rAggregationApplication::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+  StopApplication ();
+  m_device = 0;
+  m_sink = 0;
+  m_reading = 0;
+  Application::DoDispose ();
+}
+
+void
+L2rAggregationApplication::Setup (Ptr<NetDevice> dev, Ptr<L2rAggregationApplication> sink)
+{
+  m_device = dev;
+  m_sink = sink;
+  m_device->GetObject<LrWpanNetDevice> ()->GetMac ()->SetL2rRecordCallback (
+    MakeCallback (&L2rAggregationApplication::Receive, this));
+}
+
+int64_t
+L2rAggregationApplication::AssignStreams (int64_t stream)
+{
+  m_reading->SetStream (stream);
+  return 1;
+}
+
+void
+L2rAggregationApplication::StartApplication (void)
+{
+  NS_LOG_FUNCTION (this);
+  if (m_sink == 0)
+    {
+      return;
+    }
+  // Periods are aligned on absolute time so all nodes share them
+  int64_t next = Simulator::Now ().GetTimeStep () / m_period.GetTimeStep () + 1;
+  m_sampleEvent = Simulator::Schedule (TimeStep (m_period.GetTimeStep () * next) - Simulator::Now (),
+                                       &L2rAggregationApplication::Sample, this);
+}
+
+void
+L2rAggregationApplication::StopApplication (void)
+{
+  NS_LOG_FUNCTION (this);
+  m_sampleEvent.Cancel ();
+  for (std::map<uint32_t, OpenPeriod>::iterator i = m_open.begin (); i != m_open.end (); ++i)
+    {
+      i->second.close.Cancel ();
+    }
+  m_open.clear ();
+}
+
+void
+L2rAggregationApplication::Sample (void)
+{
+  uint32_t period = Simulator::Now ().GetTimeStep () / m_period.GetTimeStep ();
+  uint32_t reading = m_reading->GetInteger (0, m_maxReading);
+  m_sink->AddReference (period, reading);
+
+  OpenPeriod &open = m_open[period];
+  open.record.SetPeriod (period);
+  open.record.AddReading (reading);
+  uint32_t depth = m_device->GetObject<LrWpanNetDevice> ()->GetMac ()->GetDepth ();
+  uint32_t levelsBelow = m_maxDepth - std::min (depth, m_maxDepth);
+  open.close = Simulator::Schedule (TimeStep (m_hopWindow.GetTimeStep () * (levelsBelow + 1)),
+                                    &L2rAggregationApplication::Close, this, period);
+  m_sampleEvent = Simulator::Schedule (m_period, &L2rAggregationApplication::Sample, this);
+}
+
+void
+L2rAggregationApplication::Close (uint32_t period)
+{
+  std::map<uint32_t, OpenPeriod>::iterator i = m_open.find (period);
+  NS_ASSERT (i != m_open.end ());
+  L2rAggregateRecord record = i->second.record;
+  m_open.erase (i);
+  Send (record);
+}
+
+void
+L2rAggregationApplication::Receive (Mac16Address sender, Ptr<Packet> p)
+{
+  L2rAggregateRecord record;
+  p->RemoveHeader (record);
+  NS_LOG_LOGIC ("Record from " << sender << ": " << record);
+  if (m_sink == 0)
+    {
+      ++m_recordsReceived;
+      std::map<uint32_t, L2rAggregateRecord>::iterator r = m_results.find (record.GetPeriod ());
+      if (r == m_results.end ())
+        {
+          m_results.insert (std::make_pair (record.GetPeriod (), record));
+        }
+      else
+        {
+          r->second.Merge (record);
+        }
+      return;
+    }
+  std::map<uint32_t, OpenPeriod>::iterator i = m_open.find (record.GetPeriod ());
+  if (i != m_open.end ())
+    {
+      i->second.record.Merge (record);
+      return;
+    }
+  // The window of this period is over; pass the record on unmerged
+  ++m_lateRecords;
+  Send (record);
+}
+
+void
+L2rAggregationApplication::Send (const L2rAggregateRecord &record)
+{
+  Ptr<LrWpanMac> mac = m_device->GetObject<LrWpanNetDevice> ()->GetMac ();
+  McpsDataRequestParams params;
+  params.m_dstPanId = mac->GetPanId ();
+  params.m_srcAddrMode = SHORT_ADDR;
+  params.m_dstAddrMode = SHORT_ADDR;
+  params.m_dstAddr = mac->OutputRoute ();
+  params.m_msduHandle = 0;
+  params.m_txOptions = TX_OPTION_ACK;
+  if (params.m_dstAddr == Mac16Address ("00:00"))
+    {
+      NS_LOG_LOGIC ("No route for " << record);
+      ++m_noRoute;
+      return;
+    }
+  Ptr<Packet> packet = Create<Packet> ();
+  packet->AddHeader (record);
+  L2R_Header l2rHeader;
+  l2rHeader.SetMsgType (L2R_AGG_RECORD);
+  l2rHeader.SetSrcMacAddress (mac->GetShortAddress ());
+  packet->AddHeader (l2rHeader);
+  ++m_recordsSent;
+  LrWpanEventProfiler::Schedule (LrWpanEventProfiler::APP_DATA_TX, Time (0), &LrWpanMac::McpsDataRequest,
+                                 mac, params, packet);
+}
+
+void
+L2rAggregationApplication::AddReference (uint32_t period, uint32_t reading)
+{
+  L2rAggregateRecord &reference = m_reference[period];
+  reference.SetPeriod (period);
+  reference.AddReading (reading);
+}
+
+uint64_t
+L2rAggregationApplication::GetRecordsSent (void) const
+{
+  return m_recordsSent;
+}
+
+uint64_t
+L2rAggregationApplication::GetLateRecords (void) const
+{
+  return m_lateRecords;
+}
+
+void
+L2rAggregationApplication::PrintReport (std::ostream &os) const
+{
+  uint32_t exact = 0;
+  uint64_t readings = 0;
+  uint64_t received = 0;
+  for (std::map<uint32_t, L2rAggregateRecord>::const_iterator r = m_results.begin (); r != m_results.end (); ++r)
+    {
+      std::map<uint32_t, L2rAggregateRecord>::const_iterator ref = m_reference.find (r->first);
+      exact += ref != m_reference.end () && ref->second == r->second;
+      readings += ref != m_reference.end () ? ref->second.GetCount () : 0;
+      received += r->second.GetCount ();
+    }
+  uint32_t periods = m_results.size ();
+  os << "Aggregation: " << periods << " periods, " << exact << " exact, "
+     << received << " of " << readings << " readings";
+  if (periods > 0)
+    {
+      os << ", " << static_cast<double> (m_recordsReceived) / periods << " records per period at the sink";
+    }
+  os << std::endl;
+  if (!m_results.empty ())
+    {
+      const L2rAggregateRecord &last = m_results.rbegin ()->second;
+      os << "Last period " << last.GetPeriod () << ": count " << last.GetCount () << " min " << last.GetMin ()
+         << " max " << last.GetMax () << " mean " << last.GetMean () << std::endl;
+    }
+}
+
+}
@@ -0,0 +1,130 @@
+#ifndef L2R_AGGREGATION_APPLICATION_H
+#define L2R_AGGREGATION_APPLICATION_H
+
+#include "ns3/application.h"
+#include "ns3/header.h"
+#include "ns3/nstime.h"
+#include "ns3/event-id.h"
+#include "ns3/random-variable-stream.h"
+#include "ns3/mac16-address.h"
+#include <map>
+#include <ostream>
+
+namespace ns3 {
+
+class NetDevice;
+class Packet;
+
+/**
+ * Partial aggregate of the readings of one period: count, minimum,
+ * maximum and sum, so that merging two records is exact.
+ */
+class L2rAggregateRecord : public Header
+{
+public:
+  L2rAggregateRecord ();
+
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (Buffer::Iterator start) const;
+  virtual uint32_t Deserialize (Buffer::Iterator start);
+  virtual void Print (std::ostream &os) const;
+
+  void SetPeriod (uint32_t period);
+  uint32_t GetPeriod (void) const;
+  void AddReading (uint32_t reading);
+  /// Fold in the record of another subtree for the same period
+  void Merge (const L2rAggregateRecord &other);
+  uint32_t GetCount (void) const;
+  uint32_t GetMin (void) const;
+  uint32_t GetMax (void) const;
+  uint64_t GetSum (void) const;
+  double GetMean (void) const;
+  bool operator== (const L2rAggregateRecord &other) const;
+
+private:
+  uint32_t m_period;
+  uint32_t m_count;
+  uint32_t m_min;
+  uint32_t m_max;
+  uint64_t m_sum;
+};
+
+/**
+ * In-network aggregation over the L2R tree.
+ *
+ * Every node takes one reading per Period. A node at depth d keeps the
+ * period open for (MaxDepth - d + 1) * HopWindow, so its children, which
+ * close earlier, can send their partial aggregates in time. It then
+ * sends one L2R_AGG_RECORD frame to its OutputRoute parent. A record
+ * arriving after its period closed is forwarded on its own. The sink
+ * merges all records, so it sees one frame per child per period instead
+ * of one per node, and checks them against the readings the sources
+ * reported to it out of band.
+ */
+class L2rAggregationApplication : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+
+  L2rAggregationApplication ();
+  virtual ~L2rAggregationApplication ();
+
+  /**
+   * \param dev the device whose MAC sends and receives the records
+   * \param sink the application of the sink, 0 on the sink itself
+   */
+  void Setup (Ptr<NetDevice> dev, Ptr<L2rAggregationApplication> sink);
+  int64_t AssignStreams (int64_t stream);
+  uint64_t GetRecordsSent (void) const;
+  uint64_t GetLateRecords (void) const;
+  /**
+   * Print, on the sink, the periods received, how many match the
+   * readings exactly and the records received per period.
+   * \param os the output stream
+   */
+  void PrintReport (std::ostream &os) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void Sample (void);
+  void Close (uint32_t period);
+  void Receive (Mac16Address sender, Ptr<Packet> p);
+  void Send (const L2rAggregateRecord &record);
+  /// Called by the sources on the sink with every reading they take
+  void AddReference (uint32_t period, uint32_t reading);
+
+  struct OpenPeriod
+  {
+    L2rAggregateRecord record;
+    EventId close;
+  };
+
+  Time m_period;
+  Time m_hopWindow;
+  uint32_t m_maxDepth;
+  uint32_t m_maxReading;
+
+  Ptr<NetDevice> m_device;
+  Ptr<L2rAggregationApplication> m_sink;
+  Ptr<UniformRandomVariable> m_reading;
+  EventId m_sampleEvent;
+  std::map<uint32_t, OpenPeriod> m_open;
+  uint64_t m_recordsSent;
+  uint64_t m_lateRecords;
+  uint64_t m_noRoute;
+
+  // Sink only
+  std::map<uint32_t, L2rAggregateRecord> m_results;
+  std::map<uint32_t, L2rAggregateRecord> m_reference;
+  uint64_t m_recordsReceived;
+};
+
+}
+
+#endif
@@ -108,8 +108,8 @@ l2rapplication::SendPacket () //ToDo
   device->GetMac ()->UpdateDelay(packet->GetUid(), Simulator::Now ());
   device->GetMac ()->OutputTree(packet,Simulator::Now (),params);
   //device->GetMac ()->m_l2rQueue.insert(std::make_pair(packet->GetUid(),packet));
-  Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,device->GetMac (),
-                             params, packet);  
+  LrWpanEventProfiler::Schedule (LrWpanEventProfiler::APP_DATA_TX, Time (0), &LrWpanMac::McpsDataRequest,
+                                 device->GetMac (), params, packet);
   m_lastStartTime = Simulator::Now ();
   device->GetMac ()->IncQueue();
   m_residualBits = 0;
@@ -218,8 +218,8 @@ l2rapplication::SendBurst()
   device->GetMac ()->UpdateDelay(packet->GetUid(), Simulator::Now ());
   device->GetMac ()->OutputTree(packet,Simulator::Now (),params);
   //device->GetMac ()->m_l2rQueue.insert(std::make_pair(packet->GetUid(),packet));
-  Simulator::Schedule (MicroSeconds(var->GetValue (1, 1000)),&LrWpanMac::McpsDataRequest,device->GetMac (),
-                             params, packet);  
+  LrWpanEventProfiler::Schedule (LrWpanEventProfiler::APP_DATA_TX, MicroSeconds(var->GetValue (1, 1000)),
+                                 &LrWpanMac::McpsDataRequest, device->GetMac (), params, packet);
   }                             
 }
 
@@ -0,0 +1,261 @@
+#include "wsn-policy.h"
+#include "wsngym.h"
+#include "ns3/log.h"
+#include "ns3/simulator.h"
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+
+namespace ns3 {
+
+NS_LOG_COMPONENT_DEFINE ("WSNPolicy");
+
+NS_OBJECT_ENSURE_REGISTERED (WSNPolicy);
+
+TypeId
+WSNPolicy::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::WSNPolicy")
+    .SetParent<Object> ()
+    .AddConstructor<WSNPolicy> ()
+  ;
+  return tid;
+}
+
+WSNPolicy::WSNPolicy ()
+  : m_nSteps (0),
+    m_totalReward (0)
+{
+  NS_LOG_FUNCTION (this);
+}
+
+WSNPolicy::~WSNPolicy ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+void
+WSNPolicy::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+  m_stepEvent.Cancel ();
+  m_gym = 0;
+  Object::DoDispose ();
+}
+
+bool
+WSNPolicy::Load (std::string fileName)
+{
+  NS_LOG_FUNCTION (this << fileName);
+  std::ifstream in (fileName.c_str ());
+  if (!in.is_open ())
+    {
+      NS_LOG_ERROR ("Can not open policy file " << fileName);
+      return false;
+    }
+  // Strip the comment lines, the rest is a flat list of tokens
+  std::stringstream tokens;
+  std::string line;
+  while (std::getline (in, line))
+    {
+      if (line.empty () || line[0] == '#')
+        {
+          continue;
+        }
+      tokens << line << ' ';
+    }
+
+  std::string keyword;
+  uint32_t nLayers = 0;
+  if (!(tokens >> keyword >> nLayers) || keyword != "layers" || nLayers == 0)
+    {
+      NS_LOG_ERROR ("Policy file " << fileName << " has no layer count");
+      return false;
+    }
+  m_layers.clear ();
+  for (uint32_t l = 0; l < nLayers; l++)
+    {
+      DenseLayer layer;
+      std::string activation;
+      if (!(tokens >> keyword >> layer.m_in >> layer.m_out >> activation) || keyword != "dense")
+        {
+          NS_LOG_ERROR ("Policy file " << fileName << ": bad header for layer " << l);
+          return false;
+        }
+      if (!m_layers.empty () && m_layers.back ().m_out != layer.m_in)
+        {
+          NS_LOG_ERROR ("Policy file " << fileName << ": layer " << l << " input size "
+                                       << layer.m_in << " does not match previous output");
+          return false;
+        }
+      if (activation == "linear")
+        {
+          layer.m_activation = LINEAR;
+        }
+      else if (activation == "relu")
+        {
+          layer.m_activation = RELU;
+        }
+      else if (activation == "tanh")
+        {
+          layer.m_activation = TANH;
+        }
+      else if (activation == "sigmoid")
+        {
+          layer.m_activation = SIGMOID;
+        }
+      else if (activation == "softmax")
+        {
+          layer.m_activation = SOFTMAX;
+        }
+      else
+        {
+          NS_LOG_ERROR ("Policy file " << fileName << ": unsupported activation " << activation);
+          return false;
+        }
+      layer.m_kernel.resize (layer.m_in * layer.m_out);
+      layer.m_bias.resize (layer.m_out);
+      for (uint32_t i = 0; i < layer.m_kernel.size (); i++)
+        {
+          if (!(tokens >> layer.m_kernel[i]))
+            {
+              NS_LOG_ERROR ("Policy file " << fileName << ": layer " << l << " kernel is truncated");
+              return false;
+            }
+        }
+      for (uint32_t i = 0; i < layer.m_bias.size (); i++)
+        {
+          if (!(tokens >> layer.m_bias[i]))
+            {
+              NS_LOG_ERROR ("Policy file " << fileName << ": layer " << l << " bias is truncated");
+              return false;
+            }
+        }
+      m_layers.push_back (layer);
+    }
+  NS_LOG_INFO ("Loaded policy with " << m_layers.size () << " layers from " << fileName);
+  return true;
+}
+
+std::vector<float>
+WSNPolicy::Evaluate (const std::vector<float> &input) const
+{
+  NS_ASSERT_MSG (!m_layers.empty (), "No policy loaded");
+  NS_ASSERT_MSG (input.size () == m_layers.front ().m_in, "Observation size does not match the policy");
+  std::vector<float> x = input;
+  std::vector<float> y;
+  for (std::vector<DenseLayer>::const_iterator l = m_layers.begin (); l != m_layers.end (); ++l)
+    {
+      y.assign (l->m_bias.begin (), l->m_bias.end ());
+      for (uint32_t i = 0; i < l->m_in; i++)
+        {
+          const float *row = &l->m_kernel[i * l->m_out];
+          for (uint32_t o = 0; o < l->m_out; o++)
+            {
+              y[o] += x[i] * row[o];
+            }
+        }
+      switch (l->m_activation)
+        {
+        case RELU:
+          for (uint32_t o = 0; o < l->m_out; o++)
+            {
+              y[o] = y[o] > 0 ? y[o] : 0;
+            }
+          break;
+        case TANH:
+          for (uint32_t o = 0; o < l->m_out; o++)
+            {
+              y[o] = std::tanh (y[o]);
+            }
+          break;
+        case SIGMOID:
+          for (uint32_t o = 0; o < l->m_out; o++)
+            {
+              y[o] = 1 / (1 + std::exp (-y[o]));
+            }
+          break;
+        case SOFTMAX:
+          {
+            float maxVal = y[0];
+            for (uint32_t o = 1; o < l->m_out; o++)
+              {
+                maxVal = std::max (maxVal, y[o]);
+              }
+            float sum = 0;
+            for (uint32_t o = 0; o < l->m_out; o++)
+              {
+                y[o] = std::exp (y[o] - maxVal);
+                sum += y[o];
+              }
+            for (uint32_t o = 0; o < l->m_out; o++)
+              {
+                y[o] /= sum;
+              }
+            break;
+          }
+        case LINEAR:
+          break;
+        }
+      x.swap (y);
+    }
+  return x;
+}
+
+uint32_t
+WSNPolicy::Predict (const std::vector<float> &input) const
+{
+  std::vector<float> output = Evaluate (input);
+  uint32_t best = 0;
+  for (uint32_t o = 1; o < output.size (); o++)
+    {
+      if (output[o] > output[best])
+        {
+          best = o;
+        }
+    }
+  return best;
+}
+
+void
+WSNPolicy::Start (Ptr<WSNGym> gym, Time start, Time stepTime)
+{
+  NS_LOG_FUNCTION (this << start << stepTime);
+  m_gym = gym;
+  m_stepTime = stepTime;
+  m_stepEvent = Simulator::Schedule (start, &WSNPolicy::Step, this);
+}
+
+void
+WSNPolicy::Step (void)
+{
+  std::vector<float> obs = m_gym->ObserveState ();
+  float reward = m_gym->GetReward ();
+  uint32_t action = Predict (obs);
+  m_gym->ExecuteAction (action);
+  m_totalReward += reward;
+  ++m_nSteps;
+  NS_LOG_INFO (Simulator::Now ().GetSeconds () << " reward " << reward << " action " << action);
+  m_stepEvent = Simulator::Schedule (m_stepTime, &WSNPolicy::Step, this);
+}
+
+uint32_t
+WSNPolicy::GetInputSize (void) const
+{
+  return m_layers.empty () ? 0 : m_layers.front ().m_in;
+}
+
+uint32_t
+WSNPolicy::GetNSteps (void) const
+{
+  return m_nSteps;
+}
+
+float
+WSNPolicy::GetTotalReward (void) const
+{
+  return m_totalReward;
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef WSN_POLICY_H
+#define WSN_POLICY_H
+
+#include "ns3/object.h"
+#include "ns3/nstime.h"
+#include "ns3/event-id.h"
+#include <vector>
+#include <string>
+
+namespace ns3 {
+
+class WSNGym;
+
+/**
+ * In-process evaluator for the dense networks trained by WSNAgent.py.
+ *
+ * The weights are read from the text file written by export_policy() in
+ * WSNAgent.py, so a trained agent can drive WSNGym::ExecuteAction from a
+ * scheduled event without the Python process.
+ */
+class WSNPolicy : public Object
+{
+public:
+  static TypeId GetTypeId (void);
+
+  WSNPolicy ();
+  virtual ~WSNPolicy ();
+
+  /**
+   * Load the network from an exported weight file.
+   * \param fileName the file written by export_policy()
+   * \return true if the file was parsed successfully
+   */
+  bool Load (std::string fileName);
+  /**
+   * Run the network forward.
+   * \param input the observation vector
+   * \return the output layer activations
+   */
+  std::vector<float> Evaluate (const std::vector<float> &input) const;
+  /**
+   * \param input the observation vector
+   * \return the index of the best action
+   */
+  uint32_t Predict (const std::vector<float> &input) const;
+  /**
+   * Start stepping the gym with the policy's actions.
+   * \param gym the environment to observe and act on
+   * \param start the time of the first step
+   * \param stepTime the time between two steps
+   */
+  void Start (Ptr<WSNGym> gym, Time start, Time stepTime);
+  uint32_t GetInputSize (void) const;
+  uint32_t GetNSteps (void) const;
+  float GetTotalReward (void) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  enum Activation
+  {
+    LINEAR,
+    RELU,
+    TANH,
+    SIGMOID,
+    SOFTMAX
+  };
+  struct DenseLayer
+  {
+    uint32_t m_in;
+    uint32_t m_out;
+    Activation m_activation;
+    std::vector<float> m_kernel; //!< row-major, m_in rows of m_out weights
+    std::vector<float> m_bias;
+  };
+  void Step (void);
+
+  std::vector<DenseLayer> m_layers;
+  Ptr<WSNGym> m_gym;
+  Time m_stepTime;
+  EventId m_stepEvent;
+  uint32_t m_nSteps;
+  float m_totalReward;
+};
+
+}
+
+#endif
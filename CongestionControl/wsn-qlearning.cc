@@ -0,0 +1,332 @@
+#include "wsn-qlearning.h"
+#include "wsngym.h"
+#include "ns3/log.h"
+#include "ns3/simulator.h"
+#include "ns3/double.h"
+#include "ns3/uinteger.h"
+#include "ns3/string.h"
+#include "ns3/enum.h"
+#include <fstream>
+#include <iomanip>
+#include <cmath>
+
+namespace ns3 {
+
+NS_LOG_COMPONENT_DEFINE ("WSNQLearning");
+
+NS_OBJECT_ENSURE_REGISTERED (WSNQLearning);
+
+TypeId
+WSNQLearning::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::WSNQLearning")
+    .SetParent<Object> ()
+    .AddConstructor<WSNQLearning> ()
+    .AddAttribute ("Mode", "Q function representation",
+                   EnumValue (WSNQLearning::TABULAR),
+                   MakeEnumAccessor (&WSNQLearning::m_mode),
+                   MakeEnumChecker (WSNQLearning::TABULAR, "Tabular",
+                                    WSNQLearning::LINEAR, "Linear"))
+    .AddAttribute ("LearningRate", "Step size of the Q update",
+                   DoubleValue (0.1),
+                   MakeDoubleAccessor (&WSNQLearning::m_alpha),
+                   MakeDoubleChecker<double> (0.0, 1.0))
+    .AddAttribute ("Discount", "Discount factor of future rewards",
+                   DoubleValue (0.95),
+                   MakeDoubleAccessor (&WSNQLearning::m_gamma),
+                   MakeDoubleChecker<double> (0.0, 1.0))
+    .AddAttribute ("Epsilon", "Initial exploration rate, overridden by a loaded table",
+                   DoubleValue (1.0),
+                   MakeDoubleAccessor (&WSNQLearning::m_epsilon),
+                   MakeDoubleChecker<double> (0.0, 1.0))
+    .AddAttribute ("EpsilonDecay", "Factor applied to the exploration rate every step",
+                   DoubleValue (0.96),
+                   MakeDoubleAccessor (&WSNQLearning::m_epsilonDecay),
+                   MakeDoubleChecker<double> (0.0, 1.0))
+    .AddAttribute ("EpsilonMin", "Lower bound of the exploration rate",
+                   DoubleValue (0.01),
+                   MakeDoubleAccessor (&WSNQLearning::m_epsilonMin),
+                   MakeDoubleChecker<double> (0.0, 1.0))
+    .AddAttribute ("Bins", "Number of bins per observation in tabular mode",
+                   UintegerValue (10),
+                   MakeUintegerAccessor (&WSNQLearning::m_bins),
+                   MakeUintegerChecker<uint32_t> (1, 64))
+    .AddAttribute ("TableFile", "File the learned values are loaded from and saved to",
+                   StringValue ("wsn-qlearning.txt"),
+                   MakeStringAccessor (&WSNQLearning::m_tableFile),
+                   MakeStringChecker ())
+  ;
+  return tid;
+}
+
+WSNQLearning::WSNQLearning ()
+  : m_nActions (0),
+    m_hasLast (false),
+    m_lastAction (0),
+    m_nSteps (0),
+    m_totalReward (0)
+{
+  NS_LOG_FUNCTION (this);
+  // Clip bounds follow the worst band of WSNGym::GetReward for each of
+  // normalized queue length, packet arrival rate and delay
+  m_obsHigh.push_back (1.0);
+  m_obsHigh.push_back (4.0);
+  m_obsHigh.push_back (10.0);
+  m_uniform = CreateObject<UniformRandomVariable> ();
+}
+
+WSNQLearning::~WSNQLearning ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+void
+WSNQLearning::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+  m_stepEvent.Cancel ();
+  m_gym = 0;
+  m_uniform = 0;
+  Object::DoDispose ();
+}
+
+int64_t
+WSNQLearning::AssignStreams (int64_t stream)
+{
+  m_uniform->SetStream (stream);
+  return 1;
+}
+
+void
+WSNQLearning::Resize (void)
+{
+  uint32_t nObs = m_obsHigh.size ();
+  uint32_t size;
+  if (m_mode == TABULAR)
+    {
+      size = m_nActions;
+      for (uint32_t i = 0; i < nObs; i++)
+        {
+          size *= m_bins;
+        }
+    }
+  else
+    {
+      size = m_nActions * (nObs + 1);
+    }
+  m_q.assign (size, 0.0);
+}
+
+void
+WSNQLearning::Start (Ptr<WSNGym> gym, Time start, Time stepTime)
+{
+  NS_LOG_FUNCTION (this << start << stepTime);
+  m_gym = gym;
+  m_stepTime = stepTime;
+  Ptr<OpenGymDiscreteSpace> space = DynamicCast<OpenGymDiscreteSpace> (m_gym->GetActionSpace ());
+  NS_ABORT_MSG_IF (space == 0, "WSNQLearning needs a discrete action space");
+  m_nActions = space->GetN ();
+  if (!Load ())
+    {
+      Resize ();
+    }
+  m_stepEvent = Simulator::Schedule (start, &WSNQLearning::Step, this);
+}
+
+std::vector<double>
+WSNQLearning::Normalize (const std::vector<float> &obs) const
+{
+  NS_ASSERT (obs.size () == m_obsHigh.size ());
+  std::vector<double> x (obs.size ());
+  for (uint32_t i = 0; i < obs.size (); i++)
+    {
+      double v = obs[i] / m_obsHigh[i];
+      if (!(v > 0)) // also catches NaN when no node was sampled
+        {
+          v = 0;
+        }
+      x[i] = std::min (v, 1.0);
+    }
+  return x;
+}
+
+uint32_t
+WSNQLearning::GetStateIndex (const std::vector<double> &x) const
+{
+  uint32_t index = 0;
+  for (uint32_t i = 0; i < x.size (); i++)
+    {
+      uint32_t bin = std::min<uint32_t> (x[i] * m_bins, m_bins - 1);
+      index = index * m_bins + bin;
+    }
+  return index;
+}
+
+double
+WSNQLearning::GetQ (const std::vector<double> &x, uint32_t action) const
+{
+  if (m_mode == TABULAR)
+    {
+      return m_q[GetStateIndex (x) * m_nActions + action];
+    }
+  const double *w = &m_q[action * (x.size () + 1)];
+  double q = w[0];
+  for (uint32_t i = 0; i < x.size (); i++)
+    {
+      q += w[i + 1] * x[i];
+    }
+  return q;
+}
+
+uint32_t
+WSNQLearning::GetBestAction (const std::vector<double> &x) const
+{
+  uint32_t best = 0;
+  double bestQ = GetQ (x, 0);
+  for (uint32_t a = 1; a < m_nActions; a++)
+    {
+      double q = GetQ (x, a);
+      if (q > bestQ)
+        {
+          bestQ = q;
+          best = a;
+        }
+    }
+  return best;
+}
+
+double
+WSNQLearning::GetMaxQ (const std::vector<double> &x) const
+{
+  return GetQ (x, GetBestAction (x));
+}
+
+void
+WSNQLearning::Update (const std::vector<double> &x, uint32_t action, double target)
+{
+  double error = target - GetQ (x, action);
+  if (m_mode == TABULAR)
+    {
+      m_q[GetStateIndex (x) * m_nActions + action] += m_alpha * error;
+      return;
+    }
+  double *w = &m_q[action * (x.size () + 1)];
+  w[0] += m_alpha * error;
+  for (uint32_t i = 0; i < x.size (); i++)
+    {
+      w[i + 1] += m_alpha * error * x[i];
+    }
+}
+
+void
+WSNQLearning::Step (void)
+{
+  std::vector<double> state = Normalize (m_gym->ObserveState ());
+  // The reward scores the observation that followed the last action
+  float reward = m_gym->GetReward ();
+  if (m_hasLast)
+    {
+      Update (m_lastState, m_lastAction, reward + m_gamma * GetMaxQ (state));
+      m_totalReward += reward;
+    }
+
+  uint32_t action;
+  if (m_uniform->GetValue () < m_epsilon)
+    {
+      action = m_uniform->GetInteger (0, m_nActions - 1);
+    }
+  else
+    {
+      action = GetBestAction (state);
+    }
+  m_gym->ExecuteAction (action);
+  if (m_epsilon > m_epsilonMin)
+    {
+      m_epsilon *= m_epsilonDecay;
+    }
+
+  NS_LOG_INFO (Simulator::Now ().GetSeconds () << " reward " << reward << " action " << action
+                                               << " epsilon " << m_epsilon);
+  m_lastState = state;
+  m_lastAction = action;
+  m_hasLast = true;
+  ++m_nSteps;
+  m_stepEvent = Simulator::Schedule (m_stepTime, &WSNQLearning::Step, this);
+}
+
+bool
+WSNQLearning::Load (void)
+{
+  NS_LOG_FUNCTION (this << m_tableFile);
+  std::ifstream in (m_tableFile.c_str ());
+  if (!in.is_open ())
+    {
+      return false;
+    }
+  std::string magic;
+  uint32_t mode, bins, nObs, nActions;
+  double epsilon;
+  if (!(in >> magic >> mode >> bins >> nObs >> nActions >> epsilon) || magic != "wsn-qlearning")
+    {
+      NS_LOG_WARN ("Ignoring malformed table " << m_tableFile);
+      return false;
+    }
+  if (mode != static_cast<uint32_t> (m_mode) || nObs != m_obsHigh.size () || nActions != m_nActions
+      || (m_mode == TABULAR && bins != m_bins))
+    {
+      NS_LOG_WARN ("Ignoring table " << m_tableFile << " learned with a different configuration");
+      return false;
+    }
+  Resize ();
+  for (uint32_t i = 0; i < m_q.size (); i++)
+    {
+      if (!(in >> m_q[i]))
+        {
+          NS_LOG_WARN ("Ignoring truncated table " << m_tableFile);
+          Resize ();
+          return false;
+        }
+    }
+  m_epsilon = epsilon;
+  NS_LOG_INFO ("Loaded " << m_q.size () << " Q values from " << m_tableFile << ", epsilon " << m_epsilon);
+  return true;
+}
+
+void
+WSNQLearning::Save (void) const
+{
+  NS_LOG_FUNCTION (this << m_tableFile);
+  std::ofstream out (m_tableFile.c_str ());
+  if (!out.is_open ())
+    {
+      NS_LOG_ERROR ("Can not write table " << m_tableFile);
+      return;
+    }
+  out << "wsn-qlearning " << static_cast<uint32_t> (m_mode) << " " << m_bins << " "
+      << m_obsHigh.size () << " " << m_nActions << " " << std::setprecision (17) << m_epsilon << "\n";
+  uint32_t perLine = (m_mode == TABULAR) ? m_nActions : m_obsHigh.size () + 1;
+  for (uint32_t i = 0; i < m_q.size (); i++)
+    {
+      out << m_q[i] << (((i + 1) % perLine == 0) ? "\n" : " ");
+    }
+}
+
+uint32_t
+WSNQLearning::GetNSteps (void) const
+{
+  return m_nSteps;
+}
+
+float
+WSNQLearning::GetTotalReward (void) const
+{
+  return m_totalReward;
+}
+
+double
+WSNQLearning::GetEpsilon (void) const
+{
+  return m_epsilon;
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef WSN_QLEARNING_H
+#define WSN_QLEARNING_H
+
+#include "ns3/object.h"
+#include "ns3/nstime.h"
+#include "ns3/event-id.h"
+#include "ns3/random-variable-stream.h"
+#include <vector>
+#include <string>
+
+namespace ns3 {
+
+class WSNGym;
+
+/**
+ * Epsilon-greedy Q-learning agent running inside the simulator.
+ *
+ * It uses the same observation, reward and discrete action space as the
+ * Python agent talking to WSNGym, but steps from scheduled events so a
+ * training episode needs no ZMQ link. The Q function is either a table
+ * over a discretized observation or one linear model per action. The
+ * learned values and the exploration rate are loaded from and saved to
+ * TableFile so training continues across runs.
+ */
+class WSNQLearning : public Object
+{
+public:
+  enum Mode
+  {
+    TABULAR,
+    LINEAR
+  };
+
+  static TypeId GetTypeId (void);
+
+  WSNQLearning ();
+  virtual ~WSNQLearning ();
+
+  /**
+   * Start stepping the gym.
+   * \param gym the environment to observe and act on
+   * \param start the time of the first step
+   * \param stepTime the time between two steps
+   */
+  void Start (Ptr<WSNGym> gym, Time start, Time stepTime);
+  /**
+   * Load the Q values and exploration rate from TableFile, if it exists.
+   * \return true if a compatible table was loaded
+   */
+  bool Load (void);
+  /**
+   * Write the Q values and exploration rate to TableFile.
+   */
+  void Save (void) const;
+  int64_t AssignStreams (int64_t stream);
+  uint32_t GetNSteps (void) const;
+  float GetTotalReward (void) const;
+  double GetEpsilon (void) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  void Step (void);
+  void Resize (void);
+  /// Normalize and clip an observation to [0,1] per dimension
+  std::vector<double> Normalize (const std::vector<float> &obs) const;
+  uint32_t GetStateIndex (const std::vector<double> &x) const;
+  double GetQ (const std::vector<double> &x, uint32_t action) const;
+  double GetMaxQ (const std::vector<double> &x) const;
+  uint32_t GetBestAction (const std::vector<double> &x) const;
+  void Update (const std::vector<double> &x, uint32_t action, double target);
+
+  Mode m_mode;
+  double m_alpha;
+  double m_gamma;
+  double m_epsilon;
+  double m_epsilonDecay;
+  double m_epsilonMin;
+  uint32_t m_bins;
+  std::string m_tableFile;
+
+  uint32_t m_nActions;
+  std::vector<double> m_obsHigh; //!< upper clip bound of each observation
+  std::vector<double> m_q;       //!< tabular: [state][action], linear: [action][feature]
+
+  Ptr<WSNGym> m_gym;
+  Ptr<UniformRandomVariable> m_uniform;
+  Time m_stepTime;
+  EventId m_stepEvent;
+  bool m_hasLast;
+  std::vector<double> m_lastState;
+  uint32_t m_lastAction;
+  uint32_t m_nSteps;
+  float m_totalReward;
+};
+
+}
+
+#endif
@@ -166,7 +166,14 @@ WSNGym::ExecuteActions(Ptr<OpenGymDataContainer> action)
     */
     NS_LOG_FUNCTION (this);
     Ptr<OpenGymDiscreteContainer> discrete = DynamicCast<OpenGymDiscreteContainer>(action);
-    uint8_t lqt = discrete->GetValue();
+    return ExecuteAction(discrete->GetValue());
+}
+
+bool
+WSNGym::ExecuteAction(uint32_t action)
+{
+    NS_LOG_FUNCTION (this << action);
+    uint8_t lqt = action;
     //m_lqt = lqt + 4;
     for (uint32_t i = 0; i < NodeList::GetNNodes(); i++)
     {
@@ -188,6 +195,13 @@ WSNGym::ExecuteActions(Ptr<OpenGymDataContainer> action)
     return true;
 }
 
+std::vector<float>
+WSNGym::ObserveState()
+{
+    Ptr<OpenGymBoxContainer<float>> box = DynamicCast<OpenGymBoxContainer<float>>(GetObservation());
+    return box->GetData();
+}
+
 float
 WSNGym::GetReward()
 {
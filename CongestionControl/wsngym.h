@@ -25,6 +25,10 @@ public:
     virtual std::string GetExtraInfo();
     virtual bool ExecuteActions(Ptr<OpenGymDataContainer> action);
 
+    // In-process agents (WSNPolicy) step the environment through these
+    std::vector<float> ObserveState();
+    bool ExecuteAction(uint32_t action);
+
     //static void ScheduleNextStateRead(double envStepTime);
     void GetCongestionParams(std::multimap<uint16_t, MeshRootData>&);
     //void SetDeviceContainer(NetDeviceContainer &device);
@@ -0,0 +1,335 @@
+/*
+ * Microbenchmarks for the per-frame L2R code paths, outside of a running
+ * simulation: L2R_Header serialization for every message type, the
+ * L2R_RoutingTable operations and LrWpanMac::OutputRoute with 4 to 256
+ * neighbors.
+ *
+ * Every case runs --warmup untimed iterations, then --iterations timed
+ * ones, and reports ns/op and heap allocations/op. Results can be written
+ * to a baseline file and compared against it later:
+ *
+ *   ./waf --run "l2r-microbenchmark --writeBaseline=l2r-micro.baseline"
+ *   ./waf --run "l2r-microbenchmark --baseline=l2r-micro.baseline --threshold=10"
+ *
+ * This directory is a program of its own, to be copied into scratch/. The
+ * global operator new below counts the allocations of this program only.
+ */
+#include <ns3/core-module.h>
+#include <ns3/lr-wpan-module.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <new>
+#include <sstream>
+
+using namespace ns3;
+
+namespace {
+uint64_t g_allocations = 0;
+}
+
+void *
+operator new (std::size_t size)
+{
+  ++g_allocations;
+  void *p = std::malloc (size ? size : 1);
+  if (p == 0)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+namespace {
+
+struct Result
+{
+  double nsPerOp;
+  double allocsPerOp;
+};
+
+/// Values the optimizer can not prove unused
+volatile uint32_t g_sink;
+
+/**
+ * Run op warmup times untimed, then iterations times timed.
+ */
+template <typename Op>
+Result
+Measure (Op op, uint32_t warmup, uint32_t iterations)
+{
+  for (uint32_t i = 0; i < warmup; i++)
+    {
+      op ();
+    }
+  uint64_t allocations = g_allocations;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  for (uint32_t i = 0; i < iterations; i++)
+    {
+      op ();
+    }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now ();
+  Result r;
+  r.nsPerOp = std::chrono::duration<double, std::nano> (end - start).count () / iterations;
+  r.allocsPerOp = static_cast<double> (g_allocations - allocations) / iterations;
+  return r;
+}
+
+L2R_Header
+MakeHeader (L2R_MsgType type)
+{
+  L2R_Header h;
+  h.SetMsgType (type);
+  h.SetMeshRootAddress (Mac16Address ("00:01"));
+  h.SetSrcMacAddress (Mac16Address ("00:2a"));
+  h.SetPQM (7);
+  h.SetLQT (0xffff);
+  h.SetTCIEInterval (15);
+  h.SetMSN (3);
+  h.SetDepth (4);
+  h.SetQueueSize (2);
+  h.SetDelay (0x3f000000);
+  h.SetArrivalRate (0x3e800000);
+  return h;
+}
+
+Mac16Address
+NeighborAddress (uint32_t i)
+{
+  uint8_t buf[2] = { static_cast<uint8_t> ((i + 2) >> 8), static_cast<uint8_t> (i + 2) };
+  Mac16Address address;
+  address.CopyFrom (buf);
+  return address;
+}
+
+/// One entry per neighbor; a quarter are ancestors of a node at depth 5
+std::vector<L2R_RoutingTableEntry>
+MakeEntries (uint32_t nNeighbors)
+{
+  std::vector<L2R_RoutingTableEntry> entries;
+  for (uint32_t i = 0; i < nNeighbors; i++)
+    {
+      uint16_t depth = 4 + (i % 4 != 0) + (i % 4 == 3);
+      L2R_RoutingTableEntry entry (depth, depth + 1 + i % 3, Simulator::Now (), Seconds (15),
+                                   NeighborAddress (i), false);
+      entry.SetFlag (VALID);
+      entry.SetLQM (1);
+      entries.push_back (entry);
+    }
+  return entries;
+}
+
+class Runner
+{
+public:
+  Runner (uint32_t warmup, uint32_t iterations)
+    : m_warmup (warmup),
+      m_iterations (iterations)
+  {
+  }
+  template <typename Op>
+  void Run (std::string name, Op op)
+  {
+    m_results[name] = Measure (op, m_warmup, m_iterations);
+    m_order.push_back (name);
+  }
+  const std::map<std::string, Result> &GetResults (void) const
+  {
+    return m_results;
+  }
+  const std::vector<std::string> &GetOrder (void) const
+  {
+    return m_order;
+  }
+
+private:
+  uint32_t m_warmup;
+  uint32_t m_iterations;
+  std::map<std::string, Result> m_results;
+  std::vector<std::string> m_order;
+};
+
+void
+RunHeaderBenchmarks (Runner &runner)
+{
+  const L2R_MsgType types[] = { TC_IE, L2R_D_IE, DataHeader, NLM_IE };
+  const char *names[] = { "TC_IE", "L2R_D_IE", "DataHeader", "NLM_IE" };
+  for (uint32_t t = 0; t < 4; t++)
+    {
+      const L2R_Header header = MakeHeader (types[t]);
+      Buffer buffer;
+      buffer.AddAtStart (header.GetSerializedSize ());
+      header.Serialize (buffer.Begin ());
+      std::string prefix = std::string ("header/") + names[t];
+
+      runner.Run (prefix + "/GetSerializedSize", [&header] () {
+        g_sink = header.GetSerializedSize ();
+      });
+      runner.Run (prefix + "/Serialize", [&header, &buffer] () {
+        header.Serialize (buffer.Begin ());
+      });
+      runner.Run (prefix + "/Deserialize", [&buffer] () {
+        L2R_Header h;
+        g_sink = h.Deserialize (buffer.Begin ());
+      });
+    }
+}
+
+void
+RunTableBenchmarks (Runner &runner, uint32_t nNeighbors)
+{
+  std::vector<L2R_RoutingTableEntry> entries = MakeEntries (nNeighbors);
+  std::ostringstream prefix;
+  prefix << "table/" << nNeighbors << "/";
+
+  runner.Run (prefix.str () + "AddRoute", [&entries] () {
+    L2R_RoutingTable table;
+    for (std::vector<L2R_RoutingTableEntry>::iterator i = entries.begin (); i != entries.end (); ++i)
+      {
+        table.AddRoute (*i);
+      }
+    g_sink = table.RoutingTableSize ();
+  });
+
+  L2R_RoutingTable table;
+  for (std::vector<L2R_RoutingTableEntry>::iterator i = entries.begin (); i != entries.end (); ++i)
+    {
+      table.AddRoute (*i);
+    }
+  uint32_t next = 0;
+  runner.Run (prefix.str () + "LookupRoute", [&table, &entries, &next] () {
+    L2R_RoutingTableEntry rt;
+    g_sink = table.LookupRoute (entries[next].GetNextHop (), rt);
+    next = (next + 1) % entries.size ();
+  });
+  runner.Run (prefix.str () + "Update", [&table, &entries, &next] () {
+    g_sink = table.Update (entries[next]);
+    next = (next + 1) % entries.size ();
+  });
+  runner.Run (prefix.str () + "Purge", [&table] () {
+    std::map<Mac16Address, L2R_RoutingTableEntry> removed;
+    table.Purge (removed);
+    g_sink = removed.size ();
+  });
+
+  Ptr<LrWpanMac> mac = CreateObject<LrWpanMac> ();
+  mac->SetShortAddress (Mac16Address ("00:01"));
+  mac->L2R_SetBootstrapState (false, 5, 5, Mac16Address ("00:01"), 0xffff, 15, entries);
+  runner.Run (prefix.str () + "OutputRoute", [&mac] () {
+    g_sink = mac->OutputRoute () == Mac16Address ("00:00");
+  });
+  mac->Dispose ();
+}
+
+std::map<std::string, Result>
+LoadBaseline (std::string fileName)
+{
+  std::map<std::string, Result> baseline;
+  std::ifstream in (fileName.c_str ());
+  if (!in.is_open ())
+    {
+      NS_FATAL_ERROR ("Can not open baseline " << fileName);
+    }
+  std::string line;
+  while (std::getline (in, line))
+    {
+      if (line.empty () || line[0] == '#')
+        {
+          continue;
+        }
+      std::istringstream fields (line);
+      std::string name;
+      Result r;
+      if (fields >> name >> r.nsPerOp >> r.allocsPerOp)
+        {
+          baseline[name] = r;
+        }
+    }
+  return baseline;
+}
+
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint32_t warmup = 10000;
+  uint32_t iterations = 200000;
+  std::string baselineFile = "";
+  std::string writeBaseline = "";
+  double threshold = 10;
+
+  CommandLine cmd;
+  cmd.AddValue ("warmup", "Untimed iterations before every case", warmup);
+  cmd.AddValue ("iterations", "Timed iterations of every case", iterations);
+  cmd.AddValue ("baseline", "Compare against this baseline file", baselineFile);
+  cmd.AddValue ("writeBaseline", "Write the results to this baseline file", writeBaseline);
+  cmd.AddValue ("threshold", "Percent of ns/op above the baseline reported as a regression", threshold);
+  cmd.Parse (argc, argv);
+  NS_ABORT_MSG_IF (iterations == 0, "iterations must be positive");
+
+  Runner runner (warmup, iterations);
+  RunHeaderBenchmarks (runner);
+  const uint32_t sizes[] = { 4, 16, 64, 256 };
+  for (uint32_t s = 0; s < 4; s++)
+    {
+      RunTableBenchmarks (runner, sizes[s]);
+    }
+
+  std::map<std::string, Result> baseline;
+  if (!baselineFile.empty ())
+    {
+      baseline = LoadBaseline (baselineFile);
+    }
+  uint32_t regressions = 0;
+  std::cout << std::left << std::setw (40) << "case" << std::right << std::setw (12) << "ns/op"
+            << std::setw (12) << "allocs/op";
+  if (!baseline.empty ())
+    {
+      std::cout << std::setw (12) << "base ns" << std::setw (10) << "delta";
+    }
+  std::cout << std::endl << std::fixed;
+  for (std::vector<std::string>::const_iterator n = runner.GetOrder ().begin (); n != runner.GetOrder ().end (); ++n)
+    {
+      const Result &r = runner.GetResults ().find (*n)->second;
+      std::cout << std::left << std::setw (40) << *n << std::right << std::setprecision (1)
+                << std::setw (12) << r.nsPerOp << std::setprecision (2) << std::setw (12) << r.allocsPerOp;
+      std::map<std::string, Result>::const_iterator b = baseline.find (*n);
+      if (b != baseline.end ())
+        {
+          double delta = (r.nsPerOp / b->second.nsPerOp - 1) * 100;
+          bool regressed = delta > threshold || r.allocsPerOp > b->second.allocsPerOp;
+          regressions += regressed;
+          std::cout << std::setprecision (1) << std::setw (12) << b->second.nsPerOp
+                    << std::setw (9) << std::showpos << delta << std::noshowpos << "%"
+                    << (regressed ? "  REGRESSION" : "");
+        }
+      std::cout << std::endl;
+    }
+
+  if (!writeBaseline.empty ())
+    {
+      std::ofstream out (writeBaseline.c_str ());
+      out << "# case ns/op allocs/op, " << iterations << " iterations" << std::endl;
+      out << std::setprecision (3) << std::fixed;
+      for (std::vector<std::string>::const_iterator n = runner.GetOrder ().begin (); n != runner.GetOrder ().end (); ++n)
+        {
+          const Result &r = runner.GetResults ().find (*n)->second;
+          out << *n << " " << r.nsPerOp << " " << r.allocsPerOp << std::endl;
+        }
+    }
+  if (!baseline.empty ())
+    {
+      std::cout << regressions << " regressions against " << baselineFile << std::endl;
+    }
+  Simulator::Destroy ();
+  return regressions > 0 ? 1 : 0;
+}
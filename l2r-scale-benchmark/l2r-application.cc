@@ -0,0 +1,6 @@
+/*
+ * The scratch build links every .cc of a directory into one program, so
+ * the benchmark compiles the application of the congestionControl
+ * scenario here instead of keeping a copy of it.
+ */
+#include "../CongestionControl/l2r-application.cc"
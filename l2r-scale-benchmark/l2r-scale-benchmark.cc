@@ -0,0 +1,613 @@
+/*
+ * Scale benchmark for the L2R stack.
+ *
+ * Builds the ring topology of congestionControl.cc, or a square grid, for
+ * every size in --sizes, runs topology discovery and a fixed on/off load
+ * towards the mesh root, and reports one JSON object per size:
+ *
+ *   ./waf --run "l2r-scale-benchmark --sizes=50,500,5000 --topology=grid"
+ *
+ * Every size runs in its own forked process so the peak RSS of one size
+ * does not hide the next one.
+ *
+ * This directory is a program of its own: copy it into scratch/ next to
+ * CongestionControl, whose l2rapplication it builds with.
+ *
+ * With --compareDispatch every size runs twice, without and with
+ * LrWpanMac::DirectDispatch, and the program fails unless both runs send,
+ * forward and deliver the same frames and direct dispatch schedules fewer
+ * events:
+ *
+ *   ./waf --run "l2r-scale-benchmark --sizes=50,500 --compareDispatch=1"
+ *
+ * --profile=default instruments every run like congestionControl.cc does
+ * by default: packet metadata, an animation trace, routing table dumps and
+ * the per-packet text trace of every MAC. --profile=lean keeps only the
+ * counters. With --compareProfiles every size runs with both profiles on
+ * the same seed, and the wall time and peak RSS ratios are reported:
+ *
+ *   ./waf --run "l2r-scale-benchmark --sizes=500,5000 --compareProfiles=1"
+ *
+ * --roots spreads that many mesh roots over the node ids, starting at the
+ * default root. --rootCounts runs every size once per root count, to see
+ * how the delivered throughput scales with the number of roots:
+ *
+ *   ./waf --run "l2r-scale-benchmark --sizes=500,2000 --topology=grid --rootCounts=1,2,4,8"
+ */
+#include <ns3/core-module.h>
+#include <ns3/lr-wpan-module.h>
+#include <ns3/mobility-module.h>
+#include <ns3/propagation-loss-model.h>
+#include <ns3/single-model-spectrum-channel.h>
+#include <ns3/netanim-module.h>
+#include "../CongestionControl/l2r-application.h"
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cstdlib>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("L2rScaleBenchmark");
+
+#define PI 3.14159265
+
+namespace {
+
+struct BenchmarkConfig
+{
+  std::string topology;
+  double distance;
+  double simTime;
+  double dataStart;
+  uint32_t tcieInterval;
+  double onTime;
+  double offTime;
+  uint32_t packetSize;
+  bool bootstrap;
+  bool directDispatch;
+  bool lean;
+  uint32_t roots;
+};
+
+struct BenchmarkResult
+{
+  uint32_t nNodes;
+  double setupSeconds;
+  double runSeconds;
+  uint64_t events;
+  long peakRssKb;
+  long baseRssKb;
+  uint64_t controlFrames;
+  uint64_t dataFrames;
+  uint32_t dataSent;
+  uint32_t dataReceived;
+  uint32_t reachable;
+  uint64_t parentChanges;
+  uint64_t directDispatched;
+  std::vector<uint32_t> rootReceived; //!< data packets received by every root
+};
+
+uint64_t g_controlFrames = 0;
+uint64_t g_dataFrames = 0;
+
+double
+WallSeconds (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+long
+PeakRssKb (void)
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/// Count every L2R frame handed to the PHY by its message type
+void
+MacTx (Ptr<const Packet> packet)
+{
+  Ptr<Packet> copy = packet->Copy ();
+  LrWpanMacHeader macHdr;
+  copy->RemoveHeader (macHdr);
+  if (!macHdr.IsData ())
+    {
+      return;
+    }
+  L2R_Header l2rHdr;
+  copy->PeekHeader (l2rHdr);
+  // Type 5 (a data frame with a hop load) deserializes as DataHeader
+  switch (l2rHdr.GetMsgType ())
+    {
+    case DataHeader:
+    case L2R_AGGREGATE:
+    case L2R_AGG_RECORD:
+      ++g_dataFrames;
+      break;
+    default:
+      ++g_controlFrames;
+      break;
+    }
+}
+
+/// The ring of congestionControl.cc: the root in the centre, rings one distance apart
+Ptr<ListPositionAllocator>
+RingPositions (uint32_t nNodes, double distance)
+{
+  Ptr<UniformRandomVariable> x = CreateObject<UniformRandomVariable> ();
+  Ptr<ListPositionAllocator> positions = CreateObject<ListPositionAllocator> ();
+  double radius = distance;
+  double thetaRad = distance / radius;
+  positions->Add (Vector (0, 0, 0));
+  for (uint32_t i = 1; i < nNodes; i++)
+    {
+      thetaRad += (distance / radius) * (1 + x->GetValue () * 0.1);
+      positions->Add (Vector (static_cast<int> (radius * sin (thetaRad) + x->GetValue () * 10),
+                              static_cast<int> (radius * cos (thetaRad) + x->GetValue () * 10), 0));
+      if (thetaRad > (2 * PI - (distance / radius)))
+        {
+          radius += distance;
+          thetaRad = 0;
+        }
+    }
+  return positions;
+}
+
+/// A square grid, filled row by row
+Ptr<ListPositionAllocator>
+GridPositions (uint32_t nNodes, double distance, uint32_t &rootIndex)
+{
+  uint32_t side = std::ceil (std::sqrt (static_cast<double> (nNodes)));
+  Ptr<ListPositionAllocator> positions = CreateObject<ListPositionAllocator> ();
+  for (uint32_t i = 0; i < nNodes; i++)
+    {
+      positions->Add (Vector ((i % side) * distance, (i / side) * distance, 0));
+    }
+  // The node nearest to the centre of the filled area is the root
+  uint32_t rows = (nNodes + side - 1) / side;
+  rootIndex = std::min (nNodes - 1, (rows / 2) * side + side / 2);
+  return positions;
+}
+
+BenchmarkResult
+RunSize (uint32_t nNodes, const BenchmarkConfig &config)
+{
+  BenchmarkResult result;
+  result.nNodes = nNodes;
+  result.baseRssKb = PeakRssKb ();
+  double start = WallSeconds ();
+
+  NodeContainer nodes;
+  nodes.Create (nNodes);
+  uint32_t rootIndex = 0;
+  MobilityHelper mobility;
+  mobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
+  if (config.topology == "grid")
+    {
+      mobility.SetPositionAllocator (GridPositions (nNodes, config.distance, rootIndex));
+    }
+  else
+    {
+      mobility.SetPositionAllocator (RingPositions (nNodes, config.distance));
+    }
+  mobility.Install (nodes);
+
+  Ptr<SingleModelSpectrumChannel> channel = CreateObject<SingleModelSpectrumChannel> ();
+  Ptr<RangePropagationLossModel> propModel = CreateObject<RangePropagationLossModel> ();
+  channel->AddPropagationLossModel (propModel);
+  DoubleValue maxRange;
+  propModel->GetAttribute ("MaxRange", maxRange);
+
+  Config::SetDefault ("ns3::LrWpanMac::DirectDispatch", BooleanValue (config.directDispatch));
+  LrWpanHelper lrWpanHelper;
+  lrWpanHelper.SetChannel (channel);
+  NetDeviceContainer devices = lrWpanHelper.Install (nodes);
+  lrWpanHelper.AssociateToPan (devices, 10);
+
+  std::ostringstream prefix;
+  prefix << "l2r-scale-" << nNodes;
+  Ptr<OutputStreamWrapper> textTrace;
+  Ptr<OutputStreamWrapper> routingTables;
+  AnimationInterface *anim = 0;
+  if (!config.lean)
+    {
+      Packet::EnablePrinting ();
+      textTrace = Create<OutputStreamWrapper> (prefix.str () + ".routes", std::ios::out);
+      routingTables = Create<OutputStreamWrapper> (prefix.str () + ".tables", std::ios::out);
+      anim = new AnimationInterface (prefix.str () + ".xml");
+    }
+  for (uint32_t i = 0; i < devices.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = devices.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      if (textTrace)
+        {
+          mac->outputRoutesTree (textTrace);
+          Simulator::Schedule (Seconds (1.01), &LrWpanMac::PrintRoutingTable, mac,
+                               nodes.Get (i), routingTables, Time::S);
+        }
+      mac->SetMaxQueueSize (15);
+      mac->TraceConnectWithoutContext ("MacTx", MakeCallback (&MacTx));
+    }
+  std::vector<uint32_t> rootIndices;
+  std::vector<bool> isRoot (nNodes, false);
+  for (uint32_t k = 0; k < config.roots; k++)
+    {
+      uint32_t index = (rootIndex + k * nNodes / config.roots) % nNodes;
+      rootIndices.push_back (index);
+      isRoot[index] = true;
+    }
+  if (config.bootstrap)
+    {
+      lrWpanHelper.BootstrapL2r (devices, rootIndices, maxRange.Get (), 0xffff, config.tcieInterval);
+    }
+  else
+    {
+      for (std::vector<uint32_t>::const_iterator r = rootIndices.begin (); r != rootIndices.end (); ++r)
+        {
+          Ptr<LrWpanMac> root = devices.Get (*r)->GetObject<LrWpanNetDevice> ()->GetMac ();
+          root->L2R_AssignL2RProtocolForSink (true, 0xffff, config.tcieInterval);
+          root->L2R_SendTopologyDiscovery ();
+        }
+    }
+
+  Ptr<UniformRandomVariable> startJitter = CreateObject<UniformRandomVariable> ();
+  for (uint32_t i = 0; i < devices.GetN (); i++)
+    {
+      if (isRoot[i])
+        {
+          continue;
+        }
+      Ptr<ConstantRandomVariable> on = CreateObject<ConstantRandomVariable> ();
+      on->SetAttribute ("Constant", DoubleValue (config.onTime));
+      Ptr<ConstantRandomVariable> off = CreateObject<ConstantRandomVariable> ();
+      off->SetAttribute ("Constant", DoubleValue (config.offTime));
+      Ptr<l2rapplication> app = CreateObject<l2rapplication> ();
+      nodes.Get (i)->AddApplication (app);
+      app->Setup (devices.Get (i), on, off);
+      app->SetPacketSize (config.packetSize);
+      app->SetMaxBytes (0);
+      app->SetStartTime (Seconds (startJitter->GetValue (config.dataStart, config.dataStart + 2)));
+      app->SetStopTime (Seconds (config.simTime));
+    }
+  result.setupSeconds = WallSeconds () - start;
+
+  start = WallSeconds ();
+  Simulator::Stop (Seconds (config.simTime));
+  Simulator::Run ();
+  result.runSeconds = WallSeconds () - start;
+  result.events = Simulator::GetEventCount ();
+  result.peakRssKb = PeakRssKb ();
+  result.controlFrames = g_controlFrames;
+  result.dataFrames = g_dataFrames;
+
+  result.dataSent = 0;
+  result.reachable = 0;
+  result.parentChanges = 0;
+  result.directDispatched = 0;
+  for (uint32_t i = 0; i < devices.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = devices.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      result.directDispatched += mac->GetDirectDispatchCount ();
+      if (!isRoot[i])
+        {
+          result.dataSent += mac->GetTotalPacketSentByNode ();
+          result.reachable += (mac->GetDepth () > 0);
+          result.parentChanges += mac->GetParentChanges ();
+        }
+    }
+  result.dataReceived = 0;
+  for (std::vector<uint32_t>::const_iterator r = rootIndices.begin (); r != rootIndices.end (); ++r)
+    {
+      uint32_t received = devices.Get (*r)->GetObject<LrWpanNetDevice> ()->GetMac ()->GetTotalPacketRxByMeshRoot ();
+      result.rootReceived.push_back (received);
+      result.dataReceived += received;
+    }
+  Simulator::Destroy ();
+  delete anim;
+  return result;
+}
+
+std::string
+ToJson (const BenchmarkResult &r, const BenchmarkConfig &config)
+{
+  std::ostringstream os;
+  os << std::fixed << std::setprecision (6);
+  os << "{\"nodes\": " << r.nNodes
+     << ", \"topology\": \"" << config.topology << "\""
+     << ", \"bootstrap\": " << (config.bootstrap ? "true" : "false")
+     << ", \"directDispatch\": " << (config.directDispatch ? "true" : "false")
+     << ", \"profile\": \"" << (config.lean ? "lean" : "default") << "\""
+     << ", \"roots\": " << config.roots
+     << ", \"simTime\": " << config.simTime
+     << ", \"setupWallSeconds\": " << r.setupSeconds
+     << ", \"runWallSeconds\": " << r.runSeconds
+     << ", \"events\": " << r.events
+     << ", \"directDispatched\": " << r.directDispatched
+     << ", \"eventsPerSecond\": " << (r.runSeconds > 0 ? r.events / r.runSeconds : 0)
+     << ", \"peakRssKb\": " << r.peakRssKb
+     << ", \"bytesPerNode\": " << (r.peakRssKb - r.baseRssKb) * 1024.0 / r.nNodes
+     << ", \"controlFrames\": " << r.controlFrames
+     << ", \"controlFramesPerNode\": " << static_cast<double> (r.controlFrames) / r.nNodes
+     << ", \"dataFrames\": " << r.dataFrames
+     << ", \"reachableNodes\": " << r.reachable
+     << ", \"parentChanges\": " << r.parentChanges
+     << ", \"dataSent\": " << r.dataSent
+     << ", \"dataReceived\": " << r.dataReceived
+     << ", \"sinkPdr\": " << (r.dataSent > 0 ? static_cast<double> (r.dataReceived) / r.dataSent : 0)
+     << ", \"throughputPps\": "
+     << (config.simTime > config.dataStart ? r.dataReceived / (config.simTime - config.dataStart) : 0)
+     << ", \"rootReceived\": [";
+  for (uint32_t k = 0; k < r.rootReceived.size (); k++)
+    {
+      os << (k ? ", " : "") << r.rootReceived[k];
+    }
+  os << "]}";
+  return os.str ();
+}
+
+/// Run one size in a child process and collect its JSON line through a pipe
+std::string
+RunForked (uint32_t nNodes, const BenchmarkConfig &config)
+{
+  int fds[2];
+  if (pipe (fds) != 0)
+    {
+      NS_FATAL_ERROR ("pipe failed");
+    }
+  std::cout.flush ();
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      NS_FATAL_ERROR ("fork failed for " << nNodes << " nodes");
+    }
+  if (pid == 0)
+    {
+      close (fds[0]);
+      std::string json = ToJson (RunSize (nNodes, config), config);
+      ssize_t written = write (fds[1], json.data (), json.size ());
+      close (fds[1]);
+      _exit (written == static_cast<ssize_t> (json.size ()) ? 0 : 1);
+    }
+  close (fds[1]);
+  std::string json;
+  char buf[512];
+  ssize_t n;
+  while ((n = read (fds[0], buf, sizeof (buf))) > 0)
+    {
+      json.append (buf, n);
+    }
+  close (fds[0]);
+  int status;
+  waitpid (pid, &status, 0);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0 || json.empty ())
+    {
+      std::ostringstream os;
+      os << "{\"nodes\": " << nNodes << ", \"error\": \"run failed\"}";
+      return os.str ();
+    }
+  return json;
+}
+
+/// The value of a numeric field of a flat JSON object, -1 if it is missing
+double
+JsonNumber (const std::string &json, const std::string &name)
+{
+  std::string key = "\"" + name + "\": ";
+  std::string::size_type pos = json.find (key);
+  if (pos == std::string::npos)
+    {
+      return -1;
+    }
+  return std::strtod (json.c_str () + pos + key.size (), 0);
+}
+
+/**
+ * Run one size without and with direct dispatch. The frames sent and
+ * delivered must match, and the direct run must schedule fewer events.
+ * \returns true if both runs agree and direct dispatch saved events
+ */
+bool
+CompareDispatch (uint32_t nNodes, BenchmarkConfig config, std::string &json)
+{
+  config.directDispatch = false;
+  std::string scheduled = RunForked (nNodes, config);
+  config.directDispatch = true;
+  std::string direct = RunForked (nNodes, config);
+
+  const char *fields[] = { "controlFrames", "dataFrames", "reachableNodes", "dataSent", "dataReceived" };
+  bool same = true;
+  std::ostringstream os;
+  os << "{\"nodes\": " << nNodes << ", \"scheduled\": " << scheduled << ", \"direct\": " << direct;
+  for (uint32_t f = 0; f < 5; f++)
+    {
+      double a = JsonNumber (scheduled, fields[f]);
+      double b = JsonNumber (direct, fields[f]);
+      if (a < 0 || a != b)
+        {
+          os << ", \"mismatch\": \"" << fields[f] << "\"";
+          same = false;
+          break;
+        }
+    }
+  double events = JsonNumber (scheduled, "events");
+  double directEvents = JsonNumber (direct, "events");
+  bool saved = directEvents >= 0 && directEvents < events;
+  os << ", \"eventsSaved\": "
+     << (events > 0 ? 1 - directEvents / events : 0)
+     << ", \"same\": " << (same ? "true" : "false")
+     << ", \"fewerEvents\": " << (saved ? "true" : "false") << "}";
+  json = os.str ();
+  return same && saved;
+}
+
+/**
+ * Run one size with the default and the lean profile on the same seed.
+ * The lean profile only drops output, so the frames must match too.
+ * \returns true if both runs agree
+ */
+bool
+CompareProfiles (uint32_t nNodes, BenchmarkConfig config, std::string &json)
+{
+  config.lean = false;
+  std::string full = RunForked (nNodes, config);
+  config.lean = true;
+  std::string lean = RunForked (nNodes, config);
+
+  const char *fields[] = { "controlFrames", "dataFrames", "dataSent", "dataReceived" };
+  bool same = true;
+  std::ostringstream os;
+  os << "{\"nodes\": " << nNodes << ", \"default\": " << full << ", \"lean\": " << lean;
+  for (uint32_t f = 0; f < 4; f++)
+    {
+      double a = JsonNumber (full, fields[f]);
+      if (a < 0 || a != JsonNumber (lean, fields[f]))
+        {
+          os << ", \"mismatch\": \"" << fields[f] << "\"";
+          same = false;
+          break;
+        }
+    }
+  double wall = JsonNumber (full, "runWallSeconds") + JsonNumber (full, "setupWallSeconds");
+  double leanWall = JsonNumber (lean, "runWallSeconds") + JsonNumber (lean, "setupWallSeconds");
+  double rss = JsonNumber (full, "peakRssKb");
+  os << ", \"wallRatio\": " << (wall > 0 ? leanWall / wall : 0)
+     << ", \"peakRssRatio\": " << (rss > 0 ? JsonNumber (lean, "peakRssKb") / rss : 0)
+     << ", \"same\": " << (same ? "true" : "false") << "}";
+  json = os.str ();
+  return same;
+}
+
+}
+
+int
+main (int argc, char *argv[])
+{
+  std::string sizes = "50,200,1000,5000,10000";
+  std::string output = "";
+  BenchmarkConfig config;
+  config.topology = "ring";
+  config.distance = 79;
+  config.simTime = 60;
+  config.dataStart = 5;
+  config.tcieInterval = 15;
+  config.onTime = 1;
+  config.offTime = 1;
+  config.packetSize = 20;
+  config.bootstrap = false;
+  config.directDispatch = false;
+  config.roots = 1;
+  std::string rootCounts = "";
+  bool compareDispatch = false;
+  std::string profile = "default";
+  bool compareProfiles = false;
+
+  CommandLine cmd;
+  cmd.AddValue ("sizes", "Comma separated node counts", sizes);
+  cmd.AddValue ("topology", "ring or grid", config.topology);
+  cmd.AddValue ("distance", "Ring spacing or grid pitch in meters", config.distance);
+  cmd.AddValue ("simTime", "Simulated seconds per size", config.simTime);
+  cmd.AddValue ("dataStart", "Time at which nodes start to transmit data", config.dataStart);
+  cmd.AddValue ("tcieInterval", "TC-IE interval of the mesh root in seconds", config.tcieInterval);
+  cmd.AddValue ("onTime", "On period of every source in seconds", config.onTime);
+  cmd.AddValue ("offTime", "Off period of every source in seconds", config.offTime);
+  cmd.AddValue ("packetSize", "Payload size of every data packet", config.packetSize);
+  cmd.AddValue ("bootstrap", "Install the computed tree instead of running discovery", config.bootstrap);
+  cmd.AddValue ("directDispatch", "Run zero-delay L2R continuations without scheduling an event", config.directDispatch);
+  cmd.AddValue ("compareDispatch", "Run every size with and without directDispatch and compare", compareDispatch);
+  cmd.AddValue ("profile", "default: packet metadata, animation and text traces; lean: counters only", profile);
+  cmd.AddValue ("compareProfiles", "Run every size with the default and the lean profile and compare", compareProfiles);
+  cmd.AddValue ("roots", "Number of mesh roots", config.roots);
+  cmd.AddValue ("rootCounts", "Comma separated root counts, every size runs once per count", rootCounts);
+  cmd.AddValue ("output", "JSON output file, stdout if empty", output);
+  cmd.Parse (argc, argv);
+
+  if (config.topology != "ring" && config.topology != "grid")
+    {
+      NS_FATAL_ERROR ("Unknown topology " << config.topology);
+    }
+  if (profile != "default" && profile != "lean")
+    {
+      NS_FATAL_ERROR ("Unknown profile " << profile);
+    }
+  config.lean = profile == "lean";
+  if (compareDispatch && compareProfiles)
+    {
+      NS_FATAL_ERROR ("compareDispatch and compareProfiles are exclusive");
+    }
+  if (!rootCounts.empty () && (compareDispatch || compareProfiles))
+    {
+      NS_FATAL_ERROR ("rootCounts can not be combined with compareDispatch or compareProfiles");
+    }
+  if (rootCounts.empty ())
+    {
+      std::ostringstream roots;
+      roots << config.roots;
+      rootCounts = roots.str ();
+    }
+  if (config.tcieInterval == 0 || config.tcieInterval > 0xff)
+    {
+      NS_FATAL_ERROR ("tcieInterval must be within 1..255 seconds");
+    }
+  SeedManager::SetSeed (167);
+
+  std::ostringstream json;
+  json << "{\"benchmark\": \"l2r-scale\", \"results\": [";
+  std::istringstream list (sizes);
+  std::string item;
+  bool first = true;
+  bool same = true;
+  while (std::getline (list, item, ','))
+    {
+      uint32_t nNodes = std::strtoul (item.c_str (), 0, 10);
+      if (nNodes < 2)
+        {
+          NS_FATAL_ERROR ("Bad size " << item);
+        }
+      std::istringstream counts (rootCounts);
+      std::string count;
+      while (std::getline (counts, count, ','))
+        {
+          config.roots = std::strtoul (count.c_str (), 0, 10);
+          if (config.roots == 0 || config.roots > nNodes)
+            {
+              NS_FATAL_ERROR ("Bad root count " << count << " for " << nNodes << " nodes");
+            }
+          std::string result;
+          if (compareDispatch)
+            {
+              same = CompareDispatch (nNodes, config, result) && same;
+            }
+          else if (compareProfiles)
+            {
+              same = CompareProfiles (nNodes, config, result) && same;
+            }
+          else
+            {
+              result = RunForked (nNodes, config);
+            }
+          json << (first ? "\n  " : ",\n  ") << result;
+          first = false;
+        }
+    }
+  json << "\n]}\n";
+
+  if (output.empty ())
+    {
+      std::cout << json.str ();
+    }
+  else
+    {
+      std::ofstream out (output.c_str ());
+      out << json.str ();
+    }
+  return same ? 0 : 1;
+}
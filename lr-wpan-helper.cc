@@ -31,6 +31,12 @@
 #include <ns3/log.h>
 #include "ns3/names.h"
 #include "ns3/node.h"
+#include "ns3/hash.h"
+#include "ns3/address-utils.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
 namespace ns3 {
 
 NS_LOG_COMPONENT_DEFINE ("LrWpanHelper");
@@ -229,6 +235,527 @@ LrWpanHelper::AssignStreams (NetDeviceContainer c, int64_t stream)
   return (currentStream - stream);
 }
 
+namespace {
+/// Identifies an L2R checkpoint file
+const uint32_t L2R_CHECKPOINT_MAGIC = 0x4c325243; // "L2RC"
+const uint32_t L2R_CHECKPOINT_VERSION = 1;
+}
+
+uint32_t
+LrWpanHelper::GetTopologyFingerprint (NetDeviceContainer c)
+{
+  Buffer buffer;
+  buffer.AddAtStart (c.GetN () * (2 + 3 * 4));
+  Buffer::Iterator i = buffer.Begin ();
+  for (NetDeviceContainer::Iterator j = c.Begin (); j != c.End (); ++j)
+    {
+      Ptr<LrWpanNetDevice> device = (*j)->GetObject<LrWpanNetDevice> ();
+      WriteTo (i, device->GetMac ()->GetShortAddress ());
+      Vector position;
+      Ptr<MobilityModel> mobility = (*j)->GetNode ()->GetObject<MobilityModel> ();
+      if (mobility)
+        {
+          position = mobility->GetPosition ();
+        }
+      // Whole centimetres, so the fingerprint does not depend on rounding noise
+      i.WriteHtonU32 (static_cast<int32_t> (std::floor (position.x * 100 + 0.5)));
+      i.WriteHtonU32 (static_cast<int32_t> (std::floor (position.y * 100 + 0.5)));
+      i.WriteHtonU32 (static_cast<int32_t> (std::floor (position.z * 100 + 0.5)));
+    }
+  std::string bytes (buffer.GetSize (), 0);
+  buffer.CopyData (reinterpret_cast<uint8_t *> (&bytes[0]), bytes.size ());
+  return Hash32 (bytes);
+}
+
+namespace {
+/**
+ * Neighbors and hop counts of the L2R tree, as discovery builds it over
+ * a range propagation model.
+ */
+struct L2rTree
+{
+  std::vector<std::vector<uint32_t> > neighbors; //!< in range of each device
+  std::vector<uint16_t> hops;                    //!< 0xffff if unreachable
+  std::vector<uint32_t> root;                    //!< index of the nearest mesh root
+};
+
+L2rTree
+ComputeL2rTree (NetDeviceContainer c, std::vector<uint32_t> rootIndices, double range)
+{
+  uint32_t n = c.GetN ();
+  NS_ABORT_MSG_IF (rootIndices.empty (), "No mesh root");
+  for (std::vector<uint32_t>::const_iterator r = rootIndices.begin (); r != rootIndices.end (); ++r)
+    {
+      NS_ABORT_MSG_IF (*r >= n, "Mesh root index " << *r << " out of range");
+    }
+  std::vector<Vector> positions (n);
+  for (uint32_t i = 0; i < n; i++)
+    {
+      Ptr<MobilityModel> mobility = c.Get (i)->GetNode ()->GetObject<MobilityModel> ();
+      NS_ABORT_MSG_IF (mobility == 0, "Node " << c.Get (i)->GetNode ()->GetId () << " has no position");
+      positions[i] = mobility->GetPosition ();
+    }
+
+  // Hash every device into a square cell one range wide, so only the
+  // 3x3 surrounding cells hold candidate neighbors
+  typedef std::pair<int64_t, int64_t> Cell;
+  std::map<Cell, std::vector<uint32_t> > grid;
+  std::vector<Cell> cells (n);
+  for (uint32_t i = 0; i < n; i++)
+    {
+      cells[i] = Cell (static_cast<int64_t> (std::floor (positions[i].x / range)),
+                       static_cast<int64_t> (std::floor (positions[i].y / range)));
+      grid[cells[i]].push_back (i);
+    }
+  L2rTree tree;
+  tree.neighbors.resize (n);
+  double range2 = range * range;
+  for (uint32_t i = 0; i < n; i++)
+    {
+      for (int64_t dx = -1; dx <= 1; dx++)
+        {
+          for (int64_t dy = -1; dy <= 1; dy++)
+            {
+              std::map<Cell, std::vector<uint32_t> >::const_iterator g =
+                grid.find (Cell (cells[i].first + dx, cells[i].second + dy));
+              if (g == grid.end ())
+                {
+                  continue;
+                }
+              for (std::vector<uint32_t>::const_iterator j = g->second.begin (); j != g->second.end (); ++j)
+                {
+                  Vector d = positions[*j] - positions[i];
+                  if (*j != i && d.x * d.x + d.y * d.y + d.z * d.z <= range2)
+                    {
+                      tree.neighbors[i].push_back (*j);
+                    }
+                }
+            }
+        }
+    }
+
+  // One BFS from all roots at once; ties go to the root listed first
+  tree.hops.assign (n, 0xffff);
+  tree.root.assign (n, 0);
+  std::vector<uint32_t> frontier;
+  for (std::vector<uint32_t>::const_iterator r = rootIndices.begin (); r != rootIndices.end (); ++r)
+    {
+      if (tree.hops[*r] != 0)
+        {
+          tree.hops[*r] = 0;
+          tree.root[*r] = *r;
+          frontier.push_back (*r);
+        }
+    }
+  for (size_t head = 0; head < frontier.size (); head++)
+    {
+      uint32_t i = frontier[head];
+      for (std::vector<uint32_t>::const_iterator j = tree.neighbors[i].begin (); j != tree.neighbors[i].end (); ++j)
+        {
+          if (tree.hops[*j] == 0xffff)
+            {
+              tree.hops[*j] = tree.hops[i] + 1;
+              tree.root[*j] = tree.root[i];
+              frontier.push_back (*j);
+            }
+        }
+    }
+  return tree;
+}
+}
+
+void
+LrWpanHelper::BootstrapL2r (NetDeviceContainer c, uint32_t rootIndex, double range,
+                            uint16_t lqt, uint8_t tcieInterval)
+{
+  BootstrapL2r (c, std::vector<uint32_t> (1, rootIndex), range, lqt, tcieInterval);
+}
+
+void
+LrWpanHelper::BootstrapL2r (NetDeviceContainer c, std::vector<uint32_t> rootIndices, double range,
+                            uint16_t lqt, uint8_t tcieInterval)
+{
+  NS_LOG_FUNCTION (this << rootIndices.size () << range);
+  L2rTree tree = ComputeL2rTree (c, rootIndices, range);
+  uint32_t reachable = 0;
+  std::vector<L2R_RoutingTableEntry> entries;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      if (tree.hops[i] == 0xffff)
+        {
+          continue;
+        }
+      ++reachable;
+      entries.clear ();
+      for (std::vector<uint32_t>::const_iterator j = tree.neighbors[i].begin (); j != tree.neighbors[i].end (); ++j)
+        {
+          Ptr<LrWpanMac> neighbor = c.Get (*j)->GetObject<LrWpanNetDevice> ()->GetMac ();
+          // The neighbor advertises its depth and PQM; discovery adds an LQM of 1
+          L2R_RoutingTableEntry entry (tree.hops[*j], tree.hops[*j] + 1, Simulator::Now (),
+                                       Seconds (tcieInterval), neighbor->GetShortAddress (), false);
+          entry.SetFlag (VALID);
+          entry.SetDestination (c.Get (tree.root[*j])->GetObject<LrWpanNetDevice> ()->GetMac ()->GetShortAddress ());
+          entry.SetLQM (1);
+          entry.SetQueuePar (0);
+          entry.SetArrivalRatePar (0);
+          entry.SetDelayPar (0);
+          entries.push_back (entry);
+        }
+      Mac16Address root = c.Get (tree.root[i])->GetObject<LrWpanNetDevice> ()->GetMac ()->GetShortAddress ();
+      c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_SetBootstrapState (
+        tree.hops[i] == 0, tree.hops[i], tree.hops[i], root, lqt, tcieInterval, entries);
+    }
+  NS_LOG_INFO ("Bootstrapped L2R tree, " << reachable << " of " << c.GetN () << " devices reachable");
+}
+
+uint32_t
+LrWpanHelper::VerifyL2rBootstrap (NetDeviceContainer c, uint32_t rootIndex, double range,
+                                  std::ostream &os)
+{
+  L2rTree tree = ComputeL2rTree (c, std::vector<uint32_t> (1, rootIndex), range);
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      if (tree.hops[i] == 0xffff)
+        {
+          continue;
+        }
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      Mac16Address address = mac->GetShortAddress ();
+      if (i != rootIndex && (mac->GetDepth () != tree.hops[i] || mac->GetPqm () != tree.hops[i]))
+        {
+          os << address << ": depth " << mac->GetDepth () << " PQM " << mac->GetPqm ()
+             << ", expected " << tree.hops[i] << std::endl;
+          ++mismatches;
+        }
+      std::map<Mac16Address, L2R_RoutingTableEntry> routes;
+      mac->GetRoutingTable ().GetListOfAllRoutes (routes);
+      for (std::vector<uint32_t>::const_iterator j = tree.neighbors[i].begin (); j != tree.neighbors[i].end (); ++j)
+        {
+          Mac16Address neighbor = c.Get (*j)->GetObject<LrWpanNetDevice> ()->GetMac ()->GetShortAddress ();
+          std::map<Mac16Address, L2R_RoutingTableEntry>::iterator r = routes.find (neighbor);
+          if (r == routes.end ())
+            {
+              os << address << ": no entry for neighbor " << neighbor << std::endl;
+              ++mismatches;
+              continue;
+            }
+          if (r->second.GetDepth () != tree.hops[*j] || r->second.GetPQM () != tree.hops[*j] + 1)
+            {
+              os << address << ": entry " << neighbor << " depth " << r->second.GetDepth ()
+                 << " PQM " << r->second.GetPQM () << ", expected " << tree.hops[*j]
+                 << " and " << tree.hops[*j] + 1 << std::endl;
+              ++mismatches;
+            }
+          routes.erase (r);
+        }
+      for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator r = routes.begin (); r != routes.end (); ++r)
+        {
+          os << address << ": unexpected entry " << r->first << std::endl;
+          ++mismatches;
+        }
+    }
+  return mismatches;
+}
+
+void
+LrWpanHelper::PrintL2rDrops (NetDeviceContainer c, std::ostream &os)
+{
+  std::ios::fmtflags flags = os.flags ();
+  uint32_t total = 0;
+  uint32_t perReason[L2R_DROP_REASON_COUNT];
+  uint32_t worstCount[L2R_DROP_REASON_COUNT];
+  Mac16Address worst[L2R_DROP_REASON_COUNT];
+  for (uint32_t r = 0; r < L2R_DROP_REASON_COUNT; r++)
+    {
+      perReason[r] = 0;
+      worstCount[r] = 0;
+      for (uint32_t i = 0; i < c.GetN (); i++)
+        {
+          Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+          uint32_t count = mac->GetDropCount (static_cast<L2R_DropReason> (r));
+          perReason[r] += count;
+          if (count > worstCount[r])
+            {
+              worstCount[r] = count;
+              worst[r] = mac->GetShortAddress ();
+            }
+        }
+      total += perReason[r];
+    }
+  os << "Drops by reason: " << total << " frames on " << c.GetN () << " nodes" << std::endl;
+  os << std::left << std::setw (16) << "reason" << std::right << std::setw (10) << "frames"
+     << std::setw (10) << "share" << std::setw (12) << "worst node" << std::setw (10) << "frames" << std::endl;
+  os << std::fixed << std::setprecision (1);
+  for (uint32_t r = 0; r < L2R_DROP_REASON_COUNT; r++)
+    {
+      os << std::left << std::setw (16) << LrWpanMac::GetDropReasonName (static_cast<L2R_DropReason> (r))
+         << std::right << std::setw (10) << perReason[r]
+         << std::setw (9) << (total ? 100.0 * perReason[r] / total : 0) << "%";
+      if (worstCount[r] > 0)
+        {
+          std::ostringstream address;
+          address << worst[r];
+          os << std::setw (12) << address.str () << std::setw (10) << worstCount[r];
+        }
+      os << std::endl;
+    }
+  os.flags (flags);
+}
+
+void
+LrWpanHelper::PrintL2rCounters (NetDeviceContainer c, std::ostream &os)
+{
+  uint64_t forwarded = 0;
+  uint64_t tcIe = 0;
+  uint64_t dIe = 0;
+  uint64_t nlm = 0;
+  uint64_t parentChanges = 0;
+  uint64_t piggyback = 0;
+  uint64_t aggFrames = 0;
+  uint64_t aggPackets = 0;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      forwarded += mac->GetForwardedFrames ();
+      tcIe += mac->GetControlFrames (TC_IE);
+      dIe += mac->GetControlFrames (L2R_D_IE);
+      nlm += mac->GetControlFrames (NLM_IE);
+      parentChanges += mac->GetParentChanges ();
+      piggyback += mac->GetPiggybackUpdates ();
+      aggFrames += mac->GetAggregateFrames ();
+      aggPackets += mac->GetAggregatedPackets ();
+    }
+  os << "L2R frames: forwarded " << forwarded << ", TC-IE " << tcIe << ", D-IE " << dIe
+     << ", NLM-IE " << nlm << ", parent changes " << parentChanges
+     << ", entries refreshed by data " << piggyback
+     << ", aggregated " << aggPackets << " in " << aggFrames << " frames (saved "
+     << aggPackets - aggFrames << ")" << std::endl;
+}
+
+void
+LrWpanHelper::PrintL2rParentChanges (NetDeviceContainer c, std::ostream &os)
+{
+  uint32_t nodes = 0;
+  uint32_t stable = 0;
+  uint64_t total = 0;
+  uint64_t held = 0;
+  uint32_t most = 0;
+  uint32_t mostNode = 0;
+  std::ostringstream perNode;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      if (mac->IsMeshRoot ())
+        {
+          continue;
+        }
+      uint32_t changes = mac->GetParentChanges ();
+      ++nodes;
+      total += changes;
+      held += mac->GetParentSwitchesHeld ();
+      // The first parent is a change too
+      stable += (changes <= 1);
+      if (changes > 1)
+        {
+          perNode << " " << i << ":" << changes;
+        }
+      if (changes > most)
+        {
+          most = changes;
+          mostNode = i;
+        }
+    }
+  os << "Parent changes: " << total << " over " << nodes << " nodes, " << stable
+     << " kept their first parent, most " << most << " at node " << mostNode
+     << ", " << held << " switches held back" << std::endl;
+  if (!perNode.str ().empty ())
+    {
+      os << "Changes per node:" << perNode.str () << std::endl;
+    }
+}
+
+void
+LrWpanHelper::PrintL2rLinks (NetDeviceContainer c, std::ostream &os)
+{
+  uint32_t links = 0;
+  double etxSum = 0;
+  double lqiSum = 0;
+  double worstEtx = 0;
+  uint32_t worstNode = 0;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      Mac16Address parent = mac->GetParent ();
+      if (mac->IsMeshRoot () || parent == Mac16Address ("00:00"))
+        {
+          continue;
+        }
+      double etx = mac->GetLinkEstimator ().GetEtx (parent);
+      ++links;
+      etxSum += etx;
+      lqiSum += mac->GetLinkEstimator ().GetLqi (parent);
+      if (etx > worstEtx)
+        {
+          worstEtx = etx;
+          worstNode = i;
+        }
+    }
+  os << "Parent links: " << links;
+  if (links > 0)
+    {
+      os << ", mean ETX " << etxSum / links << ", mean LQI " << lqiSum / links
+         << ", worst ETX " << worstEtx << " at node " << worstNode;
+    }
+  os << std::endl;
+}
+
+void
+LrWpanHelper::PrintL2rRoots (NetDeviceContainer c, std::ostream &os)
+{
+  std::map<Mac16Address, uint32_t> members;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      if (!mac->IsMeshRoot ())
+        {
+          ++members[mac->GetRootAddress ()];
+        }
+    }
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      total += mac->IsMeshRoot () ? mac->GetTotalPacketRxByMeshRoot () : 0;
+    }
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      if (!mac->IsMeshRoot ())
+        {
+          continue;
+        }
+      uint32_t received = mac->GetTotalPacketRxByMeshRoot ();
+      os << "Mesh root " << mac->GetShortAddress () << ": " << members[mac->GetShortAddress ()]
+         << " nodes, received " << received << " packets ("
+         << (total > 0 ? 100.0 * received / total : 0) << "%)" << std::endl;
+    }
+}
+
+void
+LrWpanHelper::PrintL2rParentShare (NetDeviceContainer c, std::ostream &os)
+{
+  uint32_t senders = 0;
+  uint32_t multipath = 0;
+  uint64_t held = 0;
+  std::ostringstream shares;
+  for (uint32_t i = 0; i < c.GetN (); i++)
+    {
+      Ptr<LrWpanMac> mac = c.Get (i)->GetObject<LrWpanNetDevice> ()->GetMac ();
+      uint32_t nextHops = mac->GetParentShare ().size ();
+      held += mac->GetBackpressureHeldFrames ();
+      senders += (nextHops > 0);
+      if (nextHops > 1)
+        {
+          ++multipath;
+          mac->PrintParentShare (shares);
+        }
+    }
+  os << "Next hops: " << multipath << " of " << senders
+     << " sending nodes used more than one, " << held << " frames held by backpressure"
+     << std::endl << shares.str ();
+}
+
+void
+LrWpanHelper::SaveL2rCheckpoint (NetDeviceContainer c, std::string fileName)
+{
+  NS_LOG_FUNCTION (this << fileName);
+  uint32_t size = 0;
+  for (NetDeviceContainer::Iterator j = c.Begin (); j != c.End (); ++j)
+    {
+      size += (*j)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_GetCheckpointSize ();
+    }
+  Buffer payload;
+  payload.AddAtStart (size);
+  Buffer::Iterator i = payload.Begin ();
+  for (NetDeviceContainer::Iterator j = c.Begin (); j != c.End (); ++j)
+    {
+      (*j)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_SaveCheckpoint (i);
+    }
+  std::string bytes (size, 0);
+  payload.CopyData (reinterpret_cast<uint8_t *> (&bytes[0]), size);
+
+  Buffer header;
+  header.AddAtStart (6 * 4);
+  i = header.Begin ();
+  i.WriteHtonU32 (L2R_CHECKPOINT_MAGIC);
+  i.WriteHtonU32 (L2R_CHECKPOINT_VERSION);
+  i.WriteHtonU32 (c.GetN ());
+  i.WriteHtonU32 (GetTopologyFingerprint (c));
+  i.WriteHtonU32 (size);
+  i.WriteHtonU32 (Hash32 (bytes));
+
+  std::ofstream out (fileName.c_str (), std::ios::out | std::ios::binary);
+  if (!out.is_open ())
+    {
+      NS_FATAL_ERROR ("Can not write L2R checkpoint " << fileName);
+    }
+  header.CopyData (&out, header.GetSize ());
+  out.write (bytes.data (), bytes.size ());
+  NS_LOG_INFO ("Saved L2R state of " << c.GetN () << " devices at "
+                                     << Simulator::Now ().GetSeconds () << "s to " << fileName);
+}
+
+void
+LrWpanHelper::LoadL2rCheckpoint (NetDeviceContainer c, std::string fileName)
+{
+  NS_LOG_FUNCTION (this << fileName);
+  std::ifstream in (fileName.c_str (), std::ios::in | std::ios::binary);
+  if (!in.is_open ())
+    {
+      NS_FATAL_ERROR ("Can not open L2R checkpoint " << fileName);
+    }
+  uint8_t raw[6 * 4];
+  if (!in.read (reinterpret_cast<char *> (raw), sizeof (raw)))
+    {
+      NS_FATAL_ERROR ("L2R checkpoint " << fileName << " is truncated");
+    }
+  Buffer header;
+  header.AddAtStart (sizeof (raw));
+  header.Begin ().Write (raw, sizeof (raw));
+  Buffer::Iterator i = header.Begin ();
+  uint32_t magic = i.ReadNtohU32 ();
+  uint32_t version = i.ReadNtohU32 ();
+  uint32_t nDevices = i.ReadNtohU32 ();
+  uint32_t fingerprint = i.ReadNtohU32 ();
+  uint32_t size = i.ReadNtohU32 ();
+  uint32_t checksum = i.ReadNtohU32 ();
+  if (magic != L2R_CHECKPOINT_MAGIC || version != L2R_CHECKPOINT_VERSION)
+    {
+      NS_FATAL_ERROR (fileName << " is not an L2R checkpoint of version " << L2R_CHECKPOINT_VERSION);
+    }
+  if (nDevices != c.GetN () || fingerprint != GetTopologyFingerprint (c))
+    {
+      NS_FATAL_ERROR ("L2R checkpoint " << fileName << " was taken on a different topology ("
+                                        << nDevices << " devices, fingerprint " << fingerprint << ")");
+    }
+  std::string bytes (size, 0);
+  if (!in.read (&bytes[0], size) || Hash32 (bytes) != checksum)
+    {
+      NS_FATAL_ERROR ("L2R checkpoint " << fileName << " is corrupt");
+    }
+
+  Buffer payload;
+  payload.AddAtStart (size);
+  payload.Begin ().Write (reinterpret_cast<const uint8_t *> (bytes.data ()), size);
+  i = payload.Begin ();
+  for (NetDeviceContainer::Iterator j = c.Begin (); j != c.End (); ++j)
+    {
+      (*j)->GetObject<LrWpanNetDevice> ()->GetMac ()->L2R_LoadCheckpoint (i);
+    }
+  NS_LOG_INFO ("Loaded L2R state of " << c.GetN () << " devices from " << fileName);
+}
+
 void
 LrWpanHelper::AssociateToPan (NetDeviceContainer c, uint16_t panId)
 {
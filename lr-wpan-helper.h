@@ -143,6 +143,142 @@ public:
    * \return the number of stream indices assigned by this helper
    */
   int64_t AssignStreams (NetDeviceContainer c, int64_t stream);
+
+  /**
+   * \brief Save the converged L2R state of all devices to a binary checkpoint.
+   *
+   * The file carries a fingerprint of the device addresses and positions
+   * and a checksum of the saved state.
+   *
+   * \param c the devices to save, in the order they will be loaded
+   * \param fileName the checkpoint file
+   */
+  void SaveL2rCheckpoint (NetDeviceContainer c, std::string fileName);
+  /**
+   * \brief Restore a checkpoint written by SaveL2rCheckpoint.
+   *
+   * Replaces topology discovery, so traffic can start at once. Aborts
+   * the simulation if the file is corrupt or was taken on a different
+   * topology.
+   *
+   * \param c the devices to restore, in the order they were saved
+   * \param fileName the checkpoint file
+   */
+  void LoadL2rCheckpoint (NetDeviceContainer c, std::string fileName);
+  /**
+   * \param c a set of devices
+   * \return a hash of the short address and position of every device
+   */
+  static uint32_t GetTopologyFingerprint (NetDeviceContainer c);
+
+  /**
+   * \brief Install the converged L2R tree without running topology discovery.
+   *
+   * Runs a BFS from the mesh root over the links of a range propagation
+   * model, using a grid of cells one range wide. Every reachable node gets
+   * depth and PQM equal to its hop count and one routing table entry per
+   * neighbor, with the neighbor's depth and PQM plus an LQM of 1, which
+   * is what discovery produces on a loss-free channel.
+   *
+   * \param c the devices, all on the same channel
+   * \param rootIndex index of the mesh root in c
+   * \param range the maximum range of the propagation model in meters
+   * \param lqt the link quality threshold
+   * \param tcieInterval the TC-IE interval in seconds
+   */
+  void BootstrapL2r (NetDeviceContainer c, uint32_t rootIndex, double range,
+                     uint16_t lqt, uint8_t tcieInterval);
+  /**
+   * \brief Install the converged L2R state for several mesh roots.
+   *
+   * Every node joins the tree of its nearest root, by hop count, and its
+   * routing table entries carry the root of each neighbor.
+   *
+   * \param c the devices, all on the same channel
+   * \param rootIndices indices of the mesh roots in c
+   * \param range the maximum range of the propagation model in meters
+   * \param lqt the link quality threshold
+   * \param tcieInterval the TC-IE interval in seconds
+   */
+  void BootstrapL2r (NetDeviceContainer c, std::vector<uint32_t> rootIndices, double range,
+                     uint16_t lqt, uint8_t tcieInterval);
+  /**
+   * \brief Compare the live L2R state with the tree BootstrapL2r would install.
+   *
+   * Meant to run at the end of a short discovery run on a small topology.
+   *
+   * \param c the devices, all on the same channel
+   * \param rootIndex index of the mesh root in c
+   * \param range the maximum range of the propagation model in meters
+   * \param os stream that receives one line per mismatch
+   * \return the number of mismatches
+   */
+  static uint32_t VerifyL2rBootstrap (NetDeviceContainer c, uint32_t rootIndex, double range,
+                                      std::ostream &os);
+  /**
+   * \brief Print the frames dropped by a set of devices, per drop reason.
+   *
+   * One line per L2R_DropReason with the total, its share of all drops
+   * and the node that dropped the most frames for that reason.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rDrops (NetDeviceContainer c, std::ostream &os);
+  /**
+   * \brief Print the L2R frame counters of a set of devices in one line.
+   *
+   * Totals of the forwarded data frames, the queued TC-IE, D-IE and
+   * NLM-IE frames, the parent changes, the routing table entries
+   * refreshed from data frames and the data frames packed into
+   * aggregates, with the frames this saved. Stands in for the per-packet
+   * text traces in lean runs.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rCounters (NetDeviceContainer c, std::ostream &os);
+  /**
+   * \brief Print one line per mesh root of a set of devices.
+   *
+   * The nodes whose current parent leads to that root and the data
+   * packets it received, with its share of all packets received.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rRoots (NetDeviceContainer c, std::ostream &os);
+  /**
+   * \brief Print the measured links from every node to its parent.
+   *
+   * The mean ETX and LQI over all parent links and the worst ETX, as
+   * filled in by the LinkEstimation attribute of LrWpanMac.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rLinks (NetDeviceContainer c, std::ostream &os);
+  /**
+   * \brief Print how stable the parents of a set of devices were.
+   *
+   * The parent changes of every node that changed parent, the nodes that
+   * never did, the most changes of a single node and the switches the
+   * parent hysteresis held back.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rParentChanges (NetDeviceContainer c, std::ostream &os);
+  /**
+   * \brief Print how the devices split their data frames over next hops.
+   *
+   * One summary line, then the share of every device that used more
+   * than one next hop, see the LrWpanMac ForwardingMode attribute.
+   *
+   * \param c the devices
+   * \param os the output stream
+   */
+  static void PrintL2rParentShare (NetDeviceContainer c, std::ostream &os);
   //AM: modified on 26/11
   /**
    * \brief prints the routing tables of all nodes at a particular time.
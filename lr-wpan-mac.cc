@@ -29,11 +29,17 @@
 #include <ns3/simulator.h>
 #include <ns3/log.h>
 #include <ns3/uinteger.h>
+#include <ns3/boolean.h>
 #include <ns3/node.h>
 #include <ns3/packet.h>
 #include <ns3/random-variable-stream.h>
 #include <ns3/double.h>
+#include <ns3/enum.h>
 #include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
 #include "ns3/address-utils.h"
 #include "lr-wpan-net-device.h"
 #undef NS_LOG_APPEND_CONTEXT
@@ -45,6 +51,8 @@ namespace ns3 {
 NS_LOG_COMPONENT_DEFINE ("LrWpanMac");
 
 NS_OBJECT_ENSURE_REGISTERED (LrWpanMac);
+NS_OBJECT_ENSURE_REGISTERED (L2R_PathTag);
+NS_OBJECT_ENSURE_REGISTERED (L2R_UidTag);
 
 const uint32_t LrWpanMac::aMinMPDUOverhead = 9; // Table 85
 
@@ -59,6 +67,220 @@ LrWpanMac::GetTypeId (void)
                    UintegerValue (),
                    MakeUintegerAccessor (&LrWpanMac::m_macPanId),
                    MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("DirectDispatch",
+                   "Run the zero-delay continuations of L2R handlers (forwarding, "
+                   "TC-IE rebroadcast, NLM-IE) when the handler returns instead "
+                   "of scheduling an event for each",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_directDispatch),
+                   MakeBooleanChecker ())
+    .AddAttribute ("PathRecord",
+                   "Tag the data packets sent by this node with an L2R_PathTag "
+                   "and record its hops in it; the mesh root aggregates the "
+                   "records per depth",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_pathRecord),
+                   MakeBooleanChecker ())
+    .AddAttribute ("DropNoRoute",
+                   "Drop data frames for which OutputRoute found no next hop "
+                   "instead of sending them to 00:00, and count them in "
+                   "DropsNoRoute",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_dropNoRoute),
+                   MakeBooleanChecker ())
+    .AddAttribute ("ForwardingMode",
+                   "How data frames pick their next hop. SinglePath: the lowest-PQM "
+                   "ancestor within the LQT. Multipath: every ancestor within the "
+                   "LQT by smooth weighted round-robin, weighted by the queue, "
+                   "arrival rate and delay they advertise. Backpressure: the "
+                   "ancestor with the largest queue differential, counting the frame, "
+                   "holding the frame while every differential is negative",
+                   EnumValue (L2R_SINGLE_PATH),
+                   MakeEnumAccessor (&LrWpanMac::m_forwardingMode),
+                   MakeEnumChecker (L2R_SINGLE_PATH, "SinglePath",
+                                    L2R_MULTIPATH, "Multipath",
+                                    L2R_BACKPRESSURE, "Backpressure"))
+    .AddAttribute ("BackpressureRetry",
+                   "Time between two attempts to release the frames held by "
+                   "Backpressure forwarding",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&LrWpanMac::m_bpRetry),
+                   MakeTimeChecker (MicroSeconds (1)))
+    .AddAttribute ("BackpressureMaxHold",
+                   "Longest time Backpressure forwarding holds a frame before it "
+                   "is sent to the single-path next hop",
+                   TimeValue (MilliSeconds (500)),
+                   MakeTimeAccessor (&LrWpanMac::m_bpMaxHold),
+                   MakeTimeChecker ())
+    .AddAttribute ("PiggybackLoad",
+                   "Rewrite the PQM and TX queue size of the sending node into "
+                   "every data frame it queues, 4 more bytes per frame, so the "
+                   "receiver refreshes its routing table entry",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_piggybackLoad),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Overhear",
+                   "Refresh routing table entries from data frames addressed to "
+                   "other nodes too",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_overhear),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Aggregation",
+                   "Pack data frames for the same next hop into one L2R_AGGREGATE "
+                   "frame, with one length byte per frame",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_aggregation),
+                   MakeBooleanChecker ())
+    .AddAttribute ("AggregationMaxSize",
+                   "Largest aggregate in bytes, without the MAC header and trailer",
+                   UintegerValue (100),
+                   MakeUintegerAccessor (&LrWpanMac::m_aggMaxSize),
+                   MakeUintegerChecker<uint32_t> (4, LrWpanPhy::aMaxPhyPacketSize - aMinMPDUOverhead))
+    .AddAttribute ("AggregationMaxHold",
+                   "Longest time a data frame waits for others to share its frame",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&LrWpanMac::m_aggMaxHold),
+                   MakeTimeChecker ())
+    .AddAttribute ("NlmEnabled",
+                   "Broadcast an NLM-IE when the TX queue crosses NlmHighWatermark "
+                   "upwards or NlmLowWatermark downwards",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_nlmEnabled),
+                   MakeBooleanChecker ())
+    .AddAttribute ("NlmHighWatermark",
+                   "Fraction of MaxQueueSize at which a node becomes congested",
+                   DoubleValue (0.5),
+                   MakeDoubleAccessor (&LrWpanMac::m_nlmHigh),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("NlmLowWatermark",
+                   "Fraction of MaxQueueSize at which a congested node is no "
+                   "longer congested, below NlmHighWatermark",
+                   DoubleValue (0.25),
+                   MakeDoubleAccessor (&LrWpanMac::m_nlmLow),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("NlmMinInterval",
+                   "Minimum time between two NLM-IE of a node; a crossing within "
+                   "it is announced when it ends",
+                   TimeValue (MilliSeconds (50)),
+                   MakeTimeAccessor (&LrWpanMac::m_nlmMinInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("AdaptiveTcie",
+                   "On a mesh root, halve the TC-IE interval when the data frames "
+                   "since the last TC-IE show topology churn and grow it while the "
+                   "tree is stable",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_tcieAdaptive),
+                   MakeBooleanChecker ())
+    .AddAttribute ("TcieMinInterval",
+                   "Shortest TC-IE interval in seconds with AdaptiveTcie",
+                   UintegerValue (5),
+                   MakeUintegerAccessor (&LrWpanMac::m_tcieMin),
+                   MakeUintegerChecker<uint8_t> (1))
+    .AddAttribute ("TcieMaxInterval",
+                   "Longest TC-IE interval in seconds with AdaptiveTcie",
+                   UintegerValue (120),
+                   MakeUintegerAccessor (&LrWpanMac::m_tcieMax),
+                   MakeUintegerChecker<uint8_t> (1))
+    .AddAttribute ("TcieGrowStep",
+                   "Seconds added to the TC-IE interval after a stable interval",
+                   UintegerValue (5),
+                   MakeUintegerAccessor (&LrWpanMac::m_tcieGrowStep),
+                   MakeUintegerChecker<uint8_t> ())
+    .AddAttribute ("TcieHighChurn",
+                   "Fraction of the sources heard in an interval that changed "
+                   "depth or PQM above which the interval is halved",
+                   DoubleValue (0.2),
+                   MakeDoubleAccessor (&LrWpanMac::m_tcieHighChurn),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("TcieLowChurn",
+                   "Fraction of the sources heard in an interval that changed "
+                   "depth or PQM below which the interval grows",
+                   DoubleValue (0.05),
+                   MakeDoubleAccessor (&LrWpanMac::m_tcieLowChurn),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("TciePqmSwing",
+                   "Change of the PQM a source reports that counts as churn",
+                   UintegerValue (10),
+                   MakeUintegerAccessor (&LrWpanMac::m_tciePqmSwing),
+                   MakeUintegerChecker<uint16_t> (1))
+    .AddAttribute ("LinkEstimation",
+                   "Add the measured ETX and LQI of a neighbor's link to its LQM",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&LrWpanMac::m_linkEstimation),
+                   MakeBooleanChecker ())
+    .AddAttribute ("LinkWindow",
+                   "Unicast frames to a neighbor per ETX window",
+                   UintegerValue (5),
+                   MakeUintegerAccessor (&LrWpanMac::m_linkWindow),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("LinkAlpha",
+                   "Weight of the newest window, TC-IE or LQI sample in the link "
+                   "moving averages",
+                   DoubleValue (0.3),
+                   MakeDoubleAccessor (&LrWpanMac::m_linkAlpha),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("LinkMaxEtx",
+                   "ETX of a window in which no frame was acknowledged",
+                   DoubleValue (10),
+                   MakeDoubleAccessor (&LrWpanMac::m_linkMaxEtx),
+                   MakeDoubleChecker<double> (1))
+    .AddAttribute ("LinkLqiWeight",
+                   "LQM added to a link at LQI 0, scaled down linearly to 0 at LQI 255",
+                   DoubleValue (10),
+                   MakeDoubleAccessor (&LrWpanMac::m_linkLqiWeight),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("ParentSwitchMargin",
+                   "PQM by which a neighbor must beat the current parent to "
+                   "replace it, 0 to switch to any lower PQM",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::m_parentMargin),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("ParentMinDwell",
+                   "Minimum time a parent is kept before a better neighbor can "
+                   "replace it, unless its entry is gone",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&LrWpanMac::m_parentMinDwell),
+                   MakeTimeChecker ())
+    .AddAttribute ("DropsQueueFull", "Data frames refused by McpsDataRequest because the TX queue is full",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_QUEUE_FULL>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsRxQueueFull", "Data frames refused at reception because the TX queue is full",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_RX_QUEUE_FULL>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsNoRoute", "Data frames dropped because there is no next hop, with DropNoRoute",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_NO_ROUTE>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsChannelAccess", "Frames dropped because CSMA/CA found no clear channel",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_CHANNEL_ACCESS>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsRetries", "Frames dropped after the maximum number of retransmissions",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_RETRIES>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsPhyTx", "Frames the PHY failed to send",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_PHY_TX>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsFcs", "Received frames dropped for a bad FCS",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_FCS>),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("DropsPhyRx", "Frames dropped by the PHY at reception",
+                   TypeId::ATTR_GET,
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&LrWpanMac::GetDrops<L2R_DROP_PHY_RX>),
+                   MakeUintegerChecker<uint32_t> ())
     .AddTraceSource ("MacTxEnqueue",
                      "Trace source indicating a packet has been "
                      "enqueued in the transaction queue",
@@ -103,6 +325,11 @@ LrWpanMac::GetTypeId (void)
                      "but dropped before being forwarded up the stack",
                      MakeTraceSourceAccessor (&LrWpanMac::m_macRxDropTrace),
                      "ns3::Packet::TracedCallback")
+    .AddTraceSource ("L2rDrop",
+                     "Trace source indicating a frame was dropped, "
+                     "with the reason it was dropped for",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_l2rDropTrace),
+                     "ns3::LrWpanMac::DropTracedCallback")
     .AddTraceSource ("Sniffer",
                      "Trace source simulating a non-promiscuous "
                      "packet sniffer attached to the device",
@@ -126,6 +353,39 @@ LrWpanMac::GetTypeId (void)
                      "the sent packet",
                      MakeTraceSourceAccessor (&LrWpanMac::m_sentPktTrace),
                      "ns3::LrWpanMac::SentTracedCallback")
+    .AddTraceSource ("QueueOccupancy",
+                     "Number of frames in the transaction queue",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_queueOccupancy),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("ForwardedFrames",
+                     "Number of data frames this node queued for its next hop "
+                     "on behalf of other nodes",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_forwardedFrames),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("TcIeFrames",
+                     "Number of TC-IE frames queued for transmission",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_tcIeFrames),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("DIeFrames",
+                     "Number of D-IE frames queued for transmission",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_dIeFrames),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("NlmFrames",
+                     "Number of NLM-IE frames queued for transmission",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_nlmFrames),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("ParentChanges",
+                     "Number of times the L2R parent of this node changed",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_parentChanges),
+                     "ns3::TracedValueCallback::Uint32")
+    .AddTraceSource ("Pqm",
+                     "The L2R path quality metric of this node",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_pqm),
+                     "ns3::TracedValueCallback::Uint16")
+    .AddTraceSource ("Depth",
+                     "The L2R depth of this node",
+                     MakeTraceSourceAccessor (&LrWpanMac::m_depth),
+                     "ns3::TracedValueCallback::Uint16")
   ;
   return tid;
 }
@@ -172,6 +432,45 @@ LrWpanMac::LrWpanMac ()
   m_internalLoad = 0;
   m_totalPacketDroppedEverySecond = 0;
   m_queueSize = 0;
+  m_directDispatch = false;
+  m_handlerDepth = 0;
+  m_directDispatchCount = 0;
+  for (uint32_t r = 0; r < L2R_DROP_REASON_COUNT; r++)
+    {
+      m_drops[r] = 0;
+    }
+  m_parent = Mac16Address ("00:00");
+  m_heldCandidate = Mac16Address ("00:00");
+  m_parentChanges = 0;
+  m_parentSwitchesHeld = 0;
+  m_tcieChanges = 0;
+  m_tcieAdaptations = 0;
+  m_queueOccupancy = 0;
+  m_forwardedFrames = 0;
+  m_tcIeFrames = 0;
+  m_dIeFrames = 0;
+  m_nlmFrames = 0;
+  m_pathRecord = false;
+  m_dropNoRoute = false;
+  m_pathPackets = 0;
+  m_pathDelaySum = 0;
+  m_pathRecordedSum = 0;
+  m_forwardingMode = L2R_SINGLE_PATH;
+  m_bpReleasing = false;
+  m_bpHeldFrames = 0;
+  m_nlmEnabled = false;
+  m_piggybackLoad = false;
+  m_overhear = false;
+  m_piggybackUpdates = 0;
+  m_aggregation = false;
+  m_aggMaxSize = 100;
+  m_aggFlushing = false;
+  m_aggFrames = 0;
+  m_aggPackets = 0;
+  m_nlmHigh = 0.5;
+  m_nlmLow = 0.25;
+  m_nlmCongested = false;
+  m_lastNlm = Seconds (-1);
 }
 
 LrWpanMac::~LrWpanMac ()
@@ -189,6 +488,7 @@ LrWpanMac::DoInitialize ()
     {
       m_phy->PlmeSetTRXStateRequest (IEEE_802_15_4_PHY_TRX_OFF);
     }
+  m_linkEstimator.SetParameters (m_linkWindow, m_linkAlpha, m_linkMaxEtx);
 
   Object::DoInitialize ();
 }
@@ -208,9 +508,21 @@ LrWpanMac::DoDispose ()
       delete m_txQueue[i];
     }
   m_txQueue.clear ();
+  m_queueOccupancy = 0;
+  m_deferred.clear ();
+  m_deferredRun.Cancel ();
+  m_bpHold.clear ();
+  m_bpReleaseEvent.Cancel ();
+  m_nlmHoldoff.Cancel ();
+  for (std::map<Mac16Address, AggregateBuffer>::iterator i = m_aggBuffers.begin (); i != m_aggBuffers.end (); ++i)
+    {
+      i->second.flush.Cancel ();
+    }
+  m_aggBuffers.clear ();
   m_phy = 0;
   m_mcpsDataIndicationCallback = MakeNullCallback< void, McpsDataIndicationParams, Ptr<Packet> > ();
   m_mcpsDataConfirmCallback = MakeNullCallback< void, McpsDataConfirmParams > ();
+  m_l2rRecordCallback = MakeNullCallback< void, Mac16Address, Ptr<Packet> > ();
 
   Object::DoDispose ();
 }
@@ -311,10 +623,36 @@ LrWpanMac::McpsDataRequest (McpsDataRequestParams params, Ptr<Packet> p)
     }
 
     //AM: modified on 12/12
-    if(l2rH.GetMsgType() == DataHeader && m_txQueue.size() >= m_maxQueueSize)
+    if((l2rH.GetMsgType() == DataHeader || l2rH.GetMsgType() == L2R_AGGREGATE) && m_txQueue.size() >= m_maxQueueSize)
     {
       NS_LOG_LOGIC(this << " can't send packet queue is full: ");
       ++m_totalPacketDroppedByNode;
+      L2R_Drop (p, L2R_DROP_QUEUE_FULL);
+      return;
+    }
+    if(m_dropNoRoute && l2rH.GetMsgType() == DataHeader && params.m_dstAddr == Mac16Address ("00:00"))
+    {
+      // OutputRoute found no parent; the frame would only burn its retries
+      NS_LOG_LOGIC(this << " can't send packet, no route to the mesh root");
+      L2R_Drop (p, L2R_DROP_NO_ROUTE);
+      return;
+    }
+    if(l2rH.GetMsgType() == DataHeader && m_forwardingMode == L2R_BACKPRESSURE && !m_bpReleasing
+       && L2R_BackpressureHold (params, p))
+    {
+      return;
+    }
+    if(l2rH.GetMsgType() == DataHeader && (m_piggybackLoad || l2rH.HasHopLoad ()))
+    {
+      // A hop load left by the previous hop must not be passed on as ours
+      p->RemoveHeader (l2rH);
+      l2rH.SetHopLoad (m_pqm, m_txQueue.size ());
+      p->AddHeader (l2rH);
+    }
+    if(l2rH.GetMsgType() == DataHeader && m_aggregation && !m_aggFlushing
+       && params.m_dstAddr != Mac16Address ("ff:ff"))
+    {
+      L2R_Aggregate (params, p);
       return;
     }
   switch (params.m_srcAddrMode)
@@ -466,12 +804,39 @@ LrWpanMac::McpsDataRequest (McpsDataRequestParams params, Ptr<Packet> p)
 
   m_macTxEnqueueTrace (p);
 
+  if (m_pathRecord && l2rH.GetMsgType () == DataHeader)
+    {
+      L2R_PathTag pathTag;
+      if (!p->PeekPacketTag (pathTag))
+        {
+          pathTag.SetOrigin (Simulator::Now ());
+          p->AddPacketTag (pathTag);
+        }
+    }
+
   TxQueueElement *txQElement = new TxQueueElement;
   txQElement->txQMsduHandle = params.m_msduHandle;
   txQElement->txQPkt = p;
+  txQElement->txQEnqueueTime = Simulator::Now ();
   /*if(l2rH.GetMsgType() == DataHeader)
     ++m_queueSize;*/
   m_txQueue.push_back (txQElement);
+  m_queueOccupancy = m_txQueue.size ();
+  L2R_CheckCongestion ();
+  switch (l2rH.GetMsgType ())
+    {
+    case TC_IE:
+      ++m_tcIeFrames;
+      break;
+    case L2R_D_IE:
+      ++m_dIeFrames;
+      break;
+    case NLM_IE:
+      ++m_nlmFrames;
+      break;
+    default:
+      break;
+    }
   CheckQueue ();
 }
 
@@ -485,25 +850,36 @@ LrWpanMac::CheckQueue ()
     {
       TxQueueElement *txQElement = m_txQueue.front ();
       m_txPkt = txQElement->txQPkt;
+      m_txQueueSojourn = Simulator::Now () - txQElement->txQEnqueueTime;
+      m_txCsmaTime = Seconds (0);
       //AM: modified on 4/12
-      L2R_Header l2rHeader;
-      m_txPkt->PeekHeader(l2rHeader);
-      if(!m_isSink && l2rHeader.GetMsgType() == DataHeader)
+      L2R_Header l2rHeader = L2R_PeekHeader (m_txPkt);
+      if(!m_isSink && (l2rHeader.GetMsgType() == DataHeader || l2rHeader.GetMsgType() == L2R_AGGREGATE))
       {
         Time now = Simulator::Now ();
-        //m_delayForEachPacket.insert(std::make_pair (m_txPkt->GetUid(), now));
-        std::map<uint64_t, Time>::const_iterator i = m_delayForEachPacket.find (m_txPkt->GetUid());
-        if(i != m_delayForEachPacket.end())
+        // An aggregate resolves the delay of every frame it carries
+        std::vector<uint64_t> uids (1, m_txPkt->GetUid ());
+        L2R_UidTag uidTag;
+        if (m_txPkt->PeekPacketTag (uidTag))
         {
-          if (m_avgDelay.size() > 10)
-            m_avgDelay.pop();
-          
-          m_avgDelay.push(now.GetSeconds () - i->second.GetSeconds ());
-          m_delayForEachPacket.erase(i);
+          uids = uidTag.GetUids ();
+        }
+        for (std::vector<uint64_t>::const_iterator uid = uids.begin (); uid != uids.end (); ++uid)
+        {
+          //m_delayForEachPacket.insert(std::make_pair (m_txPkt->GetUid(), now));
+          std::map<uint64_t, Time>::iterator i = m_delayForEachPacket.find (*uid);
+          if(i != m_delayForEachPacket.end())
+          {
+            if (m_avgDelay.size() > 10)
+              m_avgDelay.pop();
+
+            m_avgDelay.push(now.GetSeconds () - i->second.GetSeconds ());
+            m_delayForEachPacket.erase(i);
+          }
         }
       }
       //end
-      m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_CSMA);
+      m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_CSMA);
     }
 }
 
@@ -517,6 +893,7 @@ void
 LrWpanMac::SetPhy (Ptr<LrWpanPhy> phy)
 {
   m_phy = phy;
+  m_phy->TraceConnectWithoutContext ("PhyRxDrop", MakeCallback (&LrWpanMac::PhyRxDrop, this));
 }
 
 Ptr<LrWpanPhy>
@@ -541,6 +918,11 @@ void LrWpanMac::SetMeshRootRxMsgUpdateCallback (meshRootRxMsgCallback c)
   m_meshRxMsgCallback = c;
 }
 void
+LrWpanMac::SetL2rRecordCallback (L2rRecordCallback c)
+{
+  m_l2rRecordCallback = c;
+}
+void
 LrWpanMac::SetMcpsDataConfirmCallback (McpsDataConfirmCallback c)
 {
   m_mcpsDataConfirmCallback = c;
@@ -553,6 +935,7 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
 
   NS_LOG_FUNCTION (this << psduLength << p << (uint16_t)lqi);
 
+  L2R_EnterHandler ();
   bool acceptFrame;
 
   // from sec 7.5.6.2 Reception and rejection, Std802.15.4-2006
@@ -567,7 +950,6 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
 
   Ptr<Packet> originalPkt = p->Copy (); // because we will strip headers
   L2R_Header l2rHeader;
-  p->PeekHeader(l2rHeader);
   m_promiscSnifferTrace (originalPkt);
 
   m_macPromiscRxTrace (originalPkt);
@@ -584,11 +966,16 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
   if (!receivedMacTrailer.CheckFcs (p))
     {
       m_macRxDropTrace (originalPkt);
+      L2R_Drop (originalPkt, L2R_DROP_FCS);
     }
   else
     {
       LrWpanMacHeader receivedMacHdr;
       p->RemoveHeader (receivedMacHdr);
+      if (receivedMacHdr.IsData ())
+        {
+          p->PeekHeader (l2rHeader);
+        }
 
       McpsDataIndicationParams params;
       params.m_dsn = receivedMacHdr.GetSeqNum ();
@@ -689,14 +1076,10 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
               acceptFrame = receivedMacHdr.GetSrcPanId () == m_macPanId; // \todo need to check if PAN coord
             }
                         //Added new filtering layer check queue
-          if (acceptFrame && (m_isSink || (l2rHeader.GetMsgType() != DataHeader)||(m_txQueue.size() < (m_maxQueueSize)))) //AM: Modified at 3/12
+          if (acceptFrame && (m_isSink || (l2rHeader.GetMsgType() != DataHeader && l2rHeader.GetMsgType() != L2R_AGGREGATE)||(m_txQueue.size() < (m_maxQueueSize)))) //AM: Modified at 3/12
             {
               /*if(l2rHeader.GetMsgType() == DataHeader)
                 std::cout << "L2r-Queue Size Accepted: " <<m_l2rQueue.size() << std::endl;*/
-             /* if(m_txQueue.size () >= m_maxQueueSize * 0.5)
-              {
-                //SendNlmMsg();
-              }*/
               /*std::cout <<(Simulator::Now ()).GetSeconds () <<"A packet Rx By Mac: " << params.m_dstAddr <<" From:" << params.m_srcAddr<< " Queue Size = " << m_txQueue.size () 
                         <<"LQI " << (uint16_t)lqi <<std::endl;*/
               m_macRxTrace (originalPkt);
@@ -728,10 +1111,21 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
                   // Cancel any pending MAC state change, ACKs have higher priority.
                   m_setMacState.Cancel ();
                   ChangeMacState (MAC_IDLE);
-                  m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SendAck, this, receivedMacHdr.GetSeqNum ());
+                  m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_SEND_ACK, Time (0), &LrWpanMac::SendAck, this, receivedMacHdr.GetSeqNum ());
                 }
 
-              if (receivedMacHdr.IsData () && !m_mcpsDataIndicationCallback.IsNull ())
+              if (receivedMacHdr.IsData () && !m_mcpsDataIndicationCallback.IsNull ()
+                  && l2rHeader.GetMsgType () == L2R_AGGREGATE)
+                {
+                  // Hand every frame of the aggregate up as if received alone
+                  std::vector<Ptr<Packet> > parts = L2R_Deaggregate (p);
+                  for (std::vector<Ptr<Packet> >::iterator part = parts.begin (); part != parts.end (); ++part)
+                    {
+                      RecieveL2RPacket (params, *part);
+                      m_mcpsDataIndicationCallback (params, *part);
+                    }
+                }
+              else if (receivedMacHdr.IsData () && !m_mcpsDataIndicationCallback.IsNull ())
                 {
                   // If it is a data frame, push it up the stack.
                   NS_LOG_DEBUG ("PdDataIndication():  Packet is for me; forwarding up");
@@ -758,10 +1152,11 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
                       // If it is an ACK with the expected sequence number, finish the transmission
                       // and notify the upper layer.
                       m_ackWaitTimeout.Cancel ();
+                      L2R_NoteTxOutcome (true);
                       if (!m_mcpsDataConfirmCallback.IsNull ())
                         {
                           //AM: modified on 4/11 5:39 AM
-                          std::cout << "location 1 recieved packet*******************" << std::endl;
+                          LRWPAN_DIAG (TX_ACKED, "location 1 recieved packet*******************");
                           TxQueueElement *txQElement = m_txQueue.front ();
                           McpsDataConfirmParams confirmParams;
                           confirmParams.m_msduHandle = txQElement->txQMsduHandle;
@@ -770,7 +1165,7 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
                         }
                       RemoveFirstTxQElement ();
                       m_setMacState.Cancel ();
-                      m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
+                      m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
                     }
                   else
                     {
@@ -779,12 +1174,12 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
                       if (!PrepareRetransmission ())
                         {
                           m_setMacState.Cancel ();
-                          m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
+                          m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
                         }
                       else
                         {
                           m_setMacState.Cancel ();
-                          m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_CSMA);
+                          m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_CSMA);
                         }
                     }
                 }
@@ -793,19 +1188,40 @@ LrWpanMac::PdDataIndication (uint32_t psduLength, Ptr<Packet> p, uint8_t lqi)
             {
               if(acceptFrame)
                 { 
-                  if((l2rHeader.GetMsgType() == DataHeader))
+                  if((l2rHeader.GetMsgType() == DataHeader || l2rHeader.GetMsgType() == L2R_AGGREGATE))
                   { 
-                    std::cout <<(Simulator::Now ()).GetSeconds () <<"A packet dropped By Mac: " << params.m_dstAddr <<" From:" << params.m_srcAddr<< " Queue Size = " << m_txQueue.size() 
-                            <<" exceeds the limit: " << m_maxQueueSize << std::endl;
+                    LRWPAN_DIAG (RX_QUEUE_DROP, (Simulator::Now ()).GetSeconds () <<"A packet dropped By Mac: " << params.m_dstAddr <<" From:" << params.m_srcAddr<< " Queue Size = " << m_txQueue.size() 
+                                 <<" exceeds the limit: " << m_maxQueueSize);
                     ++m_totalPacketDroppedByNode;
+                    L2R_Drop (originalPkt, L2R_DROP_RX_QUEUE_FULL);
                     //std::cout << "L2r-Queue Size Drop: " <<m_l2rQueue.size() << std::endl;
                   }
                 }
+              else if (m_overhear && receivedMacHdr.IsData () && params.m_srcAddrMode == SHORT_ADDR
+                       && (l2rHeader.GetMsgType () == DataHeader || l2rHeader.GetMsgType () == L2R_AGGREGATE))
+                {
+                  bool hasData = true;
+                  if (l2rHeader.GetMsgType () == L2R_AGGREGATE)
+                    {
+                      // The frames of an aggregate carry the same hop load
+                      std::vector<Ptr<Packet> > parts = L2R_Deaggregate (p);
+                      hasData = !parts.empty ();
+                      if (hasData)
+                        {
+                          parts.front ()->PeekHeader (l2rHeader);
+                        }
+                    }
+                  if (hasData)
+                    {
+                      L2R_UpdateFromData (params.m_srcAddr, l2rHeader);
+                    }
+                }
               m_macRxDropTrace (originalPkt);
               
             }
         }
     }
+  L2R_ExitHandler ();
 }
 
 void
@@ -855,6 +1271,8 @@ LrWpanMac::RemoveFirstTxQElement ()
   txQElement->txQPkt = 0;
   delete txQElement;
   m_txQueue.pop_front ();
+  m_queueOccupancy = m_txQueue.size ();
+  L2R_CheckCongestion ();
   m_txPkt = 0;
   m_retransmission = 0;
   m_numCsmacaRetry = 0;
@@ -890,6 +1308,8 @@ LrWpanMac::PrepareRetransmission (void)
       // remove the copy of the packet that was just sent
       TxQueueElement *txQElement = m_txQueue.front ();
       m_macTxDropTrace (txQElement->txQPkt);
+      L2R_Drop (txQElement->txQPkt, L2R_DROP_RETRIES);
+      L2R_NoteTxOutcome (false);
       if (!m_mcpsDataConfirmCallback.IsNull ())
         {
           McpsDataConfirmParams confirmParams;
@@ -932,9 +1352,9 @@ LrWpanMac::PdDataConfirm (LrWpanPhyEnumeration status)
               // start retransmission timer
               Time waitTime = MicroSeconds (GetMacAckWaitDuration () * 1000 * 1000 / m_phy->GetDataOrSymbolRate (false));
               NS_ASSERT (m_ackWaitTimeout.IsExpired ());
-              m_ackWaitTimeout = Simulator::Schedule (waitTime, &LrWpanMac::AckWaitTimeout, this);
+              m_ackWaitTimeout = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_ACK_TIMEOUT, waitTime, &LrWpanMac::AckWaitTimeout, this);
               m_setMacState.Cancel ();
-              m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_ACK_PENDING);
+              m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_ACK_PENDING);
               return;
             }
           else
@@ -970,6 +1390,7 @@ LrWpanMac::PdDataConfirm (LrWpanPhyEnumeration status)
           NS_ASSERT_MSG (m_txQueue.size () > 0, "TxQsize = 0");
           TxQueueElement *txQElement = m_txQueue.front ();
           m_macTxDropTrace (txQElement->txQPkt);
+          L2R_Drop (txQElement->txQPkt, L2R_DROP_PHY_TX);
           if (!m_mcpsDataConfirmCallback.IsNull ())
             {
               McpsDataConfirmParams confirmParams;
@@ -993,7 +1414,7 @@ LrWpanMac::PdDataConfirm (LrWpanPhyEnumeration status)
     }
 
   m_setMacState.Cancel ();
-  m_setMacState = Simulator::ScheduleNow (&LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
+  m_setMacState = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::MAC_STATE, Time (0), &LrWpanMac::SetLrWpanMacState, this, MAC_IDLE);
 }
 
 void
@@ -1026,14 +1447,13 @@ LrWpanMac::PlmeSetTRXStateConfirm (LrWpanPhyEnumeration status)
   if (m_lrWpanMacState == MAC_SENDING && (status == IEEE_802_15_4_PHY_TX_ON || status == IEEE_802_15_4_PHY_SUCCESS))
     {
       NS_ASSERT (m_txPkt);
-      L2R_Header l2rH;
-      m_txPkt->PeekHeader (l2rH);
+      L2R_Header l2rH = L2R_PeekHeader (m_txPkt);
       // Start sending if we are in state SENDING and the PHY transmitter was enabled.
       m_promiscSnifferTrace (m_txPkt);
       m_snifferTrace (m_txPkt);
       m_macTxTrace (m_txPkt);
-      if(l2rH.GetMsgType () == DataHeader && m_queueSize > 0)
-        --m_queueSize;
+      uint16_t dataFrames = l2rH.GetMsgType () == DataHeader ? 1 : l2rH.GetAggregateLengths ().size ();
+      m_queueSize -= std::min (m_queueSize, dataFrames);
       m_phy->PdDataRequest (m_txPkt->GetSize (), m_txPkt);
     }
   else if (m_lrWpanMacState == MAC_CSMA && (status == IEEE_802_15_4_PHY_RX_ON || status == IEEE_802_15_4_PHY_SUCCESS))
@@ -1098,11 +1518,14 @@ LrWpanMac::SetLrWpanMacState (LrWpanMacState macState)
       NS_ASSERT (m_lrWpanMacState == MAC_IDLE || m_lrWpanMacState == MAC_ACK_PENDING);
 
       ChangeMacState (MAC_CSMA);
+      m_txCsmaStart = Simulator::Now ();
       m_phy->PlmeSetTRXStateRequest (IEEE_802_15_4_PHY_RX_ON);
     }
   else if (m_lrWpanMacState == MAC_CSMA && macState == CHANNEL_IDLE)
     {
       // Channel is idle, set transmitter to TX_ON
+      m_txCsmaTime += Simulator::Now () - m_txCsmaStart;
+      L2R_RecordHop ();
       ChangeMacState (MAC_SENDING);
       m_phy->PlmeSetTRXStateRequest (IEEE_802_15_4_PHY_TX_ON);
     }
@@ -1115,6 +1538,7 @@ LrWpanMac::SetLrWpanMacState (LrWpanMacState macState)
       confirmParams.m_msduHandle = m_txQueue.front ()->txQMsduHandle;
       confirmParams.m_status = IEEE_802_15_4_CHANNEL_ACCESS_FAILURE;
       m_macTxDropTrace (m_txPkt);
+      L2R_Drop (m_txPkt, L2R_DROP_CHANNEL_ACCESS);
       if (!m_mcpsDataConfirmCallback.IsNull ())
         {
           m_mcpsDataConfirmCallback (confirmParams);
@@ -1199,6 +1623,9 @@ L2R_Header::L2R_Header ()
   m_queueSize = 0;
   m_arrivalRate = 0;
   m_avgDelay =0;
+  m_hopLoad = false;
+  m_hopPqm = 0;
+  m_hopQueueSize = 0;
 }
 L2R_Header::~L2R_Header ()
 {
@@ -1256,10 +1683,17 @@ L2R_Header::GetSerializedSize (void) const
   case L2R_D_IE:
     break;
   case DataHeader:
-    size += 14;
+    size += m_hopLoad ? 18 : 14;
     break;
   case NLM_IE:
-    size +=10;
+    size +=12;
+    break;
+  case L2R_AGGREGATE:
+    // no root address: type, count and one length per frame
+    size = 2 + m_aggLengths.size ();
+    break;
+  case L2R_AGG_RECORD:
+    // source address only
     break;
   }
   return size;
@@ -1269,7 +1703,8 @@ L2R_Header::Serialize (Buffer::Iterator start) const
 {
   // we can serialize two bytes at the start of the buffer.
   // we write them in network byte order.
-  start.WriteU8(m_msgType);
+  // A data frame with a hop load goes out as type 5
+  start.WriteU8 (m_msgType == DataHeader && m_hopLoad ? 5 : m_msgType);
   switch (m_msgType)
   {
   case TC_IE:
@@ -1293,12 +1728,28 @@ L2R_Header::Serialize (Buffer::Iterator start) const
     start.WriteHtonU16 (m_queueSize);
     start.WriteHtonU32 (m_avgDelay);
     start.WriteHtonU32 (m_arrivalRate);
+    if (m_hopLoad)
+      {
+        start.WriteHtonU16 (m_hopPqm);
+        start.WriteHtonU16 (m_hopQueueSize);
+      }
     break;
   case NLM_IE:
+    start.WriteHtonU16 (m_PQM);
     start.WriteHtonU16 (m_queueSize);
     start.WriteHtonU32 (m_avgDelay);
     start.WriteHtonU32 (m_arrivalRate);
     break;
+  case L2R_AGG_RECORD:
+    WriteTo (start, m_srcAddress);
+    break;
+  case L2R_AGGREGATE:
+    start.WriteU8 (m_aggLengths.size ());
+    for (uint32_t n = 0; n < m_aggLengths.size (); n++)
+      {
+        start.WriteU8 (m_aggLengths[n]);
+      }
+    break;
   }
 }
 uint32_t
@@ -1309,6 +1760,11 @@ L2R_Header::Deserialize (Buffer::Iterator start)
   // in host byte order.
   Buffer::Iterator i = start;
   m_msgType = i.ReadU8();
+  m_hopLoad = m_msgType == 5;
+  if (m_hopLoad)
+    {
+      m_msgType = DataHeader;
+    }
   switch (m_msgType)
   {
   case 0:
@@ -1332,12 +1788,28 @@ L2R_Header::Deserialize (Buffer::Iterator start)
     m_queueSize = i.ReadNtohU16 ();
     m_avgDelay = i.ReadNtohU32 ();
     m_arrivalRate = i.ReadNtohU32 ();
+    if (m_hopLoad)
+      {
+        m_hopPqm = i.ReadNtohU16 ();
+        m_hopQueueSize = i.ReadNtohU16 ();
+      }
     break;
   case 3:
+    m_PQM = i.ReadNtohU16 ();
     m_queueSize = i.ReadNtohU16 ();
     m_avgDelay = i.ReadNtohU32 ();
     m_arrivalRate = i.ReadNtohU32 ();
     break;
+  case 7:
+    ReadFrom (i, m_srcAddress);
+    break;
+  case 6:
+    m_aggLengths.resize (i.ReadU8 ());
+    for (uint32_t n = 0; n < m_aggLengths.size (); n++)
+      {
+        m_aggLengths[n] = i.ReadU8 ();
+      }
+    break;
   }
   uint32_t dist = i.GetDistanceFrom (start);
   // we return the number of bytes effectively read.
@@ -1430,8 +1902,17 @@ L2R_Header::GetMsgType (void) const
     case 2:
       return DataHeader;
       break;
+    case 3:
+      return NLM_IE;
+      break;
+    case 6:
+      return L2R_AGGREGATE;
+      break;
+    case 7:
+      return L2R_AGG_RECORD;
+      break;
     default:
-      return DataHeader;
+      return NotL2R;
     }
 }
 uint16_t L2R_Header::GetLQT(void) const
@@ -1458,6 +1939,208 @@ L2R_Header::GetSrcAddress(void) const
 {
   return m_srcAddress;
 }
+void
+L2R_Header::SetHopLoad (uint16_t pqm, uint16_t queueSize)
+{
+  m_hopLoad = true;
+  m_hopPqm = pqm;
+  m_hopQueueSize = queueSize;
+}
+bool
+L2R_Header::HasHopLoad (void) const
+{
+  return m_hopLoad;
+}
+uint16_t
+L2R_Header::GetHopPqm (void) const
+{
+  return m_hopPqm;
+}
+uint16_t
+L2R_Header::GetHopQueueSize (void) const
+{
+  return m_hopQueueSize;
+}
+void
+L2R_Header::SetAggregateLengths (const std::vector<uint8_t> &lengths)
+{
+  m_aggLengths = lengths;
+}
+const std::vector<uint8_t> &
+L2R_Header::GetAggregateLengths (void) const
+{
+  return m_aggLengths;
+}
+
+L2R_PathTag::L2R_PathTag ()
+  : m_origin (0)
+{
+}
+
+TypeId
+L2R_PathTag::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::L2R_PathTag")
+    .SetParent<Tag> ()
+    .AddConstructor<L2R_PathTag> ()
+  ;
+  return tid;
+}
+TypeId
+L2R_PathTag::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+uint32_t
+L2R_PathTag::GetSerializedSize (void) const
+{
+  // origin, hop count, then address, depth, retries, queue and CSMA/CA time
+  return 9 + m_hops.size () * 12;
+}
+void
+L2R_PathTag::Serialize (TagBuffer i) const
+{
+  i.WriteU64 (m_origin);
+  i.WriteU8 (m_hops.size ());
+  for (std::vector<Hop>::const_iterator h = m_hops.begin (); h != m_hops.end (); ++h)
+    {
+      uint8_t address[2];
+      h->address.CopyTo (address);
+      i.Write (address, 2);
+      i.WriteU8 (h->depth);
+      i.WriteU8 (h->retries);
+      i.WriteU32 (h->queueUs);
+      i.WriteU32 (h->csmaUs);
+    }
+}
+void
+L2R_PathTag::Deserialize (TagBuffer i)
+{
+  m_origin = i.ReadU64 ();
+  uint8_t nHops = i.ReadU8 ();
+  m_hops.resize (nHops);
+  for (std::vector<Hop>::iterator h = m_hops.begin (); h != m_hops.end (); ++h)
+    {
+      uint8_t address[2];
+      i.Read (address, 2);
+      h->address.CopyFrom (address);
+      h->depth = i.ReadU8 ();
+      h->retries = i.ReadU8 ();
+      h->queueUs = i.ReadU32 ();
+      h->csmaUs = i.ReadU32 ();
+    }
+}
+void
+L2R_PathTag::Print (std::ostream &os) const
+{
+  os << "origin=" << GetOrigin ().GetSeconds ();
+  for (std::vector<Hop>::const_iterator h = m_hops.begin (); h != m_hops.end (); ++h)
+    {
+      os << " [" << h->address << " depth=" << static_cast<uint32_t> (h->depth)
+         << " queue=" << h->queueUs << "us csma=" << h->csmaUs
+         << "us retries=" << static_cast<uint32_t> (h->retries) << "]";
+    }
+}
+void
+L2R_PathTag::SetOrigin (Time origin)
+{
+  m_origin = origin.GetNanoSeconds ();
+}
+Time
+L2R_PathTag::GetOrigin (void) const
+{
+  return NanoSeconds (m_origin);
+}
+bool
+L2R_PathTag::SetHop (const Hop &hop)
+{
+  if (!m_hops.empty () && m_hops.back ().address == hop.address)
+    {
+      m_hops.back () = hop;
+      return true;
+    }
+  if (m_hops.size () >= MAX_HOPS)
+    {
+      return false;
+    }
+  m_hops.push_back (hop);
+  return true;
+}
+const std::vector<L2R_PathTag::Hop> &
+L2R_PathTag::GetHops (void) const
+{
+  return m_hops;
+}
+
+L2R_UidTag::L2R_UidTag ()
+{
+}
+L2R_UidTag::L2R_UidTag (const std::vector<uint64_t> &uids)
+  : m_uids (uids)
+{
+}
+TypeId
+L2R_UidTag::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::L2R_UidTag")
+    .SetParent<Tag> ()
+    .AddConstructor<L2R_UidTag> ()
+  ;
+  return tid;
+}
+TypeId
+L2R_UidTag::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+uint32_t
+L2R_UidTag::GetSerializedSize (void) const
+{
+  // An aggregate holds at most 0xff frames
+  return 1 + m_uids.size () * 8;
+}
+void
+L2R_UidTag::Serialize (TagBuffer i) const
+{
+  i.WriteU8 (m_uids.size ());
+  for (std::vector<uint64_t>::const_iterator uid = m_uids.begin (); uid != m_uids.end (); ++uid)
+    {
+      i.WriteU64 (*uid);
+    }
+}
+void
+L2R_UidTag::Deserialize (TagBuffer i)
+{
+  m_uids.resize (i.ReadU8 ());
+  for (std::vector<uint64_t>::iterator uid = m_uids.begin (); uid != m_uids.end (); ++uid)
+    {
+      *uid = i.ReadU64 ();
+    }
+}
+void
+L2R_UidTag::Print (std::ostream &os) const
+{
+  os << "uids=";
+  for (std::vector<uint64_t>::const_iterator uid = m_uids.begin (); uid != m_uids.end (); ++uid)
+    {
+      os << (uid == m_uids.begin () ? "" : ",") << *uid;
+    }
+}
+const std::vector<uint64_t> &
+L2R_UidTag::GetUids (void) const
+{
+  return m_uids;
+}
+uint64_t
+L2R_UidTag::GetOriginalUid (Ptr<const Packet> p)
+{
+  L2R_UidTag tag;
+  if (p->PeekPacketTag (tag) && tag.GetUids ().size () == 1)
+    {
+      return tag.GetUids ().front ();
+    }
+  return p->GetUid ();
+}
 
 //AM: modified at 6/11 6:03
 //Routing Protocol
@@ -1476,6 +2159,7 @@ L2R_RoutingTableEntry::L2R_RoutingTableEntry (uint16_t depth,
     m_entriesChanged (areChanged)
 {
   m_nextHop = nextHop;
+  m_lqm = 0;
   m_l2rMissedTcIe = 0; 
   m_delayPar = 1;
   m_queuePar = 1;
@@ -1499,6 +2183,54 @@ L2R_RoutingTableEntry::Print (Ptr<OutputStreamWrapper> stream) const
                         << "s\t\t" <<std::setprecision (3)<< m_tcieInterval.GetSeconds () << "s\t\t\t"
                         << m_queuePar << "\t\t\t" << m_arrivalPar <<"\t\t\t" << m_delayPar <<"\n";
 }
+uint32_t
+L2R_RoutingTableEntry::GetSerializedSize (void)
+{
+  // addresses, depth, PQM, LQM, flag, missed TC-IE, changed flag,
+  // age, TC-IE interval and the three algorithm parameters
+  return 2 + 2 + 2 + 2 + 2 + 1 + 1 + 1 + 8 + 8 + 3 * 4;
+}
+void
+L2R_RoutingTableEntry::Serialize (Buffer::Iterator &i) const
+{
+  WriteTo (i, m_dst);
+  WriteTo (i, m_nextHop);
+  i.WriteHtonU16 (m_depth);
+  i.WriteHtonU16 (m_pqm);
+  i.WriteHtonU16 (m_lqm);
+  i.WriteU8 (m_flag);
+  i.WriteU8 (m_l2rMissedTcIe);
+  i.WriteU8 (m_entriesChanged ? 1 : 0);
+  i.WriteHtonU64 ((Simulator::Now () - m_lifeTime).GetTimeStep ());
+  i.WriteHtonU64 (m_tcieInterval.GetTimeStep ());
+  float pars[3] = { m_queuePar, m_delayPar, m_arrivalPar };
+  for (uint32_t k = 0; k < 3; k++)
+    {
+      uint32_t bits;
+      std::memcpy (&bits, &pars[k], sizeof (bits));
+      i.WriteHtonU32 (bits);
+    }
+}
+void
+L2R_RoutingTableEntry::Deserialize (Buffer::Iterator &i)
+{
+  ReadFrom (i, m_dst);
+  ReadFrom (i, m_nextHop);
+  m_depth = i.ReadNtohU16 ();
+  m_pqm = i.ReadNtohU16 ();
+  m_lqm = i.ReadNtohU16 ();
+  m_flag = static_cast<RouteFlags> (i.ReadU8 ());
+  m_l2rMissedTcIe = i.ReadU8 ();
+  m_entriesChanged = i.ReadU8 ();
+  m_lifeTime = Simulator::Now () - TimeStep (i.ReadNtohU64 ());
+  m_tcieInterval = TimeStep (i.ReadNtohU64 ());
+  float *pars[3] = { &m_queuePar, &m_delayPar, &m_arrivalPar };
+  for (uint32_t k = 0; k < 3; k++)
+    {
+      uint32_t bits = i.ReadNtohU32 ();
+      std::memcpy (pars[k], &bits, sizeof (bits));
+    }
+}
 bool
 L2R_RoutingTable::AddRoute (L2R_RoutingTableEntry & rt)
 {
@@ -1639,6 +2371,34 @@ L2R_RoutingTable::Print (Ptr<OutputStreamWrapper> stream) const
   *stream->GetStream () << "\n";
 }
 uint32_t
+L2R_RoutingTable::GetSerializedSize (void) const
+{
+  return 2 + m_mac16AddressEntry.size () * L2R_RoutingTableEntry::GetSerializedSize ();
+}
+void
+L2R_RoutingTable::Serialize (Buffer::Iterator &i) const
+{
+  i.WriteHtonU16 (m_mac16AddressEntry.size ());
+  for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator j = m_mac16AddressEntry.begin (); j
+       != m_mac16AddressEntry.end (); ++j)
+    {
+      j->second.Serialize (i);
+    }
+}
+void
+L2R_RoutingTable::Deserialize (Buffer::Iterator &i)
+{
+  Clear ();
+  m_macEvents.clear ();
+  uint16_t n = i.ReadNtohU16 ();
+  for (uint16_t k = 0; k < n; k++)
+    {
+      L2R_RoutingTableEntry rt;
+      rt.Deserialize (i);
+      AddRoute (rt);
+    }
+}
+uint32_t
 L2R_RoutingTable::RoutingTableSize ()
 {
   return m_mac16AddressEntry.size ();
@@ -1712,11 +2472,118 @@ L2R_RoutingTable::GetEventId (Mac16Address address)
       return i->second;
     }
 }
+L2R_LinkEstimator::Link::Link ()
+  : frames (0),
+    attempts (0),
+    acked (0),
+    etx (0),
+    lastMsn (0xffff),
+    tcIeRatio (0),
+    lqi (-1)
+{
+}
+L2R_LinkEstimator::L2R_LinkEstimator ()
+  : m_window (5),
+    m_alpha (0.3),
+    m_maxEtx (10)
+{
+}
+void
+L2R_LinkEstimator::SetParameters (uint32_t window, double alpha, double maxEtx)
+{
+  m_window = window;
+  m_alpha = alpha;
+  m_maxEtx = maxEtx;
+}
+double
+L2R_LinkEstimator::Smooth (double average, double sample, bool first) const
+{
+  return first ? sample : m_alpha * sample + (1 - m_alpha) * average;
+}
+bool
+L2R_LinkEstimator::NotifyTx (Mac16Address neighbor, uint32_t attempts, bool acked)
+{
+  Link &link = m_links[neighbor];
+  ++link.frames;
+  link.attempts += attempts;
+  link.acked += acked;
+  if (link.frames < m_window)
+    {
+      return false;
+    }
+  double etx = link.acked > 0 ? std::min (m_maxEtx, double (link.attempts) / link.acked) : m_maxEtx;
+  link.etx = Smooth (link.etx, etx, link.etx == 0);
+  link.frames = 0;
+  link.attempts = 0;
+  link.acked = 0;
+  return true;
+}
+void
+L2R_LinkEstimator::NotifyTcIe (Mac16Address neighbor, uint16_t msn)
+{
+  Link &link = m_links[neighbor];
+  if (link.lastMsn != 0xffff)
+    {
+      // A neighbor sends every MSN once, 0x00 to 0xf0 and over again
+      uint16_t gap = (msn + 0xf1 - link.lastMsn) % 0xf1;
+      if (gap == 0 || gap > 0xf1 / 2)
+        {
+          // A repeat, or an older TC-IE arriving late
+          return;
+        }
+      link.tcIeRatio = Smooth (link.tcIeRatio, 1.0 / gap, link.tcIeRatio == 0);
+    }
+  link.lastMsn = msn;
+}
+void
+L2R_LinkEstimator::NotifyLqi (Mac16Address neighbor, uint8_t lqi)
+{
+  Link &link = m_links[neighbor];
+  link.lqi = Smooth (link.lqi, lqi, link.lqi < 0);
+}
+double
+L2R_LinkEstimator::GetEtx (Mac16Address neighbor) const
+{
+  std::map<Mac16Address, Link>::const_iterator i = m_links.find (neighbor);
+  if (i == m_links.end ())
+    {
+      return 1;
+    }
+  if (i->second.etx > 0)
+    {
+      return i->second.etx;
+    }
+  if (i->second.tcIeRatio > 0)
+    {
+      // Broadcasts only show one direction; assume the link is symmetric.
+      // Losses upstream of the neighbor count against it as well
+      return std::min (m_maxEtx, 1 / (i->second.tcIeRatio * i->second.tcIeRatio));
+    }
+  return 1;
+}
+double
+L2R_LinkEstimator::GetLqi (Mac16Address neighbor) const
+{
+  std::map<Mac16Address, Link>::const_iterator i = m_links.find (neighbor);
+  return i == m_links.end () || i->second.lqi < 0 ? 255 : i->second.lqi;
+}
+double
+L2R_LinkEstimator::GetTcIeDeliveryRatio (Mac16Address neighbor) const
+{
+  std::map<Mac16Address, Link>::const_iterator i = m_links.find (neighbor);
+  return i == m_links.end () || i->second.tcIeRatio == 0 ? 1 : i->second.tcIeRatio;
+}
+void
+L2R_LinkEstimator::Clear (void)
+{
+  m_links.clear ();
+}
 void
 LrWpanMac::L2R_AssignL2RProtocolForSink(bool isSink, uint16_t lqt, uint8_t tcieInterval)
 {
   m_isSink = isSink;
   m_msn = 0xf0;
+  m_rootMsn.clear ();
   m_lqt = lqt;
   m_tcieInterval = tcieInterval;
   m_tcieIncr = 0;
@@ -1724,11 +2591,16 @@ LrWpanMac::L2R_AssignL2RProtocolForSink(bool isSink, uint16_t lqt, uint8_t tcieI
 void
 LrWpanMac::L2R_SendPeriodicUpdate()
 {
+  L2R_EnterHandler ();
   std::map <Mac16Address, L2R_RoutingTableEntry> removedAddresses;
   //m_routingTable.Purge (removedAddresses);
   if (m_isSink)
   {
     NS_LOG_FUNCTION (Seconds(Simulator::Now ()) << "Sending TC-IE by Sink ");
+    if (m_tcieAdaptive)
+      {
+        L2R_AdaptTcieInterval ();
+      }
     L2R_Header TC_IE_H;
     TC_IE_H.SetMeshRootAddress(m_rootAddress);
     TC_IE_H.SetMsgType(TC_IE);
@@ -1749,8 +2621,8 @@ LrWpanMac::L2R_SendPeriodicUpdate()
     params.m_dstAddr = "ff:ff";
     params.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
     params.m_txOptions = TX_OPTION_NONE;
-    Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,this,
-                             params, p0);
+    L2R_Dispatch (LrWpanEventProfiler::L2R_TCIE_TX, MakeEvent (&LrWpanMac::McpsDataRequest, this,
+                                                               params, p0));
     if(m_msn > 0xef && m_msn <= 0xff)
       m_msn = 0x00;
     else
@@ -1765,7 +2637,8 @@ LrWpanMac::L2R_SendPeriodicUpdate()
     TC_IE_H.SetMeshRootAddress(m_rootAddress);
     TC_IE_H.SetMsgType(TC_IE);
     TC_IE_H.SetPQM(m_pqm);
-    TC_IE_H.SetMSN(m_msn);
+    std::map<Mac16Address, uint16_t>::const_iterator msn = m_rootMsn.find (m_rootAddress);
+    TC_IE_H.SetMSN(msn != m_rootMsn.end () ? msn->second : m_msn);
     TC_IE_H.SetLQT(m_lqt);
     TC_IE_H.SetTCIEInterval(m_tcieInterval);
     TC_IE_H.SetDepth(m_depth);
@@ -1781,8 +2654,8 @@ LrWpanMac::L2R_SendPeriodicUpdate()
     params.m_dstAddr = "ff:ff";
     params.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
     params.m_txOptions = TX_OPTION_NONE;
-    Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,this,
-                             params, p0);
+    L2R_Dispatch (LrWpanEventProfiler::L2R_TCIE_TX, MakeEvent (&LrWpanMac::McpsDataRequest, this,
+                                                               params, p0));
   }
   for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator rmItr = removedAddresses.begin (); rmItr
            != removedAddresses.end (); ++rmItr)
@@ -1790,6 +2663,7 @@ LrWpanMac::L2R_SendPeriodicUpdate()
     NS_LOG_FUNCTION ("Update for removed record is: Destination: " << rmItr->second.GetNextHop()
                                                                 << " depth:" << rmItr->second.GetDepth());
   }
+  L2R_ExitHandler ();
 }
 void
 LrWpanMac::L2R_SendTopologyDiscovery()
@@ -1815,7 +2689,7 @@ LrWpanMac::L2R_SendTopologyDiscovery()
     params.m_dstAddr = "ff:ff";
     params.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
     params.m_txOptions = TX_OPTION_NONE;
-    Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,this,
+    LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_DISCOVERY_TX, Time (0), &LrWpanMac::McpsDataRequest, this,
                              params, p0);
     L2R_Start();
   }
@@ -1828,15 +2702,116 @@ LrWpanMac::L2R_Start()
   if(m_isSink)
     m_periodicUpdateTimer.Schedule (MicroSeconds(10000));//m_uniformRandomVariable->GetInteger (0,2000)));
 }
-void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet> p)
+uint32_t
+LrWpanMac::L2R_GetCheckpointSize (void) const
 {
-  L2R_Header L2rRxMsg;
-  Ptr<Packet> originalPkt = p->Copy (); // because we will strip headers
-  p->RemoveHeader(L2rRxMsg);
-  //McpsDataIndicationParams rxParams;
+  // address, role, LQT, MSN, depth, TC-IE interval, PQM, root, timer phase
+  return 2 + 1 + 2 + 2 + 2 + 1 + 2 + 2 + 8 + m_routingTable.GetSerializedSize ();
+}
+void
+LrWpanMac::L2R_SaveCheckpoint (Buffer::Iterator &i) const
+{
+  NS_LOG_FUNCTION (this);
+  WriteTo (i, m_shortAddress);
+  i.WriteU8 (m_isSink ? 1 : 0);
+  i.WriteHtonU16 (m_lqt);
+  i.WriteHtonU16 (m_msn);
+  i.WriteHtonU16 (m_depth);
+  i.WriteU8 (m_tcieInterval);
+  i.WriteHtonU16 (m_pqm);
+  WriteTo (i, m_rootAddress);
+  // -1 marks a timer that is not running
+  int64_t delayLeft = m_periodicUpdateTimer.IsRunning () ? m_periodicUpdateTimer.GetDelayLeft ().GetTimeStep () : -1;
+  i.WriteHtonU64 (delayLeft);
+  m_routingTable.Serialize (i);
+}
+void
+LrWpanMac::L2R_LoadCheckpoint (Buffer::Iterator &i)
+{
+  NS_LOG_FUNCTION (this);
+  Mac16Address address;
+  ReadFrom (i, address);
+  NS_ABORT_MSG_IF (address != m_shortAddress, "Checkpoint state of " << address
+                                              << " loaded into node " << m_shortAddress);
+  m_isSink = i.ReadU8 ();
+  m_lqt = i.ReadNtohU16 ();
+  m_msn = i.ReadNtohU16 ();
+  m_depth = i.ReadNtohU16 ();
+  m_tcieInterval = i.ReadU8 ();
+  m_pqm = i.ReadNtohU16 ();
+  ReadFrom (i, m_rootAddress);
+  int64_t delayLeft = i.ReadNtohU64 ();
+  m_routingTable.Deserialize (i);
+  m_rootMsn.clear ();
+  m_linkEstimator.Clear ();
+  if (!m_isSink && m_msn != 0xf0)
+    {
+      m_rootMsn[m_rootAddress] = m_msn;
+    }
+  L2R_RestoreParent ();
+
+  m_periodicUpdateTimer.Cancel ();
+  if (delayLeft >= 0)
+    {
+      if (m_uniformRandomVariable == 0)
+        {
+          m_uniformRandomVariable = CreateObject<UniformRandomVariable> ();
+        }
+      m_periodicUpdateTimer.SetFunction (&LrWpanMac::L2R_SendPeriodicUpdate,this);
+      m_periodicUpdateTimer.Schedule (TimeStep (delayLeft));
+    }
+}
+void
+LrWpanMac::L2R_SetBootstrapState (bool isSink, uint16_t depth, uint16_t pqm, Mac16Address root,
+                                  uint16_t lqt, uint8_t tcieInterval,
+                                  std::vector<L2R_RoutingTableEntry> &entries)
+{
+  NS_LOG_FUNCTION (this << isSink << depth << pqm << root);
+  m_isSink = isSink;
+  m_depth = depth;
+  m_pqm = pqm;
+  m_rootAddress = isSink ? m_shortAddress : root;
+  m_lqt = lqt;
+  m_tcieInterval = tcieInterval;
+  // The sink has already sent its discovery TC-IE (MSN 0xf0) and moved on
+  m_msn = isSink ? 0x00 : 0xf0;
+  m_rootMsn.clear ();
+  m_linkEstimator.Clear ();
+  m_tcieSources.clear ();
+  m_tcieChanges = 0;
+  m_routingTable.Clear ();
+  for (std::vector<L2R_RoutingTableEntry>::iterator i = entries.begin (); i != entries.end (); ++i)
+    {
+      m_routingTable.AddRoute (*i);
+    }
+  L2R_RestoreParent ();
+  m_periodicUpdateTimer.Cancel ();
+  if (isSink)
+    {
+      m_tcieIncr = 0;
+      m_uniformRandomVariable = CreateObject<UniformRandomVariable> ();
+      m_periodicUpdateTimer.SetFunction (&LrWpanMac::L2R_SendPeriodicUpdate,this);
+      m_periodicUpdateTimer.Schedule (Seconds (m_tcieInterval));
+    }
+}
+L2R_RoutingTable &
+LrWpanMac::GetRoutingTable (void)
+{
+  return m_routingTable;
+}
+void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet> p)
+{
+  L2R_Header L2rRxMsg;
+  Ptr<Packet> originalPkt = p->Copy (); // because we will strip headers
+  p->RemoveHeader(L2rRxMsg);
+  //McpsDataIndicationParams rxParams;
   Mac16Address sender = rxParams.m_srcAddr;
   Mac16Address receiver = rxParams.m_dstAddr;
   
+  if (m_linkEstimation)
+    {
+      m_linkEstimator.NotifyLqi (sender, rxParams.m_mpduLinkQuality);
+    }
   L2R_RoutingTableEntry tableEntry;
   EventId event;
   bool tableVerifier = m_routingTable.LookupRoute (sender,tableEntry);
@@ -1853,7 +2828,19 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
   uint32_t tempDelay = L2rRxMsg.GetDelay();
   float *arrRate = reinterpret_cast<float*>(&tempArrivalRate);
   float *entavgDelay3 = reinterpret_cast<float*>(&tempDelay);
-  m_tcieInterval = L2rRxMsg.GetTCIEInterval();
+  Mac16Address tcieRoot = L2rRxMsg.GetMeshRootAddress ();
+  // Every mesh root numbers its TC-IE on its own
+  std::map<Mac16Address, uint16_t>::iterator lastMsn = m_rootMsn.find (tcieRoot);
+  bool newer = tempMsn > 0xf0 || lastMsn == m_rootMsn.end () || L2R_IsNewerMsn (tempMsn, lastMsn->second);
+  if (m_linkEstimation && tempMsn <= 0xf0)
+    {
+      m_linkEstimator.NotifyTcIe (sender, tempMsn);
+    }
+  if (newer && !m_isSink)
+    {
+      // The interval the root chose travels with its TC-IE
+      m_tcieInterval = L2rRxMsg.GetTCIEInterval();
+    }
   NS_LOG_FUNCTION ("Received a TC-IE packet from "
                   << sender << " to " << receiver << ". Details are: Destination: " << L2rRxMsg.GetMeshRootAddress () << ", PQM: "
                   << L2rRxMsg.GetPQM () << ", depth: " << L2rRxMsg.GetDepth ());
@@ -1861,7 +2848,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
     {       
       if(!m_isSink && m_depth == 0)
       {
-        uint16_t tempLqm = 1; //ToDo What LQM should be for node with 1 depth
+        uint16_t tempLqm = 1 + L2R_LinkCost (sender);
         tempPqm += tempLqm;
         m_depth = tempDepth + 1;  
           L2R_RoutingTableEntry newEntry (
@@ -1872,14 +2859,18 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
                 sender,
                 false);
               newEntry.SetFlag (VALID);
+              newEntry.SetDestination (L2rRxMsg.GetMeshRootAddress ());
+              newEntry.SetLQM (tempLqm);
               newEntry.SetArrivalRatePar(*arrRate);
               newEntry.SetQueuePar(tempQueueSize);
               newEntry.SetDelayPar(*entavgDelay3);
               m_routingTable.AddRoute(newEntry);
               NS_LOG_FUNCTION ("New Route added to routing tables");
               m_depth = tempDepth+1;
-              m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+              if (!m_l2rReceiveUpdateCallback.IsNull ())
+                m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
               m_pqm = tempPqm;
+              L2R_SetParent (sender);
         
       }
       else
@@ -1899,7 +2890,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
           }
           else
           {
-            uint16_t tempLqm = 1; //ToDo What LQM should be for node in initialization
+            uint16_t tempLqm = 1 + L2R_LinkCost (sender);
             tempPqm += tempLqm;
             L2R_RoutingTableEntry newEntry (
             tempDepth,
@@ -1909,26 +2900,17 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
             sender,
             false);
             newEntry.SetFlag (VALID);
+            newEntry.SetDestination (L2rRxMsg.GetMeshRootAddress ());
+            newEntry.SetLQM (tempLqm);
             newEntry.SetArrivalRatePar(*arrRate);
             newEntry.SetQueuePar(tempQueueSize);
             newEntry.SetDelayPar(*entavgDelay3);
             bool returnSuccessful =  m_routingTable.AddRoute (newEntry);
             NS_LOG_FUNCTION ("New Route added to routing tables" << returnSuccessful);
           }
-          uint16_t minPqm = 0xffff;
-          std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
-          m_routingTable.GetListOfAllRoutes(allRoutes);
-          for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin (); i
-            != allRoutes.end (); ++i) 
-          {
-            if(i->second.GetPQM () < minPqm)
-            {
-              minPqm = i->second.GetPQM ();
-              m_pqm = minPqm;
-              m_depth = i->second.GetDepth() + 1;
-            }
-          }
-              m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+          L2R_SelectParent ();
+              if (!m_l2rReceiveUpdateCallback.IsNull ())
+                m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
           //look if the mac in the routing table Done
           //do the pqm condition Done
           //ToDo my depth Done
@@ -1936,8 +2918,12 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
       }
       if(m_isSink == false)     
       {
-        event =  Simulator::ScheduleNow(&LrWpanMac::L2R_SendPeriodicUpdate,this);
-        m_routingTable.AddMacEvent(sender, event);
+        event = L2R_Dispatch (LrWpanEventProfiler::L2R_TCIE_REBROADCAST, MakeEvent (&LrWpanMac::L2R_SendPeriodicUpdate, this));
+        // A queued continuation has no event id to cancel later
+        if (!event.IsExpired ())
+          {
+            m_routingTable.AddMacEvent(sender, event);
+          }
         NS_LOG_FUNCTION("EventCreated EventUID: " << event.GetUid ());
       } 
     }
@@ -1945,7 +2931,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
     {
       if(tableVerifier == false) //new Entry
       {
-        uint16_t tempLqm = 1; //ToDo What LQM should be for new nodes 
+        uint16_t tempLqm = 1 + L2R_LinkCost (sender);
         tempPqm += tempLqm;
         L2R_RoutingTableEntry newEntry (
         tempDepth,
@@ -1955,6 +2941,8 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
         sender,
         false);
         newEntry.SetFlag (VALID);
+        newEntry.SetDestination (L2rRxMsg.GetMeshRootAddress ());
+        newEntry.SetLQM (tempLqm);
         newEntry.SetArrivalRatePar(*arrRate);
         newEntry.SetQueuePar(tempQueueSize);
         newEntry.SetDelayPar(*entavgDelay3);
@@ -1962,27 +2950,18 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
             NS_LOG_FUNCTION ("New Route added to routing tables" << returnSuccessful);
         if(m_isSink) //code not completed here all nodes have zero pqm
         {
-          m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+          if (!m_l2rReceiveUpdateCallback.IsNull ())
+            m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
           return;
         }
-        uint16_t minPqm = 10000;
-        std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
-        m_routingTable.GetListOfAllRoutes(allRoutes);
-        for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin (); i
-          != allRoutes.end (); ++i) 
-        {
-        if(i->second.GetPQM () < minPqm)
-          {
-            minPqm = i->second.GetPQM ();
-            m_pqm = minPqm;
-            m_depth = i->second.GetDepth() + 1;
-          }
-        }
-        m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+        L2R_SelectParent ();
+        if (!m_l2rReceiveUpdateCallback.IsNull ())
+          m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
      }
      else
      {
-       if((m_msn == 0xef && tempMsn < 0xef) || m_msn < tempMsn)
+       // A neighbor repeating the latest MSN still refreshes its own entry
+       if(newer || tempMsn == lastMsn->second)
        {
           double arrivalRateMovingAvg = 0;
           std::queue<Time> temp_myqueue = m_arrivalRateMovingAvg;
@@ -1996,15 +2975,14 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
          /* uint16_t tempLqm = tableEntry.GetQueuePar() * m_txQueue.size() / m_maxQueueSize +
                               tableEntry.GetArrivalPar() * arrivalRateMovingAvg +
                               tableEntry.GetDelayPar() * m_avgDelay / m_delayCountPacket;*/
-          uint16_t tempLqm =  tempQueueSize * 10 +
-                              1/(tempArrivalRate+1) * 10 +
-                              tempDelay;                    
-          //uint16_t tempLqm = 1;
+          uint16_t tempLqm = L2R_NeighborLqm (sender, tempQueueSize, *arrRate, *entavgDelay3);
 
-          tempPqm += tempLqm;
+          tempPqm = std::min (0xffff, tempPqm + tempLqm);
+          tableEntry.SetLQM(tempLqm);
           tableEntry.SetDepth(tempDepth);
           tableEntry.SetEntriesChanged(true);
           tableEntry.SetFlag(VALID);
+          tableEntry.SetDestination (L2rRxMsg.GetMeshRootAddress ());
           tableEntry.SetNextHop(sender);
           tableEntry.SetLifeTime(Simulator::Now ());
           tableEntry.SetPQM(tempPqm);
@@ -2015,23 +2993,13 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
           NS_LOG_FUNCTION ("Received update For TcIE From " << sender);
           if(m_isSink) //code not completed here all nodes have zero pqm
           {
-            m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+            if (!m_l2rReceiveUpdateCallback.IsNull ())
+              m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
             return;
           }
-          uint16_t minPqm = 0xffff;
-          std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
-          m_routingTable.GetListOfAllRoutes(allRoutes);
-          for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin (); i
-            != allRoutes.end (); ++i) 
-          {
-            if(i->second.GetPQM () < minPqm)
-            {
-              minPqm = i->second.GetPQM ();
-              m_pqm = minPqm;
-              m_depth = i->second.GetDepth() + 1;
-            }
-          }
-          m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
+          L2R_SelectParent ();
+          if (!m_l2rReceiveUpdateCallback.IsNull ())
+            m_l2rReceiveUpdateCallback(rxParams,m_depth,m_pqm,m_shortAddress);
        }
        else
        {
@@ -2041,10 +3009,20 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
        
      }
     }
-    if(m_isSink == false)
+    // Rebroadcast every TC-IE of a root once
+    if(m_isSink == false && newer)
     {
-      event =  Simulator::ScheduleNow(&LrWpanMac::L2R_SendPeriodicUpdate,this);
-      m_routingTable.AddMacEvent(sender, event);
+      if (tempMsn <= 0xf0)
+      {
+        m_rootMsn[tcieRoot] = tempMsn;
+        if (tcieRoot == m_rootAddress)
+          m_msn = tempMsn;
+      }
+      event = L2R_Dispatch (LrWpanEventProfiler::L2R_TCIE_REBROADCAST, MakeEvent (&LrWpanMac::L2R_SendPeriodicUpdate, this));
+      if (!event.IsExpired ())
+        {
+          m_routingTable.AddMacEvent(sender, event);
+        }
       NS_LOG_FUNCTION("EventCreated EventUID: " << event.GetUid ());
     }
     break;
@@ -2055,9 +3033,9 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
     {
       NS_LOG_FUNCTION ("Received a TC-D-IE packet from "
                   << sender << " to " << receiver << "Mesh Root Address: " << L2rRxMsg.GetMeshRootAddress ());
+      // Pass on the root of the first D-IE heard, the nearest one
       m_rootAddress = L2rRxMsg.GetMeshRootAddress();
       L2R_Header L2R_DIE;
-      m_rootAddress = m_shortAddress; //change root name
       L2R_DIE.SetMeshRootAddress(m_rootAddress);
       L2R_DIE.SetMsgType(L2R_D_IE);
       Ptr<Packet> p0 = Create<Packet> (); //Zero payload packet
@@ -2069,7 +3047,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
       params.m_dstAddr = Mac16Address("ff:ff");
       params.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
       params.m_txOptions = TX_OPTION_NONE;
-      Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,this,
+      LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_DISCOVERY_TX, Time (0), &LrWpanMac::McpsDataRequest, this,
                              params, p0);
     }
     else
@@ -2081,6 +3059,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
   }
   case DataHeader:
   {
+    L2R_UpdateFromData (sender, L2rRxMsg);
     if(m_isSink)
     {
       //std::cout<<"Mesh Successfully Received a packet with: " << std::endl;
@@ -2097,17 +3076,42 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
       std::cout <<"AvgDelay: " << *ent3 << std::endl;*/
 
       Mac16Address srcAddress = dataHeader.GetSrcAddress();
+      if (m_tcieAdaptive)
+      {
+        L2R_NoteSourceState (srcAddress, dataHeader.GetDepth (), dataHeader.GetPQM ());
+      }
       MeshRootData newEntry = {ent1, //number of element in the queue / queue size
                                *ent2,//avg of the msg received / time ToDo make it normalized
                                *ent3,}; //The time that the packet stay in the queue 
-      m_totalPacketSendUid.insert(std::make_pair(originalPkt->GetUid(), Simulator::Now ().GetSeconds())); 
+      m_totalPacketSendUid.insert(std::make_pair(L2R_UidTag::GetOriginalUid (originalPkt), Simulator::Now ().GetSeconds())); 
+      L2R_PathTag pathTag;
+      if (originalPkt->PeekPacketTag (pathTag))
+      {
+        double recorded = 0;
+        for (std::vector<L2R_PathTag::Hop>::const_iterator h = pathTag.GetHops ().begin (); h != pathTag.GetHops ().end (); ++h)
+        {
+          PathDepthStats &stats = m_pathStats[h->depth];
+          ++stats.hops;
+          stats.queueUs += h->queueUs;
+          stats.csmaUs += h->csmaUs;
+          stats.retries += h->retries;
+          recorded += (h->queueUs + static_cast<double> (h->csmaUs)) * 1e-6;
+        }
+        ++m_pathPackets;
+        m_pathDelaySum += (Simulator::Now () - pathTag.GetOrigin ()).GetSeconds ();
+        m_pathRecordedSum += recorded;
+      }
       m_meshRootData.insert (std::make_pair(dataHeader.GetDepth(), newEntry));
       ++m_totalPacketRxByMesh;
-      m_meshRxMsgCallback(newEntry,srcAddress);
-      *m_stream->GetStream () << Simulator::Now ().GetSeconds () <<" Sink Receive Packet number: " << originalPkt->GetUid() 
-                            <<" Received From node: " << sender << " To Me: "<< m_shortAddress 
-                            <<" Node Queue Size: " << m_queueSize
-                            <<std::endl;
+      if (!m_meshRxMsgCallback.IsNull ())
+        m_meshRxMsgCallback(newEntry,srcAddress);
+      if (m_stream)
+      {
+        *m_stream->GetStream () << Simulator::Now ().GetSeconds () <<" Sink Receive Packet number: " << L2R_UidTag::GetOriginalUid (originalPkt) 
+                              <<" Received From node: " << sender << " To Me: "<< m_shortAddress 
+                              <<" Node Queue Size: " << m_queueSize
+                              <<std::endl;
+      }
       return;
     }
     //std::cout << "New Data Received: " << std::endl;
@@ -2127,7 +3131,7 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
       m_arrivalRateMovingAvg.push(m_arrivalRate);
       m_arrivalRateComplement = 0;
     }
-    m_delayForEachPacket.insert(std::make_pair (originalPkt->GetUid(), now));
+    m_delayForEachPacket.insert(std::make_pair (L2R_UidTag::GetOriginalUid (originalPkt), now));
     McpsDataRequestParams paramsSend;
     paramsSend.m_dstPanId = this->GetPanId();;
     paramsSend.m_srcAddrMode = SHORT_ADDR;
@@ -2135,14 +3139,18 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
     paramsSend.m_dstAddr = this->OutputRoute ();
     paramsSend.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
     paramsSend.m_txOptions = TX_OPTION_ACK;  
-    *m_stream->GetStream () << now.GetSeconds () <<" Forward Packet number: " << originalPkt->GetUid() 
-                            <<" Received From node: " << sender << " To Me: "<< m_shortAddress 
-                            <<" Forword it to node: " << paramsSend.m_dstAddr << std::endl;
+    if (m_stream)
+    {
+      *m_stream->GetStream () << now.GetSeconds () <<" Forward Packet number: " << L2R_UidTag::GetOriginalUid (originalPkt) 
+                              <<" Received From node: " << sender << " To Me: "<< m_shortAddress 
+                              <<" Forword it to node: " << paramsSend.m_dstAddr << std::endl;
+    }
     //std::cout << "Sending Data Packet From: " << m_shortAddress << "To: " <<paramsSend.m_dstAddr << std::endl;
     ++m_internalLoad;
+    ++m_forwardedFrames;
     //m_l2rQueue.insert(std::make_pair(originalPkt->GetUid(),originalPkt));
     ++m_queueSize;
-    Simulator::ScheduleNow(&LrWpanMac::McpsDataRequest,this, paramsSend, originalPkt);
+    L2R_Dispatch (LrWpanEventProfiler::L2R_DATA_FORWARD_TX, MakeEvent (&LrWpanMac::McpsDataRequest, this, paramsSend, originalPkt));
   
   break;
   }
@@ -2157,19 +3165,192 @@ void LrWpanMac::RecieveL2RPacket(McpsDataIndicationParams rxParams, Ptr<Packet>
       tableEntry.SetArrivalRatePar(*arrRate);
       tableEntry.SetDelayPar(*entavgDelay3);
       tableEntry.SetQueuePar(normalizeQueue);
+      // Same metric as a TC-IE update, so the choice of parent reacts now
+      // instead of at the next TC-IE interval
+      uint16_t lqm = L2R_NeighborLqm (sender, normalizeQueue, *arrRate, *entavgDelay3);
+      tableEntry.SetLQM(lqm);
+      tableEntry.SetPQM(std::min (0xffff, L2rRxMsg.GetPQM() + lqm));
       m_routingTable.Update(tableEntry);
-      break;
-    }  
+      if(!m_isSink && tableEntry.GetDepth() < m_depth)
+        L2R_SelectParent ();
+    }
+    break;
+  case L2R_AGG_RECORD:
+    if (!m_l2rRecordCallback.IsNull ())
+      {
+        m_l2rRecordCallback (sender, p);
+      }
+    break;
   case NotL2R:
+  case L2R_AGGREGATE: // split up by PdDataIndication
   break;
   }
 }
+bool
+LrWpanMac::L2R_SelectParent (void)
+{
+  uint16_t minPqm = 0xffff;
+  uint16_t depth = 0;
+  Mac16Address parent = Mac16Address ("00:00");
+  Mac16Address root = Mac16Address ("00:00");
+  std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
+  m_routingTable.GetListOfAllRoutes (allRoutes);
+  m_rootPqm.clear ();
+  for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin (); i
+       != allRoutes.end (); ++i)
+    {
+      // With several mesh roots the lowest PQM overall picks the best root
+      std::map<Mac16Address, uint16_t>::iterator r = m_rootPqm.find (i->second.GetDestination ());
+      if (r == m_rootPqm.end ())
+        {
+          m_rootPqm[i->second.GetDestination ()] = i->second.GetPQM ();
+        }
+      else
+        {
+          r->second = std::min (r->second, i->second.GetPQM ());
+        }
+      if (i->second.GetPQM () < minPqm)
+        {
+          minPqm = i->second.GetPQM ();
+          depth = i->second.GetDepth () + 1;
+          parent = i->first;
+          root = i->second.GetDestination ();
+        }
+    }
+  if (parent == Mac16Address ("00:00"))
+    {
+      return false;
+    }
+  std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator current = allRoutes.find (m_parent);
+  Mac16Address heldCandidate = Mac16Address ("00:00");
+  if (parent != m_parent && current != allRoutes.end ()
+      && (m_parentMargin > 0 || m_parentMinDwell > Time (0)))
+    {
+      bool better = minPqm + m_parentMargin < current->second.GetPQM ();
+      bool settled = Simulator::Now () - m_parentSince >= m_parentMinDwell;
+      if (!better || !settled)
+        {
+          NS_LOG_LOGIC ("Keeping parent " << m_parent << " over " << parent);
+          // Count a candidate once while it stays the one held back
+          if (parent != m_heldCandidate)
+            {
+              ++m_parentSwitchesHeld;
+            }
+          heldCandidate = parent;
+          minPqm = current->second.GetPQM ();
+          depth = current->second.GetDepth () + 1;
+          parent = m_parent;
+          root = current->second.GetDestination ();
+        }
+    }
+  m_heldCandidate = heldCandidate;
+  m_pqm = minPqm;
+  m_depth = depth;
+  if (root != Mac16Address ("00:00"))
+    {
+      m_rootAddress = root;
+    }
+  L2R_SetParent (parent);
+  return true;
+}
+bool
+LrWpanMac::L2R_IsNewerMsn (uint16_t msn, uint16_t last)
+{
+  // A root counts 0xf0, 0x00, ..., 0xef, 0xf0, ...: a cycle of 0xf1 values
+  uint16_t ahead = (msn + 0xf1 - last) % 0xf1;
+  return ahead > 0 && ahead <= 0xf1 / 2;
+}
+void
+LrWpanMac::L2R_NoteSourceState (Mac16Address source, uint16_t depth, uint16_t pqm)
+{
+  std::map<Mac16Address, TcieSourceState>::iterator i = m_tcieSources.find (source);
+  if (i == m_tcieSources.end ())
+    {
+      TcieSourceState state;
+      state.depth = depth;
+      state.pqm = pqm;
+      state.heard = true;
+      m_tcieSources.insert (std::make_pair (source, state));
+      return;
+    }
+  int swing = std::abs (static_cast<int> (pqm) - i->second.pqm);
+  if (depth != i->second.depth || swing >= m_tciePqmSwing)
+    {
+      ++m_tcieChanges;
+    }
+  i->second.depth = depth;
+  i->second.pqm = pqm;
+  i->second.heard = true;
+}
+void
+LrWpanMac::L2R_AdaptTcieInterval (void)
+{
+  uint32_t heard = 0;
+  for (std::map<Mac16Address, TcieSourceState>::iterator i = m_tcieSources.begin (); i != m_tcieSources.end (); ++i)
+    {
+      heard += i->second.heard;
+      i->second.heard = false;
+    }
+  double churn = heard > 0 ? static_cast<double> (m_tcieChanges) / heard : 0;
+  m_tcieChanges = 0;
+  uint32_t interval = m_tcieInterval;
+  if (churn >= m_tcieHighChurn)
+    {
+      interval /= 2;
+    }
+  else if (churn <= m_tcieLowChurn)
+    {
+      interval += m_tcieGrowStep;
+    }
+  uint32_t low = std::min (m_tcieMin, m_tcieMax);
+  interval = std::max<uint32_t> (low, std::min<uint32_t> (m_tcieMax, interval));
+  if (interval != m_tcieInterval)
+    {
+      NS_LOG_FUNCTION (this << churn << static_cast<uint32_t> (m_tcieInterval) << interval);
+      m_tcieInterval = interval;
+      ++m_tcieAdaptations;
+    }
+}
+void
+LrWpanMac::L2R_RestoreParent (void)
+{
+  m_parent = Mac16Address ("00:00");
+  m_parentSince = Simulator::Now ();
+  m_heldCandidate = Mac16Address ("00:00");
+  if (m_isSink)
+    {
+      return;
+    }
+  uint16_t minPqm = 0xffff;
+  std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
+  m_routingTable.GetListOfAllRoutes (allRoutes);
+  for (std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin (); i
+       != allRoutes.end (); ++i)
+    {
+      if (i->second.GetPQM () < minPqm)
+        {
+          minPqm = i->second.GetPQM ();
+          m_parent = i->first;
+        }
+    }
+}
+void
+LrWpanMac::L2R_SetParent (Mac16Address parent)
+{
+  if (parent != m_parent)
+    {
+      NS_LOG_FUNCTION (this << m_parent << parent);
+      m_parent = parent;
+      m_parentSince = Simulator::Now ();
+      ++m_parentChanges;
+    }
+}
 void
 LrWpanMac::SendNlmMsg()
 {
   L2R_Header L2R_NLM;
-  m_rootAddress = m_shortAddress; //change root name
   L2R_NLM.SetMsgType(NLM_IE);
+  L2R_NLM.SetPQM(m_pqm);
   L2R_NLM.SetArrivalRate(GetArrivalRate());
   L2R_NLM.SetDelay(GetAvgDelay());
   L2R_NLM.SetQueueSize(m_txQueue.size());
@@ -2182,89 +3363,581 @@ LrWpanMac::SendNlmMsg()
   params.m_dstAddr = Mac16Address("ff:ff");
   params.m_msduHandle = 0; //ToDo underStand the msduhandle from standard
   params.m_txOptions = TX_OPTION_NONE;
-  Simulator::ScheduleNow (&LrWpanMac::McpsDataRequest,this,
-                          params, p0);
+  m_lastNlm = Simulator::Now ();
+  L2R_Dispatch (LrWpanEventProfiler::L2R_NLM_TX, MakeEvent (&LrWpanMac::McpsDataRequest, this,
+                                                            params, p0));
 }
 void
-LrWpanMac::L2R_MaxMissedTcIeMsg (uint8_t maxMissed)
+LrWpanMac::L2R_CheckCongestion (void)
 {
-  m_routingTable.SetL2rMaxMissedTcIe(maxMissed);
+  if (!m_nlmEnabled || m_maxQueueSize == 0)
+    {
+      return;
+    }
+  double occupancy = double (m_txQueue.size ()) / m_maxQueueSize;
+  if (m_nlmCongested ? occupancy > m_nlmLow : occupancy < m_nlmHigh)
+    {
+      return;
+    }
+  m_nlmCongested = !m_nlmCongested;
+  if (m_nlmHoldoff.IsRunning ())
+    {
+      // The pending NLM-IE reads the queue when it is sent
+      return;
+    }
+  if (m_lastNlm >= Time (0) && Simulator::Now () - m_lastNlm < m_nlmMinInterval)
+    {
+      m_nlmHoldoff = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_NLM_HOLDOFF,
+                                                    m_lastNlm + m_nlmMinInterval - Simulator::Now (),
+                                                    &LrWpanMac::L2R_SendPendingNlm, this);
+      return;
+    }
+  SendNlmMsg ();
 }
-//AB: modified on 19/11
-Mac16Address
-LrWpanMac::OutputRoute()
+void
+LrWpanMac::L2R_SendPendingNlm (void)
 {
-  std::map<uint16_t, L2R_RoutingTableEntry> PQMValues;
-  std::map<Mac16Address, L2R_RoutingTableEntry> possibleRoutes;
-  bool anyAvailabeAncestor;
-  anyAvailabeAncestor = m_routingTable.GetListOfDestinationWithNextHop(possibleRoutes, m_depth);  // neighbours with depth < my_depth
-  Mac16Address nextHopAddress = Mac16Address("00:00");
-  if(anyAvailabeAncestor == true)
-  {
-    std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = possibleRoutes.begin();
-    for(;i != possibleRoutes.end(); ++i)
+  SendNlmMsg ();
+}
+void
+LrWpanMac::L2R_UpdateFromData (Mac16Address sender, L2R_Header &header)
+{
+  L2R_RoutingTableEntry entry;
+  if (m_isSink || !m_routingTable.LookupRoute (sender, entry))
     {
-      PQMValues.insert(std::make_pair(i->second.GetPQM(), i->second));    // sorted map according to PQM, but not Depth: add later to generalize
-
+      return;
     }
-
-    std::map<uint16_t, L2R_RoutingTableEntry>::const_iterator j = PQMValues.begin();
-    for(;j != PQMValues.end(); ++j)
+  uint16_t pqm;
+  if (header.HasHopLoad ())
     {
-      if(j->second.GetLQM() <= m_lqt)  // no GetLQM function in L2R_RoutingTableEntry? Add it?
+      entry.SetQueuePar (float (header.GetHopQueueSize ()) / float (m_maxQueueSize));
+      pqm = header.GetHopPqm ();
+    }
+  else if (header.GetSrcAddress () == sender)
+    {
+      uint32_t arrivalRate = header.GetArrivalRate ();
+      uint32_t delay = header.GetDelay ();
+      entry.SetQueuePar (float (header.GetQueueSize ()) / float (m_maxQueueSize));
+      entry.SetArrivalRatePar (*reinterpret_cast<float *> (&arrivalRate));
+      entry.SetDelayPar (*reinterpret_cast<float *> (&delay));
+      pqm = header.GetPQM ();
+    }
+  else
+    {
+      // A relayed frame without a hop load describes its source only
+      return;
+    }
+  uint16_t lqm = L2R_NeighborLqm (sender, entry.GetQueuePar (), entry.GetArrivalPar (), entry.GetDelayPar ());
+  entry.SetLQM (lqm);
+  entry.SetPQM (std::min (0xffff, pqm + lqm));
+  m_routingTable.Update (entry);
+  ++m_piggybackUpdates;
+  if (entry.GetDepth () < m_depth)
+    {
+      L2R_SelectParent ();
+    }
+}
+L2R_Header
+LrWpanMac::L2R_PeekHeader (Ptr<const Packet> frame)
+{
+  Ptr<Packet> copy = frame->Copy ();
+  LrWpanMacHeader macHdr;
+  copy->RemoveHeader (macHdr);
+  L2R_Header l2rHeader;
+  if (macHdr.IsData ())
+    {
+      copy->PeekHeader (l2rHeader);
+    }
+  return l2rHeader;
+}
+std::vector<Ptr<Packet> >
+LrWpanMac::L2R_Deaggregate (Ptr<const Packet> frame)
+{
+  Ptr<Packet> copy = frame->Copy ();
+  L2R_Header header;
+  copy->RemoveHeader (header);
+  std::vector<Ptr<Packet> > parts;
+  uint32_t offset = 0;
+  const std::vector<uint8_t> &lengths = header.GetAggregateLengths ();
+  // A fragment inherits the uid and the tags of the aggregate
+  L2R_UidTag uidTag;
+  copy->RemovePacketTag (uidTag);
+  const std::vector<uint64_t> &uids = uidTag.GetUids ();
+  for (std::vector<uint8_t>::const_iterator l = lengths.begin (); l != lengths.end (); ++l)
+    {
+      NS_ASSERT (offset + *l <= copy->GetSize ());
+      Ptr<Packet> part = copy->CreateFragment (offset, *l);
+      if (uids.size () == lengths.size ())
         {
-          nextHopAddress = j->second.GetNextHop();
-          return nextHopAddress;
+          part->AddPacketTag (L2R_UidTag (std::vector<uint64_t> (1, uids[parts.size ()])));
         }
+      parts.push_back (part);
+      offset += *l;
     }
-    j = PQMValues.begin();
-    uint16_t minLQM = j->second.GetLQM();
-    nextHopAddress = j->second.GetNextHop();
-    for(;j != PQMValues.end(); ++j)   // send to lowest LQM
+  return parts;
+}
+void
+LrWpanMac::L2R_Aggregate (const McpsDataRequestParams &params, Ptr<Packet> p)
+{
+  // One length byte per frame, plus type and count for the aggregate
+  uint32_t partSize = p->GetSize () + 1;
+  if (partSize + 2 > m_aggMaxSize || p->GetSize () > 0xff)
     {
-      if(j->second.GetLQM() < minLQM)
-      {
-        minLQM = j->second.GetLQM();
-        nextHopAddress = j->second.GetNextHop();
-      }
+      m_aggFlushing = true;
+      McpsDataRequest (params, p);
+      m_aggFlushing = false;
+      return;
     }
-    if (nextHopAddress == Mac16Address("00:00"))
-      std::cout << "Node Doesn't send any thing no Ancecters" << std::endl;
-    return nextHopAddress;
-  }
-  else
-  {
-		std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
-    m_routingTable.GetListOfAllRoutes(allRoutes);
-		std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin ();
-		uint16_t minDepth = i->second.GetDepth();
-    for (; i != allRoutes.end (); ++i) 
-  	{
-    	if(i->second.GetDepth () < minDepth)
-          {
-            m_depth = i->second.GetDepth() + 1;
-            nextHopAddress = i->first;
-          }
-    } // continiou cout mac in lower depth
-    return nextHopAddress;
-  }
-  
+  std::map<Mac16Address, AggregateBuffer>::iterator i = m_aggBuffers.find (params.m_dstAddr);
+  if (i != m_aggBuffers.end () && (i->second.size + partSize > m_aggMaxSize || i->second.packets.size () == 0xff))
+    {
+      L2R_FlushAggregate (params.m_dstAddr);
+      i = m_aggBuffers.end ();
+    }
+  if (i == m_aggBuffers.end ())
+    {
+      AggregateBuffer buffer;
+      buffer.params = params;
+      buffer.size = 2;
+      i = m_aggBuffers.insert (std::make_pair (params.m_dstAddr, buffer)).first;
+      i->second.flush = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_AGG_FLUSH, m_aggMaxHold,
+                                                       &LrWpanMac::L2R_FlushAggregate, this, params.m_dstAddr);
+    }
+  i->second.packets.push_back (p);
+  i->second.size += partSize;
 }
-//AM: modified on 25/11
-void LrWpanMac::PrintRoutingTable (Ptr<Node> node,Ptr<OutputStreamWrapper> stream, Time::Unit unit)
+void
+LrWpanMac::L2R_FlushAggregate (Mac16Address nextHop)
 {
-  //Ptr<Node> node = NodeList::GetNode (0);
-  if(m_isSink == true)
-  {
-  ++m_tcieIncr;
-  for(uint8_t i = 0; i<6;i++)
+  std::map<Mac16Address, AggregateBuffer>::iterator i = m_aggBuffers.find (nextHop);
+  if (i == m_aggBuffers.end ())
     {
-      *stream->GetStream () << "******************";
-      if(i == 2)
-        *stream->GetStream () << "TC-IE Updates number: " << m_tcieIncr;
+      return;
     }
-    *stream->GetStream () << std::endl;
-  }
+  AggregateBuffer buffer = i->second;
+  m_aggBuffers.erase (i);
+  buffer.flush.Cancel ();
+  Ptr<Packet> frame = buffer.packets.front ();
+  if (buffer.packets.size () > 1)
+    {
+      frame = Create<Packet> ();
+      std::vector<uint8_t> lengths;
+      std::vector<uint64_t> uids;
+      for (std::vector<Ptr<Packet> >::const_iterator p = buffer.packets.begin (); p != buffer.packets.end (); ++p)
+        {
+          lengths.push_back ((*p)->GetSize ());
+          uids.push_back (L2R_UidTag::GetOriginalUid (*p));
+          frame->AddAtEnd (*p);
+        }
+      L2R_Header header;
+      header.SetMsgType (L2R_AGGREGATE);
+      header.SetAggregateLengths (lengths);
+      frame->AddHeader (header);
+      frame->AddPacketTag (L2R_UidTag (uids));
+      ++m_aggFrames;
+      m_aggPackets += buffer.packets.size ();
+    }
+  m_aggFlushing = true;
+  McpsDataRequest (buffer.params, frame);
+  m_aggFlushing = false;
+}
+uint16_t
+LrWpanMac::L2R_ComputeLqm (float queue, float interArrival, float delay)
+{
+  // A full queue, back-to-back arrivals and one second of delay weigh 10
+  // each
+  double lqm = queue * 10 + 10 / (interArrival + 1) + delay * 10;
+  return std::max (1.0, std::min (lqm, 1000.0));
+}
+uint16_t
+LrWpanMac::L2R_LinkCost (Mac16Address neighbor) const
+{
+  if (!m_linkEstimation)
+    {
+      return 0;
+    }
+  // Every expected retransmission weighs as much as a full queue, 10
+  double cost = (m_linkEstimator.GetEtx (neighbor) - 1) * 10
+                + (255 - m_linkEstimator.GetLqi (neighbor)) / 255 * m_linkLqiWeight;
+  return std::min (1000.0, cost + 0.5);
+}
+uint16_t
+LrWpanMac::L2R_NeighborLqm (Mac16Address neighbor, float queue, float interArrival, float delay) const
+{
+  return L2R_ComputeLqm (queue, interArrival, delay) + L2R_LinkCost (neighbor);
+}
+void
+LrWpanMac::L2R_NoteTxOutcome (bool acked)
+{
+  if (!m_linkEstimation || m_txQueue.empty ())
+    {
+      return;
+    }
+  LrWpanMacHeader hdr;
+  m_txQueue.front ()->txQPkt->PeekHeader (hdr);
+  if (!hdr.IsAckReq () || hdr.GetDstAddrMode () != SHORT_ADDR)
+    {
+      return;
+    }
+  Mac16Address neighbor = hdr.GetShortDstAddr ();
+  if (m_linkEstimator.NotifyTx (neighbor, m_retransmission + 1, acked))
+    {
+      NS_LOG_FUNCTION (this << neighbor << m_linkEstimator.GetEtx (neighbor));
+      L2R_RefreshLinkCost (neighbor);
+    }
+}
+void
+LrWpanMac::L2R_RefreshLinkCost (Mac16Address neighbor)
+{
+  L2R_RoutingTableEntry entry;
+  if (!m_routingTable.LookupRoute (neighbor, entry))
+    {
+      return;
+    }
+  // The PQM the neighbor advertised is its entry's PQM without our LQM
+  uint16_t advertised = entry.GetPQM () - std::min (entry.GetPQM (), entry.GetLQM ());
+  uint16_t lqm = L2R_NeighborLqm (neighbor, entry.GetQueuePar (), entry.GetArrivalPar (), entry.GetDelayPar ());
+  entry.SetLQM (lqm);
+  entry.SetPQM (std::min (0xffff, advertised + lqm));
+  m_routingTable.Update (entry);
+  if (!m_isSink && entry.GetDepth () < m_depth)
+    {
+      L2R_SelectParent ();
+    }
+}
+EventId
+LrWpanMac::L2R_Dispatch (LrWpanEventProfiler::Tag tag, const Ptr<EventImpl> &event)
+{
+  if (!m_directDispatch || (m_handlerDepth == 0 && !m_deferredRun.IsRunning ()))
+    {
+      return LrWpanEventProfiler::Schedule (tag, Time (0), event);
+    }
+  DeferredEvent deferred;
+  deferred.tag = tag;
+  deferred.event = event;
+  // As an event of its own the continuation would run after a MAC state
+  // change that is already pending, so it must not overtake it
+  if (m_setMacState.IsRunning ())
+    {
+      deferred.after = m_setMacState;
+    }
+  m_deferred.push_back (deferred);
+  return EventId ();
+}
+void
+LrWpanMac::L2R_EnterHandler (void)
+{
+  ++m_handlerDepth;
+}
+void
+LrWpanMac::L2R_ExitHandler (void)
+{
+  NS_ASSERT (m_handlerDepth > 0);
+  if (--m_handlerDepth == 0 && !m_deferred.empty () && !m_deferredRun.IsRunning ())
+    {
+      L2R_RunDeferred ();
+    }
+}
+void
+LrWpanMac::L2R_RunDeferred (void)
+{
+  // Continuations queued while these run are appended and run in turn,
+  // as their events would have been
+  ++m_handlerDepth;
+  while (!m_deferred.empty ())
+    {
+      if (m_deferred.front ().after.IsRunning ())
+        {
+          m_deferredRun = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_DEFERRED_RUN, Time (0),
+                                                         &LrWpanMac::L2R_RunDeferred, this);
+          break;
+        }
+      DeferredEvent deferred = m_deferred.front ();
+      m_deferred.pop_front ();
+      LrWpanEventProfiler::CountDirect (deferred.tag);
+      ++m_directDispatchCount;
+      deferred.event->Invoke ();
+    }
+  --m_handlerDepth;
+}
+uint64_t
+LrWpanMac::GetDirectDispatchCount (void) const
+{
+  return m_directDispatchCount;
+}
+void
+LrWpanMac::L2R_MaxMissedTcIeMsg (uint8_t maxMissed)
+{
+  m_routingTable.SetL2rMaxMissedTcIe(maxMissed);
+}
+//AB: modified on 19/11
+Mac16Address
+LrWpanMac::OutputRoute()
+{
+  std::map<uint16_t, L2R_RoutingTableEntry> PQMValues;
+  std::map<Mac16Address, L2R_RoutingTableEntry> possibleRoutes;
+  bool anyAvailabeAncestor;
+  anyAvailabeAncestor = m_routingTable.GetListOfDestinationWithNextHop(possibleRoutes, m_depth);  // neighbours with depth < my_depth
+  Mac16Address nextHopAddress = Mac16Address("00:00");
+  if(anyAvailabeAncestor == true)
+  {
+    if (m_forwardingMode != L2R_SINGLE_PATH)
+    {
+      nextHopAddress = m_forwardingMode == L2R_MULTIPATH ? L2R_MultipathNextHop (possibleRoutes)
+                                                         : L2R_BackpressureNextHop (possibleRoutes, false);
+      if (nextHopAddress != Mac16Address ("00:00"))
+      {
+        ++m_parentShare[nextHopAddress];
+        return nextHopAddress;
+      }
+    }
+    if (m_parentMargin > 0 || m_parentMinDwell > Time (0))
+    {
+      // Stay on the parent L2R_SelectParent kept, instead of the lowest PQM of the moment
+      std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator p = possibleRoutes.find (m_parent);
+      if (p != possibleRoutes.end () && p->second.GetLQM () <= m_lqt)
+      {
+        ++m_parentShare[m_parent];
+        return m_parent;
+      }
+    }
+    std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = possibleRoutes.begin();
+    for(;i != possibleRoutes.end(); ++i)
+    {
+      PQMValues.insert(std::make_pair(i->second.GetPQM(), i->second));    // sorted map according to PQM, but not Depth: add later to generalize
+
+    }
+
+    std::map<uint16_t, L2R_RoutingTableEntry>::const_iterator j = PQMValues.begin();
+    for(;j != PQMValues.end(); ++j)
+    {
+      if(j->second.GetLQM() <= m_lqt)  // no GetLQM function in L2R_RoutingTableEntry? Add it?
+        {
+          nextHopAddress = j->second.GetNextHop();
+          ++m_parentShare[nextHopAddress];
+          return nextHopAddress;
+        }
+    }
+    j = PQMValues.begin();
+    uint16_t minLQM = j->second.GetLQM();
+    nextHopAddress = j->second.GetNextHop();
+    for(;j != PQMValues.end(); ++j)   // send to lowest LQM
+    {
+      if(j->second.GetLQM() < minLQM)
+      {
+        minLQM = j->second.GetLQM();
+        nextHopAddress = j->second.GetNextHop();
+      }
+    }
+    if (nextHopAddress == Mac16Address("00:00"))
+      LRWPAN_DIAG (NO_ANCESTOR, "Node Doesn't send any thing no Ancecters");
+    else
+      ++m_parentShare[nextHopAddress];
+    return nextHopAddress;
+  }
+  else
+  {
+		std::map<Mac16Address, L2R_RoutingTableEntry> allRoutes;
+    m_routingTable.GetListOfAllRoutes(allRoutes);
+		std::map<Mac16Address, L2R_RoutingTableEntry>::const_iterator i = allRoutes.begin ();
+		uint16_t minDepth = i->second.GetDepth();
+    for (; i != allRoutes.end (); ++i) 
+  	{
+    	if(i->second.GetDepth () < minDepth)
+          {
+            m_depth = i->second.GetDepth() + 1;
+            nextHopAddress = i->first;
+          }
+    } // continiou cout mac in lower depth
+    return nextHopAddress;
+  }
+  
+}
+double
+LrWpanMac::L2R_ParentWeight (L2R_RoutingTableEntry &entry) const
+{
+  // The NLM-IE parameters: queue over our maximum queue size, mean
+  // inter-arrival time and mean delay in seconds. Arrival rates are scaled
+  // so 100 frames/s weigh as much as a full queue.
+  double interArrival = entry.GetArrivalPar ();
+  double rate = interArrival > 0 ? 1 / interArrival : 0;
+  return 1 / (1 + entry.GetQueuePar () + entry.GetDelayPar () + rate / 100);
+}
+Mac16Address
+LrWpanMac::L2R_MultipathNextHop (std::map<Mac16Address, L2R_RoutingTableEntry> &ancestors)
+{
+  // Smooth weighted round-robin: every candidate gains its weight, the
+  // largest wins and pays the total back, so picks interleave in
+  // proportion to the weights
+  Mac16Address best = Mac16Address ("00:00");
+  double bestCurrent = 0;
+  double total = 0;
+  std::map<Mac16Address, double> current;
+  for (std::map<Mac16Address, L2R_RoutingTableEntry>::iterator i = ancestors.begin (); i != ancestors.end (); ++i)
+    {
+      if (i->second.GetLQM () > m_lqt)
+        {
+          continue;
+        }
+      double weight = L2R_ParentWeight (i->second);
+      std::map<Mac16Address, double>::const_iterator c = m_wrrCurrent.find (i->first);
+      double value = (c == m_wrrCurrent.end () ? 0 : c->second) + weight;
+      current[i->first] = value;
+      total += weight;
+      if (best == Mac16Address ("00:00") || value > bestCurrent)
+        {
+          best = i->first;
+          bestCurrent = value;
+        }
+    }
+  if (best != Mac16Address ("00:00"))
+    {
+      current[best] -= total;
+    }
+  // Ancestors that no longer qualify start from zero when they come back
+  m_wrrCurrent.swap (current);
+  return best;
+}
+Mac16Address
+LrWpanMac::L2R_BackpressureNextHop (std::map<Mac16Address, L2R_RoutingTableEntry> &ancestors, bool held)
+{
+  // Queues are compared as a fraction of our maximum queue size, the
+  // unit SetQueuePar stores; held frames and the frame being routed are
+  // part of our backlog
+  double backlog = double (m_txQueue.size () + m_bpHold.size () + (held ? 0 : 1)) / m_maxQueueSize;
+  Mac16Address best = Mac16Address ("00:00");
+  // A frame is only held back by a negative differential
+  double bestPressure = -1;
+  for (std::map<Mac16Address, L2R_RoutingTableEntry>::iterator i = ancestors.begin (); i != ancestors.end (); ++i)
+    {
+      if (i->second.GetLQM () > m_lqt)
+        {
+          continue;
+        }
+      double linkQuality = 1 - double (i->second.GetLQM ()) / (double (m_lqt) + 1);
+      double pressure = (backlog - i->second.GetQueuePar ()) * linkQuality;
+      if (pressure >= 0 && pressure > bestPressure)
+        {
+          best = i->first;
+          bestPressure = pressure;
+        }
+    }
+  return best;
+}
+bool
+LrWpanMac::L2R_BackpressureHold (const McpsDataRequestParams &params, Ptr<Packet> p)
+{
+  if (m_bpHold.empty ())
+    {
+      std::map<Mac16Address, L2R_RoutingTableEntry> ancestors;
+      if (!m_routingTable.GetListOfDestinationWithNextHop (ancestors, m_depth)
+          || L2R_BackpressureNextHop (ancestors, false) != Mac16Address ("00:00"))
+        {
+          // Without ancestors there is nothing to wait for
+          return false;
+        }
+    }
+  if (m_txQueue.size () + m_bpHold.size () >= m_maxQueueSize)
+    {
+      NS_LOG_LOGIC (this << " can't hold packet, queue is full");
+      ++m_totalPacketDroppedByNode;
+      L2R_Drop (p, L2R_DROP_QUEUE_FULL);
+      return true;
+    }
+  HeldFrame held;
+  held.params = params;
+  held.p = p;
+  held.since = Simulator::Now ();
+  m_bpHold.push_back (held);
+  ++m_bpHeldFrames;
+  if (!m_bpReleaseEvent.IsRunning ())
+    {
+      m_bpReleaseEvent = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_BP_RELEASE, m_bpRetry,
+                                                        &LrWpanMac::L2R_BackpressureRelease, this);
+    }
+  return true;
+}
+void
+LrWpanMac::L2R_BackpressureRelease (void)
+{
+  while (!m_bpHold.empty ())
+    {
+      std::map<Mac16Address, L2R_RoutingTableEntry> ancestors;
+      Mac16Address nextHop = Mac16Address ("00:00");
+      if (m_routingTable.GetListOfDestinationWithNextHop (ancestors, m_depth))
+        {
+          nextHop = L2R_BackpressureNextHop (ancestors, true);
+        }
+      HeldFrame held = m_bpHold.front ();
+      if (nextHop == Mac16Address ("00:00") && Simulator::Now () - held.since < m_bpMaxHold)
+        {
+          break;
+        }
+      m_bpHold.pop_front ();
+      // OutputRoute counted the next hop picked when the frame was held
+      if (nextHop != Mac16Address ("00:00") && nextHop != held.params.m_dstAddr)
+        {
+          std::map<Mac16Address, uint32_t>::iterator share = m_parentShare.find (held.params.m_dstAddr);
+          if (share != m_parentShare.end () && share->second > 0)
+            {
+              --share->second;
+            }
+          ++m_parentShare[nextHop];
+          held.params.m_dstAddr = nextHop;
+        }
+      m_bpReleasing = true;
+      McpsDataRequest (held.params, held.p);
+      m_bpReleasing = false;
+    }
+  if (!m_bpHold.empty ())
+    {
+      m_bpReleaseEvent = LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_BP_RELEASE, m_bpRetry,
+                                                        &LrWpanMac::L2R_BackpressureRelease, this);
+    }
+}
+uint64_t
+LrWpanMac::GetBackpressureHeldFrames (void) const
+{
+  return m_bpHeldFrames;
+}
+const std::map<Mac16Address, uint32_t> &
+LrWpanMac::GetParentShare (void) const
+{
+  return m_parentShare;
+}
+void
+LrWpanMac::PrintParentShare (std::ostream &os) const
+{
+  uint64_t total = 0;
+  for (std::map<Mac16Address, uint32_t>::const_iterator i = m_parentShare.begin (); i != m_parentShare.end (); ++i)
+    {
+      total += i->second;
+    }
+  std::ios::fmtflags flags = os.flags ();
+  os << std::fixed << std::setprecision (1);
+  os << "Parent share at " << m_shortAddress << ":";
+  for (std::map<Mac16Address, uint32_t>::const_iterator i = m_parentShare.begin (); i != m_parentShare.end (); ++i)
+    {
+      os << " " << i->first << " " << i->second << " (" << 100.0 * i->second / total << "%)";
+    }
+  os << std::endl;
+  os.flags (flags);
+}
+//AM: modified on 25/11
+void LrWpanMac::PrintRoutingTable (Ptr<Node> node,Ptr<OutputStreamWrapper> stream, Time::Unit unit)
+{
+  //Ptr<Node> node = NodeList::GetNode (0);
+  if(m_isSink == true)
+  {
+  ++m_tcieIncr;
+  for(uint8_t i = 0; i<6;i++)
+    {
+      *stream->GetStream () << "******************";
+      if(i == 2)
+        *stream->GetStream () << "TC-IE Updates number: " << m_tcieIncr;
+    }
+    *stream->GetStream () << std::endl;
+  }
   m_nodeId = node->GetId ();
   *stream->GetStream () << "Node: " <<  m_nodeId
                         << std::resetiosflags(std::ios::adjustfield) << std::setiosflags (std::ios::fixed)
@@ -2289,7 +3962,7 @@ void LrWpanMac::PrintRoutingTable (Ptr<Node> node,Ptr<OutputStreamWrapper> strea
  //m_printRoutingTableTimer.SetFunction(&LrWpanMac::PrintRoutingTable,this,node,stream,unit);
  //m_printRoutingTableTimer.Schedule(Seconds(m_tcieInterval+1));
   Time TCIEInter =  Seconds(m_tcieInterval + 1) + Now();
-  Simulator::Schedule (TCIEInter, &LrWpanMac::PrintRoutingTable,this,
+  LrWpanEventProfiler::Schedule (LrWpanEventProfiler::L2R_PRINT_TABLE, TCIEInter, &LrWpanMac::PrintRoutingTable, this,
                           node, stream,unit);
 }
 uint16_t
@@ -2348,6 +4021,173 @@ LrWpanMac::GetTotalPacketDroppedByQueue(void)
 {
   return m_totalPacketDroppedByNode;
 }
+void
+LrWpanMac::L2R_RecordHop (void)
+{
+  L2R_PathTag pathTag;
+  if (!m_pathRecord || !m_txPkt->PeekPacketTag (pathTag))
+    {
+      return;
+    }
+  L2R_PathTag::Hop hop;
+  hop.address = m_shortAddress;
+  hop.depth = std::min<uint16_t> (m_depth, 0xff);
+  hop.retries = std::min<uint32_t> (m_retransmission, 0xff);
+  hop.queueUs = std::min<int64_t> (m_txQueueSojourn.GetMicroSeconds (), 0xffffffff);
+  hop.csmaUs = std::min<int64_t> (m_txCsmaTime.GetMicroSeconds (), 0xffffffff);
+  if (pathTag.SetHop (hop))
+    {
+      m_txPkt->ReplacePacketTag (pathTag);
+    }
+}
+void
+LrWpanMac::PrintPathBreakdown (std::ostream &os) const
+{
+  std::ios::fmtflags flags = os.flags ();
+  os << std::fixed << std::setprecision (3);
+  os << "Path breakdown at " << m_shortAddress << ": " << m_pathPackets << " packets";
+  if (m_pathPackets > 0)
+    {
+      os << ", end-to-end " << 1e3 * m_pathDelaySum / m_pathPackets << " ms, queue and CSMA/CA "
+         << 1e3 * m_pathRecordedSum / m_pathPackets << " ms, airtime, ACK wait and retransmissions "
+         << 1e3 * (m_pathDelaySum - m_pathRecordedSum) / m_pathPackets << " ms per packet";
+    }
+  os << std::endl;
+  os << std::setw (6) << "depth" << std::setw (10) << "hops" << std::setw (12) << "queue ms"
+     << std::setw (12) << "csma ms" << std::setw (10) << "retries" << std::endl;
+  for (std::map<uint16_t, PathDepthStats>::const_iterator i = m_pathStats.begin (); i != m_pathStats.end (); ++i)
+    {
+      const PathDepthStats &stats = i->second;
+      os << std::setw (6) << i->first << std::setw (10) << stats.hops
+         << std::setw (12) << stats.queueUs / stats.hops / 1e3
+         << std::setw (12) << stats.csmaUs / stats.hops / 1e3
+         << std::setw (10) << static_cast<double> (stats.retries) / stats.hops << std::endl;
+    }
+  os.flags (flags);
+}
+uint32_t
+LrWpanMac::GetForwardedFrames (void) const
+{
+  return m_forwardedFrames;
+}
+uint32_t
+LrWpanMac::GetControlFrames (L2R_MsgType type) const
+{
+  switch (type)
+    {
+    case TC_IE:
+      return m_tcIeFrames;
+    case L2R_D_IE:
+      return m_dIeFrames;
+    case NLM_IE:
+      return m_nlmFrames;
+    default:
+      return 0;
+    }
+}
+bool
+LrWpanMac::IsMeshRoot (void) const
+{
+  return m_isSink;
+}
+Mac16Address
+LrWpanMac::GetRootAddress (void) const
+{
+  return m_rootAddress;
+}
+uint32_t
+LrWpanMac::GetParentSwitchesHeld (void) const
+{
+  return m_parentSwitchesHeld;
+}
+uint8_t
+LrWpanMac::GetTcieInterval (void) const
+{
+  return m_tcieInterval;
+}
+uint32_t
+LrWpanMac::GetTcieAdaptations (void) const
+{
+  return m_tcieAdaptations;
+}
+Mac16Address
+LrWpanMac::GetParent (void) const
+{
+  return m_parent;
+}
+const L2R_LinkEstimator &
+LrWpanMac::GetLinkEstimator (void) const
+{
+  return m_linkEstimator;
+}
+const std::map<Mac16Address, uint16_t> &
+LrWpanMac::GetRootPqm (void) const
+{
+  return m_rootPqm;
+}
+uint32_t
+LrWpanMac::GetParentChanges (void) const
+{
+  return m_parentChanges;
+}
+uint64_t
+LrWpanMac::GetPiggybackUpdates (void) const
+{
+  return m_piggybackUpdates;
+}
+uint64_t
+LrWpanMac::GetAggregateFrames (void) const
+{
+  return m_aggFrames;
+}
+uint64_t
+LrWpanMac::GetAggregatedPackets (void) const
+{
+  return m_aggPackets;
+}
+uint32_t
+LrWpanMac::GetDropCount (L2R_DropReason reason) const
+{
+  NS_ASSERT (reason < L2R_DROP_REASON_COUNT);
+  return m_drops[reason];
+}
+std::string
+LrWpanMac::GetDropReasonName (L2R_DropReason reason)
+{
+  switch (reason)
+    {
+    case L2R_DROP_QUEUE_FULL:
+      return "QueueFull";
+    case L2R_DROP_RX_QUEUE_FULL:
+      return "RxQueueFull";
+    case L2R_DROP_NO_ROUTE:
+      return "NoRoute";
+    case L2R_DROP_CHANNEL_ACCESS:
+      return "ChannelAccess";
+    case L2R_DROP_RETRIES:
+      return "Retries";
+    case L2R_DROP_PHY_TX:
+      return "PhyTx";
+    case L2R_DROP_FCS:
+      return "Fcs";
+    case L2R_DROP_PHY_RX:
+      return "PhyRx";
+    default:
+      return "Unknown";
+    }
+}
+void
+LrWpanMac::L2R_Drop (Ptr<const Packet> p, L2R_DropReason reason)
+{
+  NS_LOG_FUNCTION (this << p << GetDropReasonName (reason));
+  ++m_drops[reason];
+  m_l2rDropTrace (p, reason);
+}
+void
+LrWpanMac::PhyRxDrop (Ptr<const Packet> p)
+{
+  L2R_Drop (p, L2R_DROP_PHY_RX);
+}
 uint32_t
 LrWpanMac::GetPacketDroppedByQueue(void)
 {
@@ -2388,6 +4228,10 @@ LrWpanMac::outputRoutesTree(Ptr<OutputStreamWrapper> stream)
 void 
 LrWpanMac::OutputTree(Ptr<Packet> p, Time t,McpsDataRequestParams params)
 {
+  if (!m_stream)
+    {
+      return;
+    }
   *m_stream->GetStream () << t.GetSeconds () <<" Node Generate Packet number: " << p->GetUid() 
                             <<" Sending From: " << m_shortAddress << " To: "<< params.m_dstAddr 
                             <<" Node Queue Size: " << m_queueSize << std::endl;
@@ -2419,4 +4263,252 @@ LrWpanMac::GetAQueueSize(void) const
 {
   return m_queueSize;
 }
+bool LrWpanEventProfiler::s_enabled = false;
+LrWpanEventProfiler::Stats LrWpanEventProfiler::s_stats[LrWpanEventProfiler::TAG_COUNT];
+
+/**
+ * Runs a wrapped event and charges its wall time to the scheduling tag.
+ */
+class LrWpanProfiledEvent : public EventImpl
+{
+public:
+  LrWpanProfiledEvent (LrWpanEventProfiler::Tag tag, const Ptr<EventImpl> &event)
+    : m_tag (tag),
+      m_event (event)
+  {
+  }
+
+private:
+  virtual void Notify (void)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    m_event->Invoke ();
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now () - start;
+    LrWpanEventProfiler::Stats &stats = LrWpanEventProfiler::s_stats[m_tag];
+    ++stats.executed;
+    stats.wallNs += std::chrono::duration<double, std::nano> (elapsed).count ();
+  }
+  LrWpanEventProfiler::Tag m_tag;
+  Ptr<EventImpl> m_event;
+};
+
+void
+LrWpanEventProfiler::Enable (bool enable)
+{
+  s_enabled = enable;
+}
+
+bool
+LrWpanEventProfiler::IsEnabled (void)
+{
+  return s_enabled;
+}
+
+void
+LrWpanEventProfiler::Reset (void)
+{
+  for (uint32_t t = 0; t < TAG_COUNT; t++)
+    {
+      s_stats[t] = Stats ();
+    }
+}
+
+std::string
+LrWpanEventProfiler::GetTagName (Tag tag)
+{
+  switch (tag)
+    {
+    case MAC_STATE:
+      return "MacState";
+    case MAC_SEND_ACK:
+      return "MacSendAck";
+    case MAC_ACK_TIMEOUT:
+      return "MacAckTimeout";
+    case L2R_DISCOVERY_TX:
+      return "L2rDiscoveryTx";
+    case L2R_TCIE_TX:
+      return "L2rTcieTx";
+    case L2R_TCIE_REBROADCAST:
+      return "L2rTcieRebroadcast";
+    case L2R_DATA_FORWARD_TX:
+      return "L2rDataForwardTx";
+    case L2R_NLM_TX:
+      return "L2rNlmTx";
+    case L2R_PRINT_TABLE:
+      return "L2rPrintTable";
+    case APP_DATA_TX:
+      return "AppDataTx";
+    case L2R_DEFERRED_RUN:
+      return "L2rDeferredRun";
+    case L2R_BP_RELEASE:
+      return "L2rBackpressureRelease";
+    case L2R_NLM_HOLDOFF:
+      return "L2rNlmHoldoff";
+    case L2R_AGG_FLUSH:
+      return "L2rAggregateFlush";
+    default:
+      return "Unknown";
+    }
+}
+
+EventId
+LrWpanEventProfiler::Schedule (Tag tag, Time const &delay, const Ptr<EventImpl> &event)
+{
+  if (!s_enabled)
+    {
+      return Simulator::Schedule (delay, event);
+    }
+  NS_ASSERT (tag < TAG_COUNT);
+  ++s_stats[tag].scheduled;
+  if (delay.IsZero ())
+    {
+      ++s_stats[tag].zeroDelay;
+    }
+  return Simulator::Schedule (delay, Ptr<EventImpl> (new LrWpanProfiledEvent (tag, event), false));
+}
+
+void
+LrWpanEventProfiler::CountDirect (Tag tag)
+{
+  if (s_enabled)
+    {
+      NS_ASSERT (tag < TAG_COUNT);
+      ++s_stats[tag].direct;
+    }
+}
+
+void
+LrWpanEventProfiler::Report (std::ostream &os)
+{
+  uint64_t scheduled = 0;
+  double wallNs = 0;
+  for (uint32_t t = 0; t < TAG_COUNT; t++)
+    {
+      scheduled += s_stats[t].scheduled;
+      wallNs += s_stats[t].wallNs;
+    }
+  std::ios::fmtflags flags = os.flags ();
+  os << "Event profile: " << scheduled << " tagged of " << Simulator::GetEventCount ()
+     << " executed simulator events" << std::endl;
+  os << std::left << std::setw (20) << "tag" << std::right << std::setw (12) << "scheduled"
+     << std::setw (10) << "share" << std::setw (12) << "zeroDelay" << std::setw (10) << "direct"
+     << std::setw (12) << "executed"
+     << std::setw (12) << "wall ms" << std::setw (10) << "ns/event" << std::endl;
+  os << std::fixed;
+  for (uint32_t t = 0; t < TAG_COUNT; t++)
+    {
+      const Stats &stats = s_stats[t];
+      if (stats.scheduled == 0 && stats.direct == 0)
+        {
+          continue;
+        }
+      os << std::left << std::setw (20) << GetTagName (static_cast<Tag> (t)) << std::right
+         << std::setw (12) << stats.scheduled
+         << std::setprecision (1) << std::setw (9) << (scheduled ? 100.0 * stats.scheduled / scheduled : 0) << "%"
+         << std::setprecision (3) << std::setw (12)
+         << (stats.scheduled ? static_cast<double> (stats.zeroDelay) / stats.scheduled : 0)
+         << std::setw (10) << stats.direct
+         << std::setw (12) << stats.executed
+         << std::setprecision (1) << std::setw (12) << stats.wallNs / 1e6
+         << std::setprecision (0) << std::setw (10) << (stats.executed ? stats.wallNs / stats.executed : 0)
+         << std::endl;
+    }
+  os << "Total handler wall time " << std::setprecision (1) << wallNs / 1e6 << " ms" << std::endl;
+  os.flags (flags);
+}
+
+uint32_t LrWpanDiagChannel::s_perSecond = 10;
+uint32_t LrWpanDiagChannel::s_sampleEvery = 1000;
+std::ostream *LrWpanDiagChannel::s_stream = &std::cout;
+LrWpanDiagChannel::Counters LrWpanDiagChannel::s_counters[LrWpanDiagChannel::MESSAGE_COUNT];
+
+void
+LrWpanDiagChannel::Configure (uint32_t perSecond, uint32_t sampleEvery)
+{
+  s_perSecond = perSecond;
+  s_sampleEvery = sampleEvery;
+}
+
+void
+LrWpanDiagChannel::SetStream (std::ostream *os)
+{
+  s_stream = os;
+}
+
+std::ostream &
+LrWpanDiagChannel::GetStream (void)
+{
+  return *s_stream;
+}
+
+bool
+LrWpanDiagChannel::Accept (Message message)
+{
+  NS_ASSERT (message < MESSAGE_COUNT);
+  Counters &counters = s_counters[message];
+  int64_t window = Simulator::Now ().GetTimeStep () / Seconds (1).GetTimeStep ();
+  if (window != counters.window)
+    {
+      counters.window = window;
+      counters.inWindow = 0;
+    }
+  bool print;
+  if (counters.inWindow < s_perSecond)
+    {
+      ++counters.inWindow;
+      print = true;
+    }
+  else
+    {
+      ++counters.overLimit;
+      print = s_sampleEvery > 0 && counters.overLimit % s_sampleEvery == 0;
+    }
+  if (print)
+    {
+      ++counters.printed;
+    }
+  else
+    {
+      ++counters.suppressed;
+    }
+  return print;
+}
+
+std::string
+LrWpanDiagChannel::GetMessageName (Message message)
+{
+  switch (message)
+    {
+    case RX_QUEUE_DROP:
+      return "RxQueueDrop";
+    case TX_ACKED:
+      return "TxAcked";
+    case NO_ANCESTOR:
+      return "NoAncestor";
+    default:
+      return "Unknown";
+    }
+}
+
+void
+LrWpanDiagChannel::Report (std::ostream &os)
+{
+  os << "Diagnostics: at most " << s_perSecond << " per second";
+  if (s_sampleEvery > 0)
+    {
+      os << ", then 1 in " << s_sampleEvery;
+    }
+  os << std::endl;
+  for (uint32_t m = 0; m < MESSAGE_COUNT; m++)
+    {
+      const Counters &counters = s_counters[m];
+      if (counters.printed + counters.suppressed == 0)
+        {
+          continue;
+        }
+      os << std::left << std::setw (14) << GetMessageName (static_cast<Message> (m)) << std::right
+         << " printed " << counters.printed << ", suppressed " << counters.suppressed << std::endl;
+    }
+}
+
 } // namespace ns3
@@ -29,6 +29,7 @@
 #include <ns3/object.h>
 #include <ns3/traced-callback.h>
 #include <ns3/traced-value.h>
+#include <ns3/tag.h>
 #include <ns3/mac16-address.h>
 #include <ns3/mac64-address.h>
 #include <ns3/sequence-number.h>
@@ -39,9 +40,12 @@
 #include <ns3/packet.h>
 #include <cassert>
 #include <map>
+#include <vector>
 #include <sys/types.h>
 #include "ns3/output-stream-wrapper.h"
 #include "ns3/timer.h"
+#include "ns3/simulator.h"
+#include "ns3/make-event.h"
 #include "ns3/random-variable-stream.h"
 #include "queue"
 namespace ns3 {
@@ -234,12 +238,198 @@ typedef Callback<void, McpsDataIndicationParams, Ptr<Packet>> McpsDataIndication
 //AM: modified on 30/12
 typedef Callback<void, McpsDataIndicationParams,uint16_t ,uint16_t, Mac16Address> L2rReceiveUpdateCallback;
 typedef Callback<void,MeshRootData,Mac16Address> meshRootRxMsgCallback;
+/**
+ * \ingroup lr-wpan
+ *
+ * Called with the sender and the payload of a received L2R_AGG_RECORD
+ * frame, L2R header removed. The MAC does not forward these frames.
+ */
+typedef Callback<void, Mac16Address, Ptr<Packet> > L2rRecordCallback;
 /**
  * \ingroup lr-wpan
  *
  * Class that implements the LR-WPAN Mac state machine
  */
 
+/**
+ * \ingroup lr-wpan
+ *
+ * Opt-in profiler for the events scheduled by the MAC, the L2R protocol
+ * and the L2R application.
+ *
+ * Every scheduling site goes through Schedule() with a tag naming the
+ * call site. While enabled, each event is wrapped so its handler is
+ * timed, and Report() lists, per tag, the events scheduled, the share
+ * with zero delay, the events executed and their total handler wall time.
+ * Continuations run directly by LrWpanMac::L2R_Dispatch are counted per
+ * tag as well; their wall time is charged to the enclosing handler.
+ * While disabled the funnel costs one branch over Simulator::Schedule.
+ * Events scheduled by Timer objects are not tagged.
+ */
+class LrWpanEventProfiler
+{
+public:
+  /// Call sites of scheduled events
+  enum Tag
+  {
+    MAC_STATE = 0,        //!< SetLrWpanMacState
+    MAC_SEND_ACK,         //!< SendAck after a received frame
+    MAC_ACK_TIMEOUT,      //!< AckWaitTimeout
+    L2R_DISCOVERY_TX,     //!< McpsDataRequest of a D-IE
+    L2R_TCIE_TX,          //!< McpsDataRequest from L2R_SendPeriodicUpdate
+    L2R_TCIE_REBROADCAST, //!< L2R_SendPeriodicUpdate from RecieveL2RPacket
+    L2R_DATA_FORWARD_TX,  //!< McpsDataRequest of a forwarded data frame
+    L2R_NLM_TX,           //!< McpsDataRequest of an NLM-IE
+    L2R_PRINT_TABLE,      //!< PrintRoutingTable
+    APP_DATA_TX,          //!< McpsDataRequest from the L2R application
+    L2R_DEFERRED_RUN,     //!< Deferred continuations waiting for a MAC state change
+    L2R_BP_RELEASE,       //!< L2R_BackpressureRelease
+    L2R_NLM_HOLDOFF,      //!< L2R_SendPendingNlm after NlmMinInterval
+    L2R_AGG_FLUSH,        //!< L2R_FlushAggregate after AggregationMaxHold
+    TAG_COUNT
+  };
+
+  /**
+   * \param enable true to wrap and time events scheduled from now on
+   */
+  static void Enable (bool enable);
+  static bool IsEnabled (void);
+  /// Clear all counters
+  static void Reset (void);
+  /**
+   * Print one line per tag with scheduled, zero delay, executed and wall time
+   * \param os the output stream
+   */
+  static void Report (std::ostream &os);
+  static std::string GetTagName (Tag tag);
+
+  /**
+   * Schedule an event on behalf of a tagged call site
+   * \param tag the call site
+   * \param delay the delay, zero for the ScheduleNow equivalent
+   * \param event the event to run
+   * \returns the id of the scheduled event
+   */
+  static EventId Schedule (Tag tag, Time const &delay, const Ptr<EventImpl> &event);
+  /**
+   * Count a zero-delay continuation of a tagged call site that was run
+   * directly instead of being scheduled
+   * \param tag the call site
+   */
+  static void CountDirect (Tag tag);
+  template <typename MEM, typename OBJ>
+  static EventId Schedule (Tag tag, Time const &delay, MEM mem_ptr, OBJ obj)
+  {
+    return Schedule (tag, delay, MakeEvent (mem_ptr, obj));
+  }
+  template <typename MEM, typename OBJ, typename T1>
+  static EventId Schedule (Tag tag, Time const &delay, MEM mem_ptr, OBJ obj, T1 a1)
+  {
+    return Schedule (tag, delay, MakeEvent (mem_ptr, obj, a1));
+  }
+  template <typename MEM, typename OBJ, typename T1, typename T2>
+  static EventId Schedule (Tag tag, Time const &delay, MEM mem_ptr, OBJ obj, T1 a1, T2 a2)
+  {
+    return Schedule (tag, delay, MakeEvent (mem_ptr, obj, a1, a2));
+  }
+  template <typename MEM, typename OBJ, typename T1, typename T2, typename T3>
+  static EventId Schedule (Tag tag, Time const &delay, MEM mem_ptr, OBJ obj, T1 a1, T2 a2, T3 a3)
+  {
+    return Schedule (tag, delay, MakeEvent (mem_ptr, obj, a1, a2, a3));
+  }
+
+private:
+  friend class LrWpanProfiledEvent;
+  /// Counters of one tag
+  struct Stats
+  {
+    uint64_t scheduled;
+    uint64_t zeroDelay;
+    uint64_t direct;
+    uint64_t executed;
+    double wallNs;
+  };
+  static bool s_enabled;
+  static Stats s_stats[TAG_COUNT];
+};
+
+/**
+ * \ingroup lr-wpan
+ *
+ * Rate-limited console diagnostics of the MAC and L2R hot paths.
+ *
+ * Each kind of message may print at most a configured number of times
+ * per simulated second; beyond that only one in every sampleEvery
+ * messages prints. Printed and suppressed messages are counted per kind
+ * and listed by Report(). Use it through LRWPAN_DIAG so the message is
+ * only formatted when it is printed.
+ */
+class LrWpanDiagChannel
+{
+public:
+  /// Kinds of diagnostic messages
+  enum Message
+  {
+    RX_QUEUE_DROP = 0, //!< data frame refused at reception, the TX queue is full
+    TX_ACKED,          //!< acknowledged frame confirmed to the upper layer
+    NO_ANCESTOR,       //!< OutputRoute found no usable next hop
+    MESSAGE_COUNT
+  };
+
+  /**
+   * \param perSecond messages of each kind printed per simulated second
+   * \param sampleEvery over the limit, print one message in this many; 0 prints none
+   */
+  static void Configure (uint32_t perSecond, uint32_t sampleEvery);
+  /**
+   * \param os the stream messages are printed to, std::cout by default
+   */
+  static void SetStream (std::ostream *os);
+  static std::ostream & GetStream (void);
+  /**
+   * Count a message and decide whether it is printed
+   * \param message the kind of message
+   * \returns true if the caller should print it
+   */
+  static bool Accept (Message message);
+  /**
+   * Print the printed and suppressed messages of each kind
+   * \param os the output stream
+   */
+  static void Report (std::ostream &os);
+  static std::string GetMessageName (Message message);
+
+private:
+  /// Counters of one kind of message
+  struct Counters
+  {
+    int64_t window;    //!< simulated second of inWindow
+    uint32_t inWindow; //!< messages seen in that second
+    uint64_t overLimit;
+    uint64_t printed;
+    uint64_t suppressed;
+  };
+  static uint32_t s_perSecond;
+  static uint32_t s_sampleEvery;
+  static std::ostream *s_stream;
+  static Counters s_counters[MESSAGE_COUNT];
+};
+
+/**
+ * Print to the LrWpanDiagChannel if the rate limit of message allows it.
+ * \param message an LrWpanDiagChannel::Message without the class prefix
+ * \param expr the stream expression to print
+ */
+#define LRWPAN_DIAG(message, expr)                                                \
+  do                                                                            \
+    {                                                                           \
+      if (LrWpanDiagChannel::Accept (LrWpanDiagChannel::message))               \
+        {                                                                       \
+          LrWpanDiagChannel::GetStream () << expr << '\n';                      \
+        }                                                                       \
+    }                                                                           \
+  while (false)
+
 //AM: modified at 7/11
 
 enum L2R_MsgType
@@ -248,7 +438,38 @@ enum L2R_MsgType
   L2R_D_IE = 1,
   DataHeader = 2,
   NLM_IE = 3,
-  NotL2R = 4
+  NotL2R = 4,
+  // 5 is a DataHeader with a hop load on the air, see L2R_Header::SetHopLoad
+  L2R_AGGREGATE = 6, //!< several data frames for one next hop, see LrWpanMac Aggregation
+  L2R_AGG_RECORD = 7 //!< partial aggregate of a subtree, handed to the L2rRecordCallback
+};
+
+/**
+ * Why a frame was dropped, see LrWpanMac::GetDropCount and the L2rDrop
+ * trace source
+ */
+enum L2R_DropReason
+{
+  L2R_DROP_QUEUE_FULL = 0,  //!< data frame refused by McpsDataRequest, the TX queue is full
+  L2R_DROP_RX_QUEUE_FULL,   //!< data frame refused at reception, the TX queue is full
+  L2R_DROP_NO_ROUTE,        //!< data frame with no next hop (00:00), with DropNoRoute
+  L2R_DROP_CHANNEL_ACCESS,  //!< CSMA/CA found no clear channel
+  L2R_DROP_RETRIES,         //!< no ACK after the maximum number of retransmissions
+  L2R_DROP_PHY_TX,          //!< the PHY failed to send the frame
+  L2R_DROP_FCS,             //!< received frame with a bad FCS
+  L2R_DROP_PHY_RX,          //!< dropped by the PHY at reception, e.g. a collision
+  L2R_DROP_REASON_COUNT
+};
+
+/**
+ * How OutputRoute picks the next hop of data frames, see the
+ * ForwardingMode attribute of LrWpanMac
+ */
+enum L2R_ForwardingMode
+{
+  L2R_SINGLE_PATH = 0,  //!< the lowest-PQM ancestor within the LQT
+  L2R_MULTIPATH,        //!< weighted round-robin over the ancestors within the LQT
+  L2R_BACKPRESSURE      //!< the ancestor with the largest queue differential
 };
 class L2R_Header : public Header 
 {
@@ -275,6 +496,20 @@ public:
   void SetDelay(uint32_t delay);
   void SetArrivalRate(uint32_t arrivalRate);
   void SetSrcMacAddress (Mac16Address srcAddress);
+  /**
+   * Add the load of the node sending a data frame, rewritten at every
+   * hop. On the air the frame type becomes 5 and the header grows by
+   * 4 bytes; the other fields keep describing the source.
+   * \param pqm the PQM of the sending node
+   * \param queueSize the TX queue size of the sending node
+   */
+  void SetHopLoad (uint16_t pqm, uint16_t queueSize);
+  /**
+   * Set the sizes of the data frames following an L2R_AGGREGATE header,
+   * one byte each.
+   * \param lengths the sizes in order
+   */
+  void SetAggregateLengths (const std::vector<uint8_t> &lengths);
   /**
    * Get the header data.
    * \return The data.
@@ -290,6 +525,11 @@ public:
   uint32_t GetDelay(void) const;
   uint32_t GetArrivalRate(void) const;
   Mac16Address GetSrcAddress (void) const;
+  /// \returns true if SetHopLoad was called or the frame carried a hop load
+  bool HasHopLoad (void) const;
+  uint16_t GetHopPqm (void) const;
+  uint16_t GetHopQueueSize (void) const;
+  const std::vector<uint8_t> &GetAggregateLengths (void) const;
   /**
    * \brief Get the type ID.
    * \return the object TypeId
@@ -312,9 +552,90 @@ private:
   uint32_t m_arrivalRate;
   uint32_t m_avgDelay; 
   Mac16Address m_srcAddress;
+  bool m_hopLoad;
+  uint16_t m_hopPqm;
+  uint16_t m_hopQueueSize;
+  std::vector<uint8_t> m_aggLengths;
   
 };
 
+/**
+ * Path record of a data packet, see the PathRecord attribute of
+ * LrWpanMac. The source stamps the creation time and every node that
+ * sends the packet adds one record of 12 bytes: its address and depth,
+ * the time the packet waited in its TX queue, the time spent in CSMA/CA
+ * and the number of retransmissions.
+ */
+class L2R_PathTag : public Tag
+{
+public:
+  /// The record of one hop
+  struct Hop
+  {
+    Mac16Address address;
+    uint8_t depth;
+    uint8_t retries;
+    uint32_t queueUs; //!< TX queue sojourn in microseconds
+    uint32_t csmaUs;  //!< CSMA/CA time of all attempts in microseconds
+  };
+  /// Records beyond this many hops are not kept
+  static const uint8_t MAX_HOPS = 16;
+
+  L2R_PathTag ();
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (TagBuffer i) const;
+  virtual void Deserialize (TagBuffer i);
+  virtual void Print (std::ostream &os) const;
+
+  void SetOrigin (Time origin);
+  Time GetOrigin (void) const;
+  /**
+   * Add the record of a hop. A record of the same address at the end of
+   * the path, written by an earlier attempt, is replaced.
+   * \param hop the record
+   * \returns false if the path is already MAX_HOPS long
+   */
+  bool SetHop (const Hop &hop);
+  const std::vector<Hop> & GetHops (void) const;
+
+private:
+  int64_t m_origin; //!< creation time in nanoseconds
+  std::vector<Hop> m_hops;
+};
+
+/**
+ * Packet uids of the data frames an L2R_AGGREGATE frame carries. After
+ * deaggregation each frame carries a tag with its own uid, so the delay
+ * bookkeeping and the route tree trace keep the uid the source used.
+ */
+class L2R_UidTag : public Tag
+{
+public:
+  L2R_UidTag ();
+  /**
+   * \param uids the packet uids, one per frame of the aggregate
+   */
+  L2R_UidTag (const std::vector<uint64_t> &uids);
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (TagBuffer i) const;
+  virtual void Deserialize (TagBuffer i);
+  virtual void Print (std::ostream &os) const;
+
+  const std::vector<uint64_t> & GetUids (void) const;
+  /**
+   * \param p a data frame
+   * \returns the uid the frame had at its source
+   */
+  static uint64_t GetOriginalUid (Ptr<const Packet> p);
+
+private:
+  std::vector<uint64_t> m_uids;
+};
+
 
 
 enum RouteFlags
@@ -336,13 +657,22 @@ public:
   ~L2R_RoutingTableEntry ();
   /**
    * Get destination MAC address
-   * \returns the destination MAC address (usually Sink node)
+   * \returns the mesh root the neighbor routes to
    */
   Mac16Address
   GetDestination () const
   {
     return m_dst;
   }
+  /**
+   * Set destination MAC address
+   * \param dst the mesh root the neighbor routes to
+   */
+  void
+  SetDestination (Mac16Address dst)
+  {
+    m_dst = dst;
+  }
   /**
    * Get route
    * \returns the IPv4 route
@@ -513,6 +843,24 @@ public:
    */
   void
   Print (Ptr<OutputStreamWrapper> stream) const;
+  /**
+   * \returns the number of bytes written by Serialize
+   */
+  static uint32_t
+  GetSerializedSize (void);
+  /**
+   * Write the entry into a checkpoint. The lifetime is stored as the age
+   * of the entry, so the entry can be restored at any simulation time.
+   * \param start the buffer position to write at, advanced past the entry
+   */
+  void
+  Serialize (Buffer::Iterator &start) const;
+  /**
+   * Read an entry written by Serialize
+   * \param start the buffer position to read at, advanced past the entry
+   */
+  void
+  Deserialize (Buffer::Iterator &start);
   uint8_t
   GetL2rMissedTcIe () 
   {
@@ -665,6 +1013,24 @@ public:
    */
   void
   Print (Ptr<OutputStreamWrapper> stream) const;
+  /**
+   * \returns the number of bytes written by Serialize
+   */
+  uint32_t
+  GetSerializedSize (void) const;
+  /**
+   * Write all entries into a checkpoint
+   * \param start the buffer position to write at, advanced past the table
+   */
+  void
+  Serialize (Buffer::Iterator &start) const;
+  /**
+   * Replace all entries with the ones written by Serialize. Pending
+   * update events are dropped.
+   * \param start the buffer position to read at, advanced past the table
+   */
+  void
+  Deserialize (Buffer::Iterator &start);
   /**
    * Provides the number of routes present in that nodes routing table.
    * \returns the number of routes
@@ -741,6 +1107,89 @@ private:
 
 };
 
+/**
+ * \ingroup l2r
+ * \brief Per-neighbor link quality measured by the L2R MAC
+ *
+ * The ETX of a neighbor is the number of transmission attempts per
+ * acknowledged unicast frame, taken over windows of frames and smoothed
+ * across windows. Until a window has closed it falls back to the share
+ * of the mesh root's TC-IE that arrive through the neighbor, counted from
+ * gaps in their MSN. That share also drops with every loss between the
+ * root and the neighbor, so it is an end-to-end approximation that can
+ * only overstate the ETX of a neighbor deeper than 0. The LQI of the
+ * frames received from the neighbor is smoothed the same way.
+ */
+class L2R_LinkEstimator
+{
+public:
+  L2R_LinkEstimator ();
+  /**
+   * \param window unicast frames per ETX window
+   * \param alpha weight of the newest sample in every moving average
+   * \param maxEtx ETX of a window without any acknowledgment
+   */
+  void SetParameters (uint32_t window, double alpha, double maxEtx);
+  /**
+   * Count a unicast frame that left the TX queue.
+   * \param neighbor its destination
+   * \param attempts transmissions it took, retries included
+   * \param acked true if it was acknowledged
+   * \returns true if this closed a window, so the ETX changed
+   */
+  bool NotifyTx (Mac16Address neighbor, uint32_t attempts, bool acked);
+  /**
+   * Count a TC-IE of the mesh root rebroadcast by a neighbor.
+   * \param neighbor the sender
+   * \param msn its MSN, 0x00 to 0xf0
+   */
+  void NotifyTcIe (Mac16Address neighbor, uint16_t msn);
+  /**
+   * \param neighbor the sender of a received frame
+   * \param lqi its link quality indication
+   */
+  void NotifyLqi (Mac16Address neighbor, uint8_t lqi);
+  /**
+   * \param neighbor a neighbor
+   * \returns its ETX, 1 for a neighbor not measured yet
+   */
+  double GetEtx (Mac16Address neighbor) const;
+  /**
+   * \param neighbor a neighbor
+   * \returns its mean LQI, 255 for a neighbor not heard yet
+   */
+  double GetLqi (Mac16Address neighbor) const;
+  /**
+   * \param neighbor a neighbor
+   * \returns the fraction of the mesh root's TC-IE received from it, end
+   * to end, 1 if unknown
+   */
+  double GetTcIeDeliveryRatio (Mac16Address neighbor) const;
+  /// Forget all neighbors
+  void Clear (void);
+
+private:
+  /// What is known about the link to one neighbor
+  struct Link
+  {
+    Link ();
+    uint32_t frames;     //!< unicast frames of the current window
+    uint32_t attempts;   //!< their transmission attempts
+    uint32_t acked;      //!< the ones acknowledged
+    double etx;          //!< smoothed over the closed windows, 0 if none
+    uint16_t lastMsn;    //!< MSN of the last TC-IE, 0xffff if none
+    double tcIeRatio;    //!< smoothed end-to-end TC-IE delivery ratio, 0 if unknown
+    double lqi;          //!< smoothed LQI, negative if unknown
+  };
+  /// \returns the new average after a sample, the sample itself if first
+  double Smooth (double average, double sample, bool first) const;
+
+  std::map<Mac16Address, Link> m_links;
+  uint32_t m_window;
+  double m_alpha;
+  double m_maxEtx;
+};
+
 
 class LrWpanMac : public Object
 {
@@ -863,6 +1312,12 @@ public:
   //AM: modified on 30/12
   void SetL2rReceiveUpdateCallback (L2rReceiveUpdateCallback c);
   void SetMeshRootRxMsgUpdateCallback (meshRootRxMsgCallback c);
+  /**
+   * Set the callback for received L2R_AGG_RECORD frames.
+   *
+   * \param c the callback
+   */
+  void SetL2rRecordCallback (L2rRecordCallback c);
 
   /**
    * Set the callback for the confirmation of a data transmission request.
@@ -1069,6 +1524,15 @@ public:
    * \param [in] retries The number of retries.
    * \param [in] backoffs The number of CSMA backoffs.
    */
+  /**
+   * TracedCallback signature for L2R drops.
+   *
+   * \param [in] packet The dropped frame or MSDU.
+   * \param [in] reason Why it was dropped.
+   */
+  typedef void (* DropTracedCallback)
+    (Ptr<const Packet> packet, L2R_DropReason reason);
+
   typedef void (* SentTracedCallback)
     (Ptr<const Packet> packet, uint8_t retries, uint8_t backoffs);
 
@@ -1101,9 +1565,100 @@ public:
   uint16_t GetDepth(void) const;
   uint16_t GetPqm (void) const;
   uint32_t GetTotalPacketDroppedByQueue(void);
+  /**
+   * \param reason a drop reason
+   * \returns the number of frames this node dropped for that reason
+   */
+  uint32_t GetDropCount (L2R_DropReason reason) const;
+  /**
+   * \returns the value of the ForwardedFrames trace source
+   */
+  uint32_t GetForwardedFrames (void) const;
+  /**
+   * \param type TC_IE, L2R_D_IE or NLM_IE
+   * \returns the control frames of that type queued by this node
+   */
+  uint32_t GetControlFrames (L2R_MsgType type) const;
+  /**
+   * \returns the value of the ParentChanges trace source
+   */
+  uint32_t GetParentChanges (void) const;
+  /**
+   * \returns how often ParentSwitchMargin or ParentMinDwell kept the
+   * current parent over one with a lower PQM, counting each candidate
+   * once while it stays held back
+   */
+  uint32_t GetParentSwitchesHeld (void) const;
+  /**
+   * \returns true on a mesh root
+   */
+  bool IsMeshRoot (void) const;
+  /**
+   * \returns the mesh root of the current parent, this node on a mesh root
+   */
+  Mac16Address GetRootAddress (void) const;
+  /**
+   * \returns the lowest PQM through any neighbor to every mesh root heard
+   * of, as of the last parent selection
+   */
+  const std::map<Mac16Address, uint16_t> &GetRootPqm (void) const;
+  /**
+   * \returns the current parent, 00:00 if none
+   */
+  Mac16Address GetParent (void) const;
+  /**
+   * \returns the link measurements of this node, filled with LinkEstimation
+   */
+  const L2R_LinkEstimator &GetLinkEstimator (void) const;
+  /**
+   * \returns the TC-IE interval in seconds, as chosen by the mesh root
+   */
+  uint8_t GetTcieInterval (void) const;
+  /**
+   * \returns how often AdaptiveTcie changed the interval of this mesh root
+   */
+  uint32_t GetTcieAdaptations (void) const;
+  /**
+   * \param reason a drop reason
+   * \returns a short name of the reason, as used in the drop summary
+   */
+  static std::string GetDropReasonName (L2R_DropReason reason);
   uint32_t GetPacketDroppedByQueue(void);
   uint32_t GetTotalPacketSentByNode(void) const;
   uint32_t GetTotalPacketRxByMeshRoot(void) const;
+  /**
+   * Print, at the mesh root, the average hop records of the received
+   * data packets per depth of the sending node, see PathRecord.
+   * \param os the output stream
+   */
+  void PrintPathBreakdown (std::ostream &os) const;
+  /**
+   * \returns the data frames OutputRoute sent to each next hop
+   */
+  const std::map<Mac16Address, uint32_t> &GetParentShare (void) const;
+  /**
+   * Print the data frames sent to each next hop and their share.
+   * \param os the output stream
+   */
+  void PrintParentShare (std::ostream &os) const;
+  /**
+   * \returns the routing table entries refreshed from received or
+   * overheard data frames
+   */
+  uint64_t GetPiggybackUpdates (void) const;
+  /**
+   * \returns the aggregate frames queued by this node
+   */
+  uint64_t GetAggregateFrames (void) const;
+  /**
+   * \returns the data frames packed into them; the frames saved are
+   * GetAggregatedPackets () - GetAggregateFrames ()
+   */
+  uint64_t GetAggregatedPackets (void) const;
+  /**
+   * \returns the data frames held by Backpressure forwarding so far
+   */
+  uint64_t GetBackpressureHeldFrames (void) const;
   uint16_t GetQueueSize(void) const;
   uint16_t GetAQueueSize(void) const;
   uint32_t GetArrivalRate(void) const;
@@ -1119,6 +1674,48 @@ public:
   {
     m_lqt = lqt;
   }
+  /**
+   * \returns the number of bytes written by L2R_SaveCheckpoint
+   */
+  uint32_t L2R_GetCheckpointSize (void) const;
+  /**
+   * Write the converged L2R state of this node: role, depth, PQM, MSN,
+   * root address, the routing table and the phase of the periodic update
+   * timer.
+   * \param start the buffer position to write at, advanced past the state
+   */
+  void L2R_SaveCheckpoint (Buffer::Iterator &start) const;
+  /**
+   * Restore the state written by L2R_SaveCheckpoint, instead of running
+   * topology discovery. A running periodic update timer is rescheduled
+   * with the delay it had left when the checkpoint was taken.
+   * \param start the buffer position to read at, advanced past the state
+   */
+  void L2R_LoadCheckpoint (Buffer::Iterator &start);
+  /**
+   * Install a precomputed L2R state instead of running topology discovery,
+   * as computed by LrWpanHelper::BootstrapL2r. A sink also starts its
+   * periodic TC-IE timer, one interval from now.
+   * \param isSink true for the mesh root
+   * \param depth the node depth
+   * \param pqm the node path quality metric
+   * \param root the mesh root address
+   * \param lqt the link quality threshold
+   * \param tcieInterval the TC-IE interval in seconds
+   * \param entries one entry per neighbor
+   */
+  void L2R_SetBootstrapState (bool isSink, uint16_t depth, uint16_t pqm, Mac16Address root,
+                              uint16_t lqt, uint8_t tcieInterval,
+                              std::vector<L2R_RoutingTableEntry> &entries);
+  /**
+   * \returns the L2R routing table of this node
+   */
+  L2R_RoutingTable & GetRoutingTable (void);
+  /**
+   * \returns the number of zero-delay continuations run without an event,
+   * see the DirectDispatch attribute
+   */
+  uint64_t GetDirectDispatchCount (void) const;
   void IncQueue();
   void PrintEndtoEndDelay();
   //std::queue<uint64_t> m_l2rQueue;
@@ -1132,11 +1729,91 @@ private:
   bool m_isSink;
   uint16_t m_lqt;
   uint16_t m_msn;
-  uint16_t m_depth;
+  TracedValue<uint16_t> m_depth;
   uint8_t m_tcieInterval;
-  uint16_t m_pqm;
+  TracedValue<uint16_t> m_pqm;
   uint32_t m_tcieIncr;
+  Mac16Address m_parent; //!< neighbor that sets m_pqm, 00:00 if none
+  Time m_parentSince;    //!< when m_parent was set
+  uint16_t m_parentMargin;
+  Time m_parentMinDwell;
+  uint32_t m_parentSwitchesHeld; //!< better parents kept out by the hysteresis
+  Mac16Address m_heldCandidate;  //!< the one held back at the last selection, 00:00 if none
+  TracedValue<uint32_t> m_parentChanges;
+  TracedValue<uint32_t> m_queueOccupancy;  //!< m_txQueue.size ()
+  TracedValue<uint32_t> m_forwardedFrames; //!< data frames queued for the next hop
+  TracedValue<uint32_t> m_tcIeFrames;      //!< TC-IE frames queued
+  TracedValue<uint32_t> m_dIeFrames;       //!< D-IE frames queued
+  TracedValue<uint32_t> m_nlmFrames;       //!< NLM-IE frames queued
+  /**
+   * Take the routing table entry with the lowest PQM as parent and
+   * derive this node's PQM and depth from it. Ties keep the lowest
+   * address. While the current parent has an entry, it is only replaced
+   * by one lower by more than ParentSwitchMargin, and not before
+   * ParentMinDwell.
+   * \returns true if an entry was found
+   */
+  bool L2R_SelectParent (void);
+  /// Take the parent from installed state without counting a change
+  void L2R_RestoreParent (void);
+  /**
+   * Set the parent, counting a change of parent.
+   * \param parent the new parent
+   */
+  void L2R_SetParent (Mac16Address parent);
+  /**
+   * \param entry an ancestor
+   * \returns its Multipath weight, higher for a less loaded ancestor
+   */
+  double L2R_ParentWeight (L2R_RoutingTableEntry &entry) const;
+  /**
+   * Pick the next Multipath hop among the ancestors within the LQT.
+   * \param ancestors the routing table entries of lower depth
+   * \returns the next hop, 00:00 if no ancestor is within the LQT
+   */
+  Mac16Address L2R_MultipathNextHop (std::map<Mac16Address, L2R_RoutingTableEntry> &ancestors);
+  /**
+   * Pick the ancestor within the LQT with the largest non-negative
+   * difference between our backlog and its advertised queue, scaled by
+   * its link quality.
+   * \param ancestors the routing table entries of lower depth
+   * \param held true if the frame being routed is in the hold queue already
+   * \returns the next hop, 00:00 if every ancestor is more loaded than us
+   */
+  Mac16Address L2R_BackpressureNextHop (std::map<Mac16Address, L2R_RoutingTableEntry> &ancestors, bool held);
+  /**
+   * Hold a data frame while every ancestor is more loaded than this node.
+   * Frames already held keep their order, so a frame is also held while
+   * the hold queue is not empty.
+   * \param params the request parameters
+   * \param p the frame
+   * \returns true if the frame was held or dropped
+   */
+  bool L2R_BackpressureHold (const McpsDataRequestParams &params, Ptr<Packet> p);
+  /**
+   * Hand the held frames to McpsDataRequest, in order, as long as an
+   * ancestor is less loaded or the frame waited BackpressureMaxHold.
+   */
+  void L2R_BackpressureRelease (void);
+  /// A data frame held by Backpressure forwarding
+  struct HeldFrame
+  {
+    McpsDataRequestParams params;
+    Ptr<Packet> p;
+    Time since;   //!< time the frame was held
+  };
+  L2R_ForwardingMode m_forwardingMode;
+  Time m_bpRetry;               //!< time between two release attempts
+  Time m_bpMaxHold;             //!< longest time a frame is held
+  std::deque<HeldFrame> m_bpHold;
+  EventId m_bpReleaseEvent;
+  bool m_bpReleasing;           //!< McpsDataRequest is called by L2R_BackpressureRelease
+  uint64_t m_bpHeldFrames;      //!< data frames held at least once
+  std::map<Mac16Address, double> m_wrrCurrent;   //!< round-robin state of each ancestor
+  std::map<Mac16Address, uint32_t> m_parentShare; //!< data frames sent to each next hop
   Mac16Address m_rootAddress;
+  std::map<Mac16Address, uint16_t> m_rootPqm; //!< best PQM to each mesh root
+  std::map<Mac16Address, uint16_t> m_rootMsn; //!< latest TC-IE MSN of each mesh root
   Ptr<OutputStreamWrapper> m_stream;
   /// Timer to trigger periodic updates from a node
   Timer m_periodicUpdateTimer;
@@ -1156,6 +1833,169 @@ private:
   std::queue<Time> m_arrivalRateMovingAvg;
   uint8_t m_arrivalRateComplement;
   void SendNlmMsg();
+  /**
+   * Send an NLM-IE when the TX queue crosses NlmHighWatermark upwards or
+   * NlmLowWatermark downwards, at most one per NlmMinInterval.
+   */
+  void L2R_CheckCongestion (void);
+  /// Send the NLM-IE held back by NlmMinInterval
+  void L2R_SendPendingNlm (void);
+  /**
+   * \param msn the MSN of a received TC-IE
+   * \param last the latest MSN of the same mesh root
+   * \returns true if msn follows last, over the wrap from 0xef to 0xf0 to 0x00
+   */
+  static bool L2R_IsNewerMsn (uint16_t msn, uint16_t last);
+  /**
+   * On a mesh root, count a source whose data frame shows another depth
+   * or a PQM at least TciePqmSwing away from its previous one.
+   * \param source the source of the data frame
+   * \param depth its depth
+   * \param pqm its PQM
+   */
+  void L2R_NoteSourceState (Mac16Address source, uint16_t depth, uint16_t pqm);
+  /**
+   * Halve the TC-IE interval if the sources that changed since the last
+   * TC-IE reach TcieHighChurn, grow it by TcieGrowStep if they stay under
+   * TcieLowChurn, within TcieMinInterval and TcieMaxInterval.
+   */
+  void L2R_AdaptTcieInterval (void);
+  /**
+   * Feed the outcome of the unicast frame at the head of the TX queue to
+   * the link estimator, before it is removed.
+   * \param acked true if it was acknowledged
+   */
+  void L2R_NoteTxOutcome (bool acked);
+  /**
+   * \param neighbor a neighbor
+   * \returns the LQM added by its measured link, 0 without LinkEstimation
+   */
+  uint16_t L2R_LinkCost (Mac16Address neighbor) const;
+  /**
+   * L2R_ComputeLqm of the load a neighbor advertises plus L2R_LinkCost.
+   * \param neighbor the neighbor
+   * \param queue its queue over our maximum queue size
+   * \param interArrival its mean inter-arrival time in seconds
+   * \param delay its mean delay in seconds
+   * \returns the LQM of the neighbor
+   */
+  uint16_t L2R_NeighborLqm (Mac16Address neighbor, float queue, float interArrival, float delay) const;
+  /**
+   * Recompute the LQM and PQM of a neighbor's entry after its ETX changed.
+   * \param neighbor the neighbor
+   */
+  void L2R_RefreshLinkCost (Mac16Address neighbor);
+  /// What a mesh root last heard from a source, for AdaptiveTcie
+  struct TcieSourceState
+  {
+    uint16_t depth;
+    uint16_t pqm;
+    bool heard;   //!< a data frame arrived since the last TC-IE
+  };
+  /**
+   * Link quality metric of a neighbor from the load it advertises.
+   * \param queue its queue over our maximum queue size
+   * \param interArrival its mean inter-arrival time in seconds
+   * \param delay its mean delay in seconds
+   * \returns the LQM, at least 1
+   */
+  static uint16_t L2R_ComputeLqm (float queue, float interArrival, float delay);
+  /**
+   * Refresh the routing table entry of a neighbor from a data frame it
+   * sent: from the hop load if there is one, else from the source fields
+   * if the neighbor is the source.
+   * \param sender the MAC source of the frame
+   * \param header its L2R header
+   */
+  void L2R_UpdateFromData (Mac16Address sender, L2R_Header &header);
+  /**
+   * \param frame a frame with its MAC header
+   * \returns its L2R header
+   */
+  static L2R_Header L2R_PeekHeader (Ptr<const Packet> frame);
+  /**
+   * \param frame an L2R_AGGREGATE frame without MAC header
+   * \returns the data frames it carries
+   */
+  static std::vector<Ptr<Packet> > L2R_Deaggregate (Ptr<const Packet> frame);
+  /**
+   * Add a data frame to the aggregate of its next hop. The aggregate is
+   * queued when the frame does not fit or after AggregationMaxHold.
+   * \param params the request parameters
+   * \param p the data frame
+   */
+  void L2R_Aggregate (const McpsDataRequestParams &params, Ptr<Packet> p);
+  /**
+   * Queue the aggregate of a next hop; a single frame is queued as is.
+   * \param nextHop the next hop
+   */
+  void L2R_FlushAggregate (Mac16Address nextHop);
+  /// Data frames waiting to be aggregated for one next hop
+  struct AggregateBuffer
+  {
+    McpsDataRequestParams params; //!< parameters of the first frame
+    std::vector<Ptr<Packet> > packets;
+    uint32_t size;                //!< bytes of the aggregate so far
+    EventId flush;
+  };
+  bool m_aggregation;
+  uint32_t m_aggMaxSize;
+  Time m_aggMaxHold;
+  bool m_aggFlushing;            //!< McpsDataRequest is called by L2R_FlushAggregate
+  std::map<Mac16Address, AggregateBuffer> m_aggBuffers;
+  uint64_t m_aggFrames;
+  uint64_t m_aggPackets;
+  bool m_piggybackLoad;
+  bool m_overhear;
+  uint64_t m_piggybackUpdates;
+  bool m_nlmEnabled;
+  double m_nlmHigh;        //!< queue fraction that starts congestion
+  double m_nlmLow;         //!< queue fraction that ends congestion
+  Time m_nlmMinInterval;
+  bool m_nlmCongested;
+  Time m_lastNlm;          //!< time of the last NLM-IE, negative if none
+  EventId m_nlmHoldoff;
+  bool m_tcieAdaptive;
+  uint8_t m_tcieMin;
+  uint8_t m_tcieMax;
+  uint8_t m_tcieGrowStep;
+  double m_tcieHighChurn;
+  double m_tcieLowChurn;
+  uint16_t m_tciePqmSwing;
+  std::map<Mac16Address, TcieSourceState> m_tcieSources;
+  uint32_t m_tcieChanges;      //!< sources that changed since the last TC-IE
+  uint32_t m_tcieAdaptations;
+  bool m_linkEstimation;
+  uint32_t m_linkWindow;
+  double m_linkAlpha;
+  double m_linkMaxEtx;
+  double m_linkLqiWeight;      //!< LQM of a link at LQI 0, over one at 255
+  L2R_LinkEstimator m_linkEstimator;
+  /**
+   * Run a zero-delay continuation of an L2R handler. With DirectDispatch
+   * set and a handler running, it is queued and run when the outermost
+   * handler returns, otherwise it is scheduled as before.
+   * \param tag the call site
+   * \param event the continuation
+   * \returns the scheduled event, or an empty id if it was queued
+   */
+  EventId L2R_Dispatch (LrWpanEventProfiler::Tag tag, const Ptr<EventImpl> &event);
+  void L2R_EnterHandler (void);
+  void L2R_ExitHandler (void);
+  /// Run the queued continuations in order
+  void L2R_RunDeferred (void);
+  /// A continuation queued by L2R_Dispatch
+  struct DeferredEvent
+  {
+    LrWpanEventProfiler::Tag tag;
+    Ptr<EventImpl> event;
+    EventId after; //!< MAC state change that was pending when it was queued
+  };
+  bool m_directDispatch;
+  uint32_t m_handlerDepth;
+  std::deque<DeferredEvent> m_deferred;
+  EventId m_deferredRun;
+  uint64_t m_directDispatchCount;
   uint32_t m_internalLoad;
   uint16_t m_queueSize;
   std::map<uint64_t,double> m_totalPacketSendUid;
@@ -1173,8 +2013,30 @@ private:
   {
     uint8_t txQMsduHandle; //!< MSDU Handle
     Ptr<Packet> txQPkt;    //!< Queued packet
+    Time txQEnqueueTime;   //!< Time the packet was queued
   };
 
+  /**
+   * Add or update the record of this node in the path tag of m_txPkt.
+   */
+  void L2R_RecordHop (void);
+  /// Per-depth sums of the hop records decoded at the mesh root
+  struct PathDepthStats
+  {
+    uint64_t hops;
+    double queueUs;
+    double csmaUs;
+    uint64_t retries;
+  };
+  bool m_pathRecord;
+  Time m_txQueueSojourn; //!< TX queue sojourn of m_txPkt
+  Time m_txCsmaTime;     //!< CSMA/CA time spent on m_txPkt so far
+  Time m_txCsmaStart;    //!< Start of the current CSMA/CA attempt
+  std::map<uint16_t, PathDepthStats> m_pathStats;
+  uint64_t m_pathPackets;    //!< received data packets with a path tag
+  double m_pathDelaySum;     //!< sum of their end-to-end delay in seconds
+  double m_pathRecordedSum;  //!< sum of their queue and CSMA/CA time in seconds
+
   /**
    * Send an acknowledgment packet for the given sequence number.
    *
@@ -1295,6 +2157,37 @@ private:
    */
   TracedCallback<Ptr<const Packet> > m_macRxDropTrace;
 
+  /**
+   * The trace source fired for every drop counted in m_drops, with its
+   * reason.
+   */
+  TracedCallback<Ptr<const Packet>, L2R_DropReason> m_l2rDropTrace;
+
+  /**
+   * Frames dropped by this node, per reason.
+   */
+  uint32_t m_drops[L2R_DROP_REASON_COUNT];
+  bool m_dropNoRoute;
+
+  /**
+   * Count a drop and fire the L2rDrop trace source.
+   * \param p the dropped frame or MSDU
+   * \param reason why it was dropped
+   */
+  void L2R_Drop (Ptr<const Packet> p, L2R_DropReason reason);
+  /**
+   * Getter for the per-reason read-only attributes.
+   */
+  template <L2R_DropReason R>
+  uint32_t GetDrops (void) const
+  {
+    return m_drops[R];
+  }
+  /**
+   * Sink of the PHY PhyRxDrop trace source.
+   */
+  void PhyRxDrop (Ptr<const Packet> p);
+
   /**
    * A trace source that emulates a non-promiscuous protocol sniffer connected
    * to the device.  Unlike your average everyday sniffer, this trace source
@@ -1363,6 +2256,7 @@ private:
   //AM: modified on 30/12
   L2rReceiveUpdateCallback m_l2rReceiveUpdateCallback;
   meshRootRxMsgCallback m_meshRxMsgCallback;
+  L2rRecordCallback m_l2rRecordCallback;
   /**
    * This callback is used to report data transmission request status to the
    * upper layers.